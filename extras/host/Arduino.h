@@ -0,0 +1,100 @@
+//  Copyright (C) 2010 Georg Kaindl
+//  http://gkaindl.com
+//
+//  This file is part of Arduino EthernetBonjour3.
+//
+//  EthernetBonjour3 is free software: you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public License
+//  as published by the Free Software Foundation, either version 3 of
+//  the License, or (at your option) any later version.
+//
+//  EthernetBonjour3 is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with EthernetBonjour3. If not, see
+//  <http://www.gnu.org/licenses/>.
+//
+
+// just enough of the Arduino core to build the library on a PC, for the tools in
+// extras/tools. put extras/host on the include path before src.
+//
+// millis() and micros() follow a virtual clock that only moves when the host program
+// calls hostSetMicros(), so replays behave the same no matter how fast they run.
+// Serial discards everything unless hostSetSerialOutput() gives it a FILE*.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+
+#ifndef ARDUINO
+#define ARDUINO 100
+#endif
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define DEC 10
+#define HEX 16
+
+inline uint64_t& _hostClockMicros()
+{
+   static uint64_t now = 0;
+   return now;
+}
+
+inline void hostSetMicros(uint64_t now) { _hostClockMicros() = now; }
+inline uint64_t hostMicros() { return _hostClockMicros(); }
+
+inline unsigned long millis() { return (unsigned long)(_hostClockMicros() / 1000); }
+inline unsigned long micros() { return (unsigned long)_hostClockMicros(); }
+inline void delay(unsigned long ms) { _hostClockMicros() += (uint64_t)ms * 1000; }
+
+class HostSerial
+{
+private:
+   FILE* _out;
+
+   void _number(unsigned long n, int base, int negative)
+   {
+      if (NULL != this->_out)
+         fprintf(this->_out, (HEX == base) ? "%s%lx" : "%s%lu", negative ? "-" : "", n);
+   }
+
+public:
+   HostSerial() : _out(NULL) {}
+
+   static HostSerial& instance()
+   {
+      static HostSerial serial;
+      return serial;
+   }
+
+   void setOutput(FILE* out) { this->_out = out; }
+
+   void print(const char* s) { if (NULL != this->_out) fputs(s, this->_out); }
+   void print(char c) { if (NULL != this->_out) fputc(c, this->_out); }
+   void print(unsigned char n, int base = DEC) { this->_number(n, base, 0); }
+   void print(unsigned int n, int base = DEC) { this->_number(n, base, 0); }
+   void print(unsigned long n, int base = DEC) { this->_number(n, base, 0); }
+   void print(int n, int base = DEC) { this->print((long)n, base); }
+   void print(long n, int base = DEC)
+   {
+      this->_number((n < 0) ? -(unsigned long)n : (unsigned long)n, base, n < 0);
+   }
+
+   void println() { this->print('\n'); }
+   template <class T> void println(T v) { this->print(v); this->println(); }
+   template <class T> void println(T v, int base) { this->print(v, base); this->println(); }
+};
+
+#define Serial (HostSerial::instance())
+
+inline void hostSetSerialOutput(FILE* out) { Serial.setOutput(out); }
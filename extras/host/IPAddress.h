@@ -0,0 +1,62 @@
+//  Copyright (C) 2010 Georg Kaindl
+//  http://gkaindl.com
+//
+//  This file is part of Arduino EthernetBonjour3.
+//
+//  EthernetBonjour3 is free software: you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public License
+//  as published by the Free Software Foundation, either version 3 of
+//  the License, or (at your option) any later version.
+//
+//  EthernetBonjour3 is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with EthernetBonjour3. If not, see
+//  <http://www.gnu.org/licenses/>.
+//
+
+// the parts of the Arduino IPAddress class the library uses, for host builds.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+class IPAddress
+{
+private:
+   uint8_t _address[4]; // network byte order
+
+public:
+   IPAddress() { memset(this->_address, 0, sizeof(this->_address)); }
+   IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+   {
+      this->_address[0] = a;
+      this->_address[1] = b;
+      this->_address[2] = c;
+      this->_address[3] = d;
+   }
+   IPAddress(uint32_t address) { memcpy(this->_address, &address, sizeof(this->_address)); }
+   IPAddress(const uint8_t* address) { memcpy(this->_address, address, sizeof(this->_address)); }
+
+   operator uint32_t() const
+   {
+      uint32_t address;
+      memcpy(&address, this->_address, sizeof(address));
+      return address;
+   }
+
+   uint8_t operator[](int index) const { return this->_address[index]; }
+   uint8_t& operator[](int index) { return this->_address[index]; }
+
+   const uint8_t* raw_address() const { return this->_address; }
+
+   bool operator==(const IPAddress& other) const
+   {
+      return 0 == memcmp(this->_address, other._address, sizeof(this->_address));
+   }
+   bool operator!=(const IPAddress& other) const { return !(*this == other); }
+};
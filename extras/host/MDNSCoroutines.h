@@ -0,0 +1,378 @@
+//  Copyright (C) 2010 Georg Kaindl
+//  http://gkaindl.com
+//
+//  This file is part of Arduino EthernetBonjour3.
+//
+//  EthernetBonjour3 is free software: you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public License
+//  as published by the Free Software Foundation, either version 3 of
+//  the License, or (at your option) any later version.
+//
+//  EthernetBonjour3 is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with EthernetBonjour3. If not, see
+//  <http://www.gnu.org/licenses/>.
+//
+
+// C++20 coroutines over EthernetBonjour3Class, for host builds:
+//
+//    MDNSTask findPrinter(MDNSCoroutines<Bonjour>& mdns)
+//    {
+//       co_await mdns.registered();
+//
+//       MDNSResolveResult printer = co_await mdns.resolve("printer", 5000);
+//       if (printer.found)
+//          ...
+//
+//       MDNSBrowser<Bonjour> browser = mdns.browse("_ipp", MDNSServiceTCP, NULL, 10000);
+//       while (std::optional<MDNSServiceInstance> instance = co_await browser.next())
+//          ...
+//    }
+//
+// MDNSCoroutines::run() takes the place of the instance's run() in the main loop. it resumes
+// the coroutines whose results arrived after the instance's run() returned, never from within
+// the library, so a coroutine may do anything except call run() itself. a coroutine resumes
+// on the thread that calls run().
+//
+// the library runs NumMDNSQueries lookups at once. resolve() waits for a free slot while
+// other resolves started here are running, so any number of coroutines can resolve names at
+// the same time. browsers aren't queued: browse() fails right away if no slot is free.
+
+#pragma once
+
+#if __cplusplus < 202002L
+#error "MDNSCoroutines.h needs C++20"
+#endif
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <EthernetBonjour3.h>
+
+#include "MDNSServiceInstance.h"
+
+BEGIN_MDNS_NAMESPACE
+
+// the return type of coroutines that await the library. they start right away, and clean up
+// after themselves when they finish; nobody waits for them.
+struct MDNSTask
+{
+   struct promise_type
+   {
+      MDNSTask get_return_object() { return MDNSTask(); }
+      std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+      std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+      void return_void() {}
+      void unhandled_exception() { std::terminate(); }
+   };
+};
+
+struct MDNSResolveResult
+{
+   bool      found;   // false if the lookup timed out, or couldn't be started
+   IPAddress address;
+};
+
+template <class Bonjour> class MDNSCoroutines;
+
+// co_await mdns.resolve(...)
+template <class Bonjour>
+class MDNSResolveAwaiter
+{
+private:
+   friend class MDNSCoroutines<Bonjour>;
+
+   MDNSCoroutines<Bonjour>* _mdns;
+   std::string              _name;
+   unsigned long            _timeout;
+   MDNSHandle_t             _request;
+   MDNSResolveResult        _result;
+   std::coroutine_handle<>  _waiter;
+
+   static void _resolved(void* context, MDNSHandle_t, const char*, const byte ipAddr[4])
+   {
+      MDNSResolveAwaiter* self = (MDNSResolveAwaiter*)context;
+
+      self->_request = MDNS_INVALID_HANDLE;
+      self->_mdns->_running--;
+
+      if (NULL != ipAddr)
+      {
+         self->_result.found = true;
+         self->_result.address = IPAddress(ipAddr);
+      }
+
+      self->_mdns->_wake(self->_waiter);
+   }
+
+   // return values:
+   // 1 if the lookup is running
+   // 0 otherwise
+   int _start()
+   {
+      this->_request = this->_mdns->_bonjour.resolveNameAsync(this->_name.c_str(), this->_timeout,
+                                                              _resolved, this);
+      if (MDNS_INVALID_HANDLE == this->_request)
+         return 0;
+
+      this->_mdns->_running++;
+      return 1;
+   }
+
+public:
+   MDNSResolveAwaiter(MDNSCoroutines<Bonjour>& mdns, const char* name, unsigned long timeout)
+      : _mdns(&mdns), _name(name), _timeout(timeout), _request(MDNS_INVALID_HANDLE)
+   {
+      this->_result.found = false;
+   }
+
+   MDNSResolveAwaiter(const MDNSResolveAwaiter&) = delete;
+   MDNSResolveAwaiter& operator=(const MDNSResolveAwaiter&) = delete;
+
+   ~MDNSResolveAwaiter()
+   {
+      if (this->_mdns->_bonjour.cancelRequest(this->_request))
+         this->_mdns->_running--;
+
+      this->_mdns->_unqueue(this);
+   }
+
+   bool await_ready() { return false; }
+
+   bool await_suspend(std::coroutine_handle<> waiter)
+   {
+      this->_waiter = waiter;
+
+      if (this->_start())
+         return true;
+
+      // our other resolves take the slots, so one will be free soon
+      if (this->_mdns->_running > 0)
+      {
+         this->_mdns->_queued.push_back(this);
+         return true;
+      }
+
+      return false;
+   }
+
+   MDNSResolveResult await_resume() { return this->_result; }
+};
+
+// the instances of a service type, as they are found:
+//    MDNSBrowser<Bonjour> browser = mdns.browse(...);
+//    while (std::optional<MDNSServiceInstance> instance = co_await browser.next())
+// next() gives std::nullopt once the browse timed out. the browse ends with the browser.
+template <class Bonjour>
+class MDNSBrowser
+{
+private:
+   MDNSCoroutines<Bonjour>*        _mdns;
+   MDNSHandle_t                    _request;
+   std::deque<MDNSServiceInstance> _found;
+   std::coroutine_handle<>         _waiter;
+
+   static void _serviceFound(void* context, MDNSHandle_t, const char* type, MDNSServiceProtocol_t proto,
+                             const char* name, const byte ipAddr[4], unsigned short port,
+                             const char* txt)
+   {
+      MDNSBrowser* self = (MDNSBrowser*)context;
+
+      if (NULL == name)
+         self->_request = MDNS_INVALID_HANDLE;
+      else
+      {
+         MDNSServiceInstance instance;
+         instance.type = type;
+         instance.proto = proto;
+         instance.name = name;
+         instance.address = IPAddress(ipAddr);
+         instance.port = port;
+         if (NULL != txt)
+            instance.txt = txt;
+
+         self->_found.push_back(instance);
+      }
+
+      if (self->_waiter)
+      {
+         self->_mdns->_wake(self->_waiter);
+         self->_waiter = nullptr;
+      }
+   }
+
+public:
+   class NextAwaiter
+   {
+   private:
+      MDNSBrowser* _browser;
+
+   public:
+      NextAwaiter(MDNSBrowser* browser) : _browser(browser) {}
+
+      bool await_ready()
+      {
+         return !this->_browser->_found.empty() || MDNS_INVALID_HANDLE == this->_browser->_request;
+      }
+
+      void await_suspend(std::coroutine_handle<> waiter) { this->_browser->_waiter = waiter; }
+
+      std::optional<MDNSServiceInstance> await_resume()
+      {
+         if (this->_browser->_found.empty())
+            return std::nullopt;
+
+         MDNSServiceInstance instance = this->_browser->_found.front();
+         this->_browser->_found.pop_front();
+         return instance;
+      }
+   };
+
+   MDNSBrowser(MDNSCoroutines<Bonjour>& mdns, const char* serviceName, MDNSServiceProtocol_t proto,
+               const char* subtype, unsigned long timeout)
+      : _mdns(&mdns)
+   {
+      this->_request = mdns._bonjour.discoverServiceAsync(serviceName, proto, subtype, timeout,
+                                                          _serviceFound, this);
+   }
+
+   MDNSBrowser(const MDNSBrowser&) = delete;
+   MDNSBrowser& operator=(const MDNSBrowser&) = delete;
+
+   ~MDNSBrowser() { (void)this->_mdns->_bonjour.cancelRequest(this->_request); }
+
+   // return value:
+   // an awaitable for the next instance found, std::nullopt once the browse has ended
+   NextAwaiter next() { return NextAwaiter(this); }
+
+   // return value:
+   // true while the browse runs, false if it timed out or couldn't be started
+   bool active() { return MDNS_INVALID_HANDLE != this->_request; }
+};
+
+// drives the coroutines awaiting bonjour, a EthernetBonjour3Class.
+template <class Bonjour>
+class MDNSCoroutines
+{
+private:
+   friend class MDNSResolveAwaiter<Bonjour>;
+   friend class MDNSBrowser<Bonjour>;
+
+   Bonjour&                                 _bonjour;
+   std::deque<MDNSResolveAwaiter<Bonjour>*> _queued;  // resolves waiting for a free slot
+   std::vector<std::coroutine_handle<>>     _ready;   // coroutines to resume in run()
+   std::vector<std::coroutine_handle<>>     _registration;
+   int                                      _running; // our resolves in the library
+
+   void _wake(std::coroutine_handle<> waiter) { this->_ready.push_back(waiter); }
+
+   void _unqueue(MDNSResolveAwaiter<Bonjour>* awaiter)
+   {
+      for (auto i = this->_queued.begin(); i != this->_queued.end(); ++i)
+         if (*i == awaiter)
+         {
+            this->_queued.erase(i);
+            break;
+         }
+   }
+
+public:
+   // co_await mdns.registered(): until our host name is ours, after probing
+   class RegisteredAwaiter
+   {
+   private:
+      MDNSCoroutines* _mdns;
+
+   public:
+      RegisteredAwaiter(MDNSCoroutines* mdns) : _mdns(mdns) {}
+
+      bool await_ready() { return this->_mdns->_bonjour.isNameRegistered(); }
+      void await_suspend(std::coroutine_handle<> waiter) { this->_mdns->_registration.push_back(waiter); }
+      void await_resume() {}
+   };
+
+   MDNSCoroutines(Bonjour& bonjour) : _bonjour(bonjour), _running(0) {}
+
+   MDNSCoroutines(const MDNSCoroutines&) = delete;
+   MDNSCoroutines& operator=(const MDNSCoroutines&) = delete;
+
+   // runs the instance, then resumes the coroutines whose results arrived.
+   // return value:
+   // what the instance's run() returned
+   int run()
+   {
+      int handled = this->_bonjour.run();
+
+      if (!this->_registration.empty() && this->_bonjour.isNameRegistered())
+      {
+         this->_ready.insert(this->_ready.end(), this->_registration.begin(), this->_registration.end());
+         this->_registration.clear();
+      }
+
+      // slots freed up, so the next resolves can start
+      while (!this->_queued.empty())
+      {
+         MDNSResolveAwaiter<Bonjour>* awaiter = this->_queued.front();
+
+         if (!awaiter->_start())
+         {
+            // none of our resolves is running anymore, so waiting won't help
+            if (0 == this->_running)
+            {
+               this->_queued.pop_front();
+               this->_wake(awaiter->_waiter);
+               continue;
+            }
+
+            break;
+         }
+
+         this->_queued.pop_front();
+      }
+
+      // coroutines resumed now may make others ready, those run next time
+      std::vector<std::coroutine_handle<>> ready;
+      ready.swap(this->_ready);
+
+      for (std::coroutine_handle<> waiter : ready)
+         waiter.resume();
+
+      return handled;
+   }
+
+   // return value:
+   // like the instance's nextWakeupMillis(), but 0 while coroutines are waiting to be resumed
+   unsigned long nextWakeupMillis()
+   {
+      return this->_ready.empty() ? this->_bonjour.nextWakeupMillis() : 0;
+   }
+
+   // return value:
+   // an awaitable for the address of name (without ".local"), or for the timeout after
+   // timeout ms (0: never)
+   MDNSResolveAwaiter<Bonjour> resolve(const char* name, unsigned long timeout)
+   {
+      return MDNSResolveAwaiter<Bonjour>(*this, name, timeout);
+   }
+
+   // return value:
+   // a browser for the instances of serviceName, optionally only those with subtype (unless
+   // NULL), that ends after timeout ms (0: never)
+   MDNSBrowser<Bonjour> browse(const char* serviceName, MDNSServiceProtocol_t proto,
+                               const char* subtype, unsigned long timeout)
+   {
+      return MDNSBrowser<Bonjour>(*this, serviceName, proto, subtype, timeout);
+   }
+
+   RegisteredAwaiter registered() { return RegisteredAwaiter(this); }
+};
+
+END_MDNS_NAMESPACE
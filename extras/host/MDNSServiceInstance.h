@@ -0,0 +1,43 @@
+//  Copyright (C) 2010 Georg Kaindl
+//  http://gkaindl.com
+//
+//  This file is part of Arduino EthernetBonjour3.
+//
+//  EthernetBonjour3 is free software: you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public License
+//  as published by the Free Software Foundation, either version 3 of
+//  the License, or (at your option) any later version.
+//
+//  EthernetBonjour3 is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with EthernetBonjour3. If not, see
+//  <http://www.gnu.org/licenses/>.
+//
+
+
+// a service instance found by a browse, copied out of the library's callback, for the host
+// front-ends in MDNSCoroutines.h and MDNSThread.h.
+
+#pragma once
+
+#include <string>
+
+#include <EthernetBonjour3.h>
+
+BEGIN_MDNS_NAMESPACE
+
+struct MDNSServiceInstance
+{
+   std::string           type;   // "_ipp"
+   MDNSServiceProtocol_t proto;
+   std::string           name;   // "Printer"
+   IPAddress             address;
+   uint16_t              port;
+   std::string           txt;    // TXT rdata in wire form, empty if there was none
+};
+
+END_MDNS_NAMESPACE
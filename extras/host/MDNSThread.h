@@ -0,0 +1,450 @@
+//  Copyright (C) 2010 Georg Kaindl
+//  http://gkaindl.com
+//
+//  This file is part of Arduino EthernetBonjour3.
+//
+//  EthernetBonjour3 is free software: you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public License
+//  as published by the Free Software Foundation, either version 3 of
+//  the License, or (at your option) any later version.
+//
+//  EthernetBonjour3 is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with EthernetBonjour3. If not, see
+//  <http://www.gnu.org/licenses/>.
+//
+
+
+// runs an EthernetBonjour3Class on a thread of its own, for multithreaded host programs:
+//
+//    MDNSResponderThread<> mdns("gateway");
+//    mdns.start(IPAddress(192, 168, 0, 2));
+//    mdns.addServiceRecord("Web._http", 80, MDNSServiceTCP);
+//    mdns.resolve("printer", 5000, [](bool found, IPAddress address) { ... });
+//
+// the instance belongs to the I/O thread, which sleeps in epoll_wait() until a datagram
+// arrives, a timer of the library is due, or a command comes in. all methods may be called
+// from any thread, also from callbacks: they queue a command without taking a lock, and
+// return right away. commands run in the order they were queued.
+//
+// callbacks are handed to the executor given to the constructor, or run on the I/O thread
+// if there is none. an executor that passes them on to another thread keeps slow callbacks
+// from holding up the responder.
+//
+// UdpClass has to add its sockets to the epoll set given to its static pollWith(), and queue
+// what it sends between batchSends(1) and flushAll(), like MDNSPosixUdp does. the answers
+// to all datagrams one run() handles go out together. the I/O thread sets the library's
+// clock (hostSetMicros()), so there can only be one of these per program.
+
+#pragma once
+
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <map>
+#include <string>
+#include <thread>
+
+#include <Arduino.h>
+#include <EthernetBonjour3.h>
+
+#include "MDNSServiceInstance.h"
+#include "PosixUdp.h"
+
+BEGIN_MDNS_NAMESPACE
+
+template <class UdpClass = MDNSPosixUdp, class Features = MDNSAllFeatures>
+class MDNSResponderThread
+{
+public:
+   typedef EthernetBonjour3Class<UdpClass, Features>        Bonjour;
+   typedef std::function<void(Bonjour&)>                    Command;
+   typedef std::function<void(std::function<void()>)>       Executor;
+   typedef std::function<void(bool, IPAddress)>             ResolveCallback; // found, address
+   typedef std::function<void(const MDNSServiceInstance*)>  BrowseCallback;  // NULL once it ended
+
+private:
+   struct _Node
+   {
+      Command command;
+      _Node*  next;
+   };
+
+   // a lookup or browse of the library, I/O thread only
+   struct _Request
+   {
+      MDNSResponderThread* owner;
+      uint32_t             id;
+      MDNSHandle_t         handle;
+      ResolveCallback      resolved;
+      BrowseCallback       found;
+   };
+
+   Bonjour                       _bonjour;
+   Executor                      _executor;
+   std::thread                   _thread;
+   std::atomic<_Node*>           _commands; // pushed in front, so newest first
+   std::atomic<uint32_t>         _nextId;
+   std::atomic<bool>             _stop;
+   int                           _epollFd;
+   int                           _wakeFd;
+   std::map<uint32_t, _Request*> _requests;
+
+   void _wake()
+   {
+      uint64_t one = 1;
+      if (write(this->_wakeFd, &one, sizeof(one)) < 0)
+         return; // the counter is full, so the thread is awake anyway
+   }
+
+   void _deliver(const std::function<void()>& callback)
+   {
+      if (this->_executor)
+         this->_executor(callback);
+      else
+         callback();
+   }
+
+   void _runCommands()
+   {
+      _Node* list = this->_commands.exchange(NULL, std::memory_order_acquire);
+      _Node* ordered = NULL;
+
+      while (NULL != list)
+      {
+         _Node* next = list->next;
+         list->next = ordered;
+         ordered = list;
+         list = next;
+      }
+
+      while (NULL != ordered)
+      {
+         _Node* next = ordered->next;
+         ordered->command(this->_bonjour);
+         delete ordered;
+         ordered = next;
+      }
+   }
+
+   void _endRequest(_Request* request)
+   {
+      this->_requests.erase(request->id);
+      delete request;
+   }
+
+   static void _nameResolved(void* context, MDNSHandle_t, const char*, const byte ipAddr[4])
+   {
+      _Request* request = (_Request*)context;
+      MDNSResponderThread* self = request->owner;
+      ResolveCallback callback = request->resolved;
+      bool found = (NULL != ipAddr);
+      IPAddress address = found ? IPAddress(ipAddr) : IPAddress();
+
+      self->_endRequest(request);
+      self->_deliver([callback, found, address]() { callback(found, address); });
+   }
+
+   static void _serviceFound(void* context, MDNSHandle_t, const char* type, MDNSServiceProtocol_t proto,
+                             const char* name, const byte ipAddr[4], unsigned short port,
+                             const char* txt)
+   {
+      _Request* request = (_Request*)context;
+      MDNSResponderThread* self = request->owner;
+      BrowseCallback callback = request->found;
+
+      if (NULL == name)
+      {
+         self->_endRequest(request);
+         self->_deliver([callback]() { callback(NULL); });
+         return;
+      }
+
+      MDNSServiceInstance instance;
+      instance.type = type;
+      instance.proto = proto;
+      instance.name = name;
+      instance.address = IPAddress(ipAddr);
+      instance.port = port;
+      if (NULL != txt)
+         instance.txt = txt;
+
+      self->_deliver([callback, instance]() { callback(&instance); });
+   }
+
+   void _loop()
+   {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      struct epoll_event events[NumMDNSInterfaces + 1];
+      int i, n;
+
+      UdpClass::pollWith(this->_epollFd);
+      UdpClass::batchSends(1);
+
+      while (!this->_stop.load())
+      {
+         this->_runCommands();
+
+         hostSetMicros((uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::steady_clock::now() - start).count());
+         this->_bonjour.run();
+         UdpClass::flushAll();
+
+         unsigned long wait = this->_bonjour.nextWakeupMillis();
+         n = epoll_wait(this->_epollFd, events, NumMDNSInterfaces + 1,
+                        (MDNS_NO_WAKEUP == wait) ? -1 : (int)std::min(wait, (unsigned long)INT_MAX));
+
+         for (i = 0; i < n; i++)
+         {
+            uint64_t count;
+
+            // the sockets are read by run(), the wakeup counter only has to be reset
+            if (events[i].data.fd == this->_wakeFd && read(this->_wakeFd, &count, sizeof(count)) < 0)
+               break;
+         }
+      }
+
+      // what was queued before stop(), then the goodbyes
+      this->_runCommands();
+      this->_bonjour.end();
+      UdpClass::batchSends(0);
+
+      for (typename std::map<uint32_t, _Request*>::iterator i = this->_requests.begin();
+           i != this->_requests.end(); ++i)
+      {
+         (void)this->_bonjour.cancelRequest(i->second->handle);
+         delete i->second;
+      }
+      this->_requests.clear();
+
+      UdpClass::pollWith(-1);
+   }
+
+public:
+   MDNSResponderThread(const char* bonjourName, Executor executor = Executor())
+      : _bonjour(bonjourName), _executor(executor), _commands(NULL), _nextId(0), _stop(false)
+   {
+      this->_epollFd = epoll_create1(EPOLL_CLOEXEC);
+      this->_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+      if (this->_epollFd >= 0 && this->_wakeFd >= 0)
+      {
+         struct epoll_event event;
+
+         memset(&event, 0, sizeof(event));
+         event.events = EPOLLIN;
+         event.data.fd = this->_wakeFd;
+         (void)epoll_ctl(this->_epollFd, EPOLL_CTL_ADD, this->_wakeFd, &event);
+      }
+   }
+
+   MDNSResponderThread(const MDNSResponderThread&) = delete;
+   MDNSResponderThread& operator=(const MDNSResponderThread&) = delete;
+
+   ~MDNSResponderThread()
+   {
+      this->stop();
+
+      // commands queued after stop() never run
+      _Node* list = this->_commands.exchange(NULL);
+      while (NULL != list)
+      {
+         _Node* next = list->next;
+         delete list;
+         list = next;
+      }
+
+      if (this->_epollFd >= 0)
+         close(this->_epollFd);
+      if (this->_wakeFd >= 0)
+         close(this->_wakeFd);
+   }
+
+   // starts the I/O thread, and begin()s the instance there. commands queued before run first.
+   // return values:
+   // what begin() returned: 1 on success, 0 otherwise
+   int start(IPAddress localIP)
+   {
+      if (this->_thread.joinable() || this->_epollFd < 0 || this->_wakeFd < 0)
+         return 0;
+
+      std::promise<int> begun;
+      std::future<int> result = begun.get_future();
+
+      this->post([localIP, &begun](Bonjour& bonjour) { begun.set_value(bonjour.begin(localIP)); });
+
+      this->_stop = false;
+      this->_thread = std::thread(&MDNSResponderThread::_loop, this);
+
+      return result.get();
+   }
+
+   // says goodbye for all our records, ends all lookups without calling back, and waits for
+   // the I/O thread to finish. not from a callback on the I/O thread.
+   void stop()
+   {
+      if (!this->_thread.joinable())
+         return;
+
+      this->_stop = true;
+      this->_wake();
+      this->_thread.join();
+   }
+
+   // runs command on the I/O thread, with the instance, for everything there's no method for
+   void post(const Command& command)
+   {
+      _Node* node = new _Node;
+
+      node->command = command;
+      node->next = this->_commands.load(std::memory_order_relaxed);
+
+      while (!this->_commands.compare_exchange_weak(node->next, node, std::memory_order_release,
+                                                    std::memory_order_relaxed))
+         ;
+
+      this->_wake();
+   }
+
+   void addServiceRecord(const char* name, uint16_t port, MDNSServiceProtocol_t proto,
+                         const char* textContent = NULL)
+   {
+      std::string n(name), txt(textContent ? textContent : "");
+      bool hasTxt = (NULL != textContent);
+
+      this->post([n, port, proto, txt, hasTxt](Bonjour& bonjour) {
+         if (hasTxt)
+            bonjour.addServiceRecord(n.c_str(), port, proto, txt.c_str());
+         else
+            bonjour.addServiceRecord(n.c_str(), port, proto);
+      });
+   }
+
+   void removeServiceRecord(const char* name, uint16_t port, MDNSServiceProtocol_t proto)
+   {
+      std::string n(name);
+      this->post([n, port, proto](Bonjour& bonjour) { bonjour.removeServiceRecord(n.c_str(), port, proto); });
+   }
+
+   // answers for name (without ".local") with address, in place of a device that doesn't
+   // speak mDNS itself. see EthernetBonjour3Class::addProxyHost().
+   void addProxyHost(const char* name, IPAddress address)
+   {
+      std::string n(name);
+      this->post([n, address](Bonjour& bonjour) { bonjour.addProxyHost(n.c_str(), address); });
+   }
+
+   void removeProxyHost(const char* name)
+   {
+      std::string n(name);
+      this->post([n](Bonjour& bonjour) { bonjour.removeProxyHost(n.c_str()); });
+   }
+
+   void addProxyServiceRecord(const char* hostName, const char* name, uint16_t port,
+                              MDNSServiceProtocol_t proto, const char* textContent = NULL)
+   {
+      std::string h(hostName), n(name), txt(textContent ? textContent : "");
+      bool hasTxt = (NULL != textContent);
+
+      this->post([h, n, port, proto, txt, hasTxt](Bonjour& bonjour) {
+         bonjour.addProxyServiceRecord(h.c_str(), n.c_str(), port, proto, hasTxt ? txt.c_str() : NULL);
+      });
+   }
+
+   void setServiceTxt(const char* name, MDNSServiceProtocol_t proto, const char* key, const char* value)
+   {
+      std::string n(name), k(key), v(value);
+      this->post([n, proto, k, v](Bonjour& bonjour) {
+         bonjour.setServiceTxt(n.c_str(), proto, k.c_str(), v.c_str());
+      });
+   }
+
+   // looks up the address of name (without ".local"). callback gets it, or false if there
+   // was no answer within timeout ms (0: never), or the lookup couldn't be started.
+   // return value:
+   // the id of the lookup, for cancel()
+   uint32_t resolve(const char* name, unsigned long timeout, const ResolveCallback& callback)
+   {
+      uint32_t id = ++this->_nextId;
+      std::string n(name);
+
+      this->post([this, id, n, timeout, callback](Bonjour& bonjour) {
+         _Request* request = new _Request();
+         request->owner = this;
+         request->id = id;
+         request->resolved = callback;
+         request->handle = bonjour.resolveNameAsync(n.c_str(), timeout, _nameResolved, request);
+
+         if (MDNS_INVALID_HANDLE == request->handle)
+         {
+            delete request;
+            this->_deliver([callback]() { callback(false, IPAddress()); });
+            return;
+         }
+
+         this->_requests[id] = request;
+      });
+
+      return id;
+   }
+
+   // browses for instances of serviceName, optionally only those with subtype (unless NULL).
+   // callback gets each one found, and NULL once timeout ms (0: never) have passed, or if the
+   // browse couldn't be started.
+   // return value:
+   // the id of the browse, for cancel()
+   uint32_t browse(const char* serviceName, MDNSServiceProtocol_t proto, const char* subtype,
+                   unsigned long timeout, const BrowseCallback& callback)
+   {
+      uint32_t id = ++this->_nextId;
+      std::string n(serviceName), sub(subtype ? subtype : "");
+
+      this->post([this, id, n, proto, sub, timeout, callback](Bonjour& bonjour) {
+         _Request* request = new _Request();
+         request->owner = this;
+         request->id = id;
+         request->found = callback;
+         request->handle = bonjour.discoverServiceAsync(n.c_str(), proto, sub.c_str(), timeout,
+                                                        _serviceFound, request);
+
+         if (MDNS_INVALID_HANDLE == request->handle)
+         {
+            delete request;
+            this->_deliver([callback]() { callback(NULL); });
+            return;
+         }
+
+         this->_requests[id] = request;
+      });
+
+      return id;
+   }
+
+   // ends a lookup or browse, without calling back again. callbacks the executor holds
+   // already still run.
+   void cancel(uint32_t id)
+   {
+      this->post([this, id](Bonjour& bonjour) {
+         typename std::map<uint32_t, _Request*>::iterator i = this->_requests.find(id);
+
+         if (i != this->_requests.end())
+         {
+            (void)bonjour.cancelRequest(i->second->handle);
+            this->_endRequest(i->second);
+         }
+      });
+   }
+};
+
+END_MDNS_NAMESPACE
@@ -0,0 +1,388 @@
+//  Copyright (C) 2010 Georg Kaindl
+//  http://gkaindl.com
+//
+//  This file is part of Arduino EthernetBonjour3.
+//
+//  EthernetBonjour3 is free software: you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public License
+//  as published by the Free Software Foundation, either version 3 of
+//  the License, or (at your option) any later version.
+//
+//  EthernetBonjour3 is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with EthernetBonjour3. If not, see
+//  <http://www.gnu.org/licenses/>.
+//
+
+
+// a UdpClass on a POSIX socket, to run the library on Linux:
+//    EthernetBonjour3Class<MDNSPosixUdp> bonjour("gateway");
+//
+// the socket is non-blocking, so run() never waits for datagrams. to sleep until one
+// arrives, call MDNSPosixUdp::pollWith() with an epoll descriptor before begin(): the sockets
+// the library opens on that thread afterwards add themselves to it. MDNSResponderThread in
+// MDNSThread.h does all of that.
+//
+// datagrams are received MDNS_POSIX_UDP_BATCH at a time with recvmmsg(), and run() works
+// through them before the next system call. after batchSends(1), what the library sends is
+// queued, too, and goes out with sendmmsg(): when the queue is full, before the next batch is
+// received, and in flushAll(), which has to be called after every run() then. a busy
+// responder gets by with two system calls for a whole batch of queries and their answers.
+//
+// it answers on the interface the kernel picks for 224.0.0.251, unless multicastInterface()
+// is set to the address of another one. IPv4 only.
+
+#pragma once
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <Arduino.h>
+#include <IPAddress.h>
+
+#define MDNS_POSIX_UDP_MAX_DATAGRAM  (9000)   // the largest mDNS message, see RFC 6762, 17
+#define MDNS_POSIX_UDP_BATCH         (16)     // datagrams per recvmmsg() and sendmmsg()
+
+class MDNSPosixUdp
+{
+private:
+   int                  _fd;
+
+   // the last batch received, and where we are in it
+   std::vector<uint8_t> _rxBuffer;
+   struct mmsghdr       _rxMessages[MDNS_POSIX_UDP_BATCH];
+   struct iovec         _rxVectors[MDNS_POSIX_UDP_BATCH];
+   struct sockaddr_in   _rxFrom[MDNS_POSIX_UDP_BATCH];
+   int                  _rxCount;
+   int                  _rxNext;
+
+   // the datagram of the last parsePacket()
+   const uint8_t*       _rx;
+   uint16_t             _rxLength;
+   uint16_t             _rxPos;
+   IPAddress            _rxIP;
+   uint16_t             _rxPort;
+
+   // datagrams waiting for sendmmsg(), the one being written is _tx[_txCount]
+   std::vector<uint8_t> _tx[MDNS_POSIX_UDP_BATCH];
+   struct sockaddr_in   _txTo[MDNS_POSIX_UDP_BATCH];
+   int                  _txCount;
+
+   static int& _poller()
+   {
+      static thread_local int epollFd = -1;
+      return epollFd;
+   }
+
+   static int& _batching()
+   {
+      static thread_local int enabled = 0;
+      return enabled;
+   }
+
+   // the sockets of this thread with datagrams queued
+   static std::vector<MDNSPosixUdp*>& _queued()
+   {
+      static thread_local std::vector<MDNSPosixUdp*> sockets;
+      return sockets;
+   }
+
+   static struct sockaddr_in _address(IPAddress ip, uint16_t port)
+   {
+      struct sockaddr_in address;
+
+      memset(&address, 0, sizeof(address));
+      address.sin_family = AF_INET;
+      address.sin_port = htons(port);
+      address.sin_addr.s_addr = (uint32_t)ip;
+
+      return address;
+   }
+
+   // return value:
+   // the number of datagrams received, 0 if there were none
+   int _receiveBatch()
+   {
+      int i, n;
+
+      this->_rxCount = this->_rxNext = 0;
+
+      if (this->_rxBuffer.empty())
+         this->_rxBuffer.resize(MDNS_POSIX_UDP_BATCH * MDNS_POSIX_UDP_MAX_DATAGRAM);
+
+      memset(this->_rxMessages, 0, sizeof(this->_rxMessages));
+      for (i = 0; i < MDNS_POSIX_UDP_BATCH; i++)
+      {
+         this->_rxVectors[i].iov_base = &this->_rxBuffer[i * MDNS_POSIX_UDP_MAX_DATAGRAM];
+         this->_rxVectors[i].iov_len = MDNS_POSIX_UDP_MAX_DATAGRAM;
+         this->_rxMessages[i].msg_hdr.msg_iov = &this->_rxVectors[i];
+         this->_rxMessages[i].msg_hdr.msg_iovlen = 1;
+         this->_rxMessages[i].msg_hdr.msg_name = &this->_rxFrom[i];
+         this->_rxMessages[i].msg_hdr.msg_namelen = sizeof(this->_rxFrom[i]);
+      }
+
+      do
+         n = recvmmsg(this->_fd, this->_rxMessages, MDNS_POSIX_UDP_BATCH, MSG_DONTWAIT, NULL);
+      while (n < 0 && EINTR == errno);
+
+      this->_rxCount = (n > 0) ? n : 0;
+      return this->_rxCount;
+   }
+
+public:
+   MDNSPosixUdp() : _fd(-1), _rxCount(0), _rxNext(0), _rx(NULL), _rxLength(0), _rxPos(0), _rxPort(0),
+                    _txCount(0) {}
+   ~MDNSPosixUdp() { this->stop(); }
+
+   // sockets this thread opens from now on add themselves to epollFd (-1: to none), for
+   // EPOLLIN. their descriptor is the data of the event.
+   static void pollWith(int epollFd) { _poller() = epollFd; }
+
+   // queues the datagrams sockets send on this thread, until flushAll() (or until the queue
+   // is full, or the socket receives the next batch).
+   static void batchSends(int enabled)
+   {
+      _batching() = enabled;
+      if (!enabled)
+         flushAll();
+   }
+
+   // sends what the sockets of this thread have queued
+   static void flushAll()
+   {
+      std::vector<MDNSPosixUdp*> sockets;
+      sockets.swap(_queued());
+
+      for (size_t i = 0; i < sockets.size(); i++)
+         sockets[i]->flushSends();
+   }
+
+   static IPAddress& multicastInterface()
+   {
+      static IPAddress address;
+      return address;
+   }
+
+   // return values:
+   // 1 on success
+   // 0 otherwise (errno tells why)
+   int beginMulticast(IPAddress group, uint16_t port)
+   {
+      int on = 1;
+      unsigned char ttl = 255; // RFC 6762, 11
+      struct sockaddr_in address = _address(IPAddress(0, 0, 0, 0), port);
+      struct ip_mreq membership;
+      struct in_addr ifAddress;
+
+      this->stop();
+
+      this->_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (this->_fd < 0)
+         return 0;
+
+      ifAddress.s_addr = (uint32_t)multicastInterface();
+      membership.imr_multiaddr.s_addr = (uint32_t)group;
+      membership.imr_interface = ifAddress;
+
+      // other responders on this host, like avahi, keep receiving on the port, too
+      if (setsockopt(this->_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+          setsockopt(this->_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+          bind(this->_fd, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+          setsockopt(this->_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0 ||
+          setsockopt(this->_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+          setsockopt(this->_fd, IPPROTO_IP, IP_MULTICAST_IF, &ifAddress, sizeof(ifAddress)) < 0)
+      {
+         this->stop();
+         return 0;
+      }
+
+      if (_poller() >= 0)
+      {
+         struct epoll_event event;
+
+         memset(&event, 0, sizeof(event));
+         event.events = EPOLLIN;
+         event.data.fd = this->_fd;
+
+         if (epoll_ctl(_poller(), EPOLL_CTL_ADD, this->_fd, &event) < 0)
+         {
+            this->stop();
+            return 0;
+         }
+      }
+
+      return 1;
+   }
+
+   // sends what is queued (the goodbyes, usually), then closes the socket
+   void stop()
+   {
+      this->flushSends();
+
+      // closing it takes it out of any epoll set, too
+      if (this->_fd >= 0)
+         close(this->_fd);
+
+      this->_fd = -1;
+      this->_rxCount = this->_rxNext = 0;
+      this->_rx = NULL;
+      this->_rxLength = this->_rxPos = 0;
+   }
+
+   int fd() { return this->_fd; }
+
+   // return value:
+   // the size of the next datagram, 0 if there is none right now
+   int parsePacket()
+   {
+      this->_rx = NULL;
+      this->_rxLength = this->_rxPos = 0;
+
+      if (this->_fd < 0)
+         return 0;
+
+      for (;;)
+      {
+         if (this->_rxNext >= this->_rxCount)
+         {
+            // the answers to the last batch go out before we look at the next one
+            this->flushSends();
+
+            if (0 == this->_receiveBatch())
+               return 0;
+         }
+
+         struct mmsghdr* message = &this->_rxMessages[this->_rxNext];
+         int i = this->_rxNext++;
+
+         // too large for mDNS, so it's dropped like a malformed one
+         if (0 == message->msg_len || (message->msg_hdr.msg_flags & MSG_TRUNC))
+            continue;
+
+         this->_rx = &this->_rxBuffer[i * MDNS_POSIX_UDP_MAX_DATAGRAM];
+         this->_rxLength = (uint16_t)message->msg_len;
+         this->_rxIP = IPAddress((uint32_t)this->_rxFrom[i].sin_addr.s_addr);
+         this->_rxPort = ntohs(this->_rxFrom[i].sin_port);
+
+         return this->_rxLength;
+      }
+   }
+
+   // the parser reads the datagram in place
+   const uint8_t* peekPacket() { return this->_rx; }
+
+   int available() { return this->_rxLength - this->_rxPos; }
+   int read() { return (this->_rxPos < this->_rxLength) ? this->_rx[this->_rxPos++] : -1; }
+
+   int read(uint8_t* buf, size_t len)
+   {
+      if (len > (size_t)(this->_rxLength - this->_rxPos))
+         len = this->_rxLength - this->_rxPos;
+
+      memcpy(buf, &this->_rx[this->_rxPos], len);
+      this->_rxPos += len;
+      return len;
+   }
+
+   void flush() { this->_rxPos = this->_rxLength; }
+
+   IPAddress remoteIP() { return this->_rxIP; }
+   uint16_t remotePort() { return this->_rxPort; }
+
+   int beginPacket(IPAddress ip, uint16_t port)
+   {
+      if (MDNS_POSIX_UDP_BATCH == this->_txCount)
+         this->flushSends();
+
+      this->_tx[this->_txCount].clear();
+      this->_txTo[this->_txCount] = _address(ip, port);
+      return (this->_fd >= 0);
+   }
+
+   size_t write(uint8_t b)
+   {
+      this->_tx[this->_txCount].push_back(b);
+      return 1;
+   }
+
+   size_t write(const uint8_t* buf, size_t len)
+   {
+      this->_tx[this->_txCount].insert(this->_tx[this->_txCount].end(), buf, buf + len);
+      return len;
+   }
+
+   // return values:
+   // 1 if the datagram was sent, or queued
+   // 0 otherwise (queued datagrams that fail later aren't reported)
+   int endPacket()
+   {
+      if (this->_fd < 0)
+         return 0;
+
+      if (0 == this->_txCount && _batching())
+         _queued().push_back(this);
+
+      this->_txCount++;
+
+      if (_batching())
+         return 1;
+
+      return (1 == this->flushSends());
+   }
+
+   // return value:
+   // the number of queued datagrams sent
+   int flushSends()
+   {
+      struct mmsghdr messages[MDNS_POSIX_UDP_BATCH];
+      struct iovec vectors[MDNS_POSIX_UDP_BATCH];
+      int i, n, done = 0, sent = 0;
+
+      if (0 == this->_txCount)
+         return 0;
+
+      memset(messages, 0, sizeof(messages));
+      for (i = 0; i < this->_txCount; i++)
+      {
+         vectors[i].iov_base = this->_tx[i].data();
+         vectors[i].iov_len = this->_tx[i].size();
+         messages[i].msg_hdr.msg_iov = &vectors[i];
+         messages[i].msg_hdr.msg_iovlen = 1;
+         messages[i].msg_hdr.msg_name = &this->_txTo[i];
+         messages[i].msg_hdr.msg_namelen = sizeof(this->_txTo[i]);
+      }
+
+      // sendmmsg() stops at the first datagram it can't send, which we drop
+      while (done < this->_txCount && this->_fd >= 0)
+      {
+         n = sendmmsg(this->_fd, &messages[done], this->_txCount - done, 0);
+
+         if (n > 0)
+         {
+            done += n;
+            sent += n;
+         }
+         else if (n < 0 && EINTR == errno)
+            continue;
+         else
+            done++;
+      }
+
+      this->_txCount = 0;
+
+      std::vector<MDNSPosixUdp*>& queued = _queued();
+      queued.erase(std::remove(queued.begin(), queued.end(), this), queued.end());
+
+      return sent;
+   }
+};
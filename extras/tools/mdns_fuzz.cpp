@@ -0,0 +1,240 @@
+//  Copyright (C) 2010 Georg Kaindl
+//  http://gkaindl.com
+//
+//  This file is part of Arduino EthernetBonjour3.
+//
+//  EthernetBonjour3 is free software: you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public License
+//  as published by the Free Software Foundation, either version 3 of
+//  the License, or (at your option) any later version.
+//
+//  EthernetBonjour3 is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with EthernetBonjour3. If not, see
+//  <http://www.gnu.org/licenses/>.
+//
+
+// mdns_fuzz: feeds arbitrary datagrams to the packet parser, for libFuzzer or AFL.
+//
+// libFuzzer, from the top of the library:
+//    clang++ -std=gnu++11 -g -O1 -fsanitize=fuzzer,address,undefined -Iextras/host -Isrc
+//       extras/tools/mdns_fuzz.cpp -o mdns_fuzz
+//    ./mdns_fuzz corpus/
+//
+// AFL, or just running inputs by hand (file arguments, or stdin without any):
+//    afl-g++ -std=gnu++11 -g -O1 -fsanitize=address,undefined -DMDNS_FUZZ_MAIN -Iextras/host
+//       -Isrc extras/tools/mdns_fuzz.cpp -o mdns_fuzz
+//    afl-fuzz -i seeds -o findings -- ./mdns_fuzz
+//
+// an input is one flags byte, followed by datagrams, each preceded by its length (two bytes,
+// big-endian). a length that runs past the end takes the rest of the input. the flags pick
+// what the instance is doing while the datagrams arrive:
+//    bit 0: the socket offers peekPacket(), so the parser works on the datagram in place
+//    bit 1: we're resolving "printer.local"
+//    bit 2: we're browsing for "_ipp._tcp" (and bit 3: its "_color" subtype)
+//    bit 4: the datagrams arrive while we're still probing for our names
+//    bit 5: the datagrams don't come from port 5353
+
+#include <Arduino.h>
+#include <EthernetBonjour3.h>
+
+using namespace mDNS;
+
+#define FUZZ_PEEK       (0x01)
+#define FUZZ_RESOLVE    (0x02)
+#define FUZZ_BROWSE     (0x04)
+#define FUZZ_SUBTYPE    (0x08)
+#define FUZZ_PROBING    (0x10)
+#define FUZZ_OTHER_PORT (0x20)
+
+// hands the library the current datagram, and swallows what it sends
+class FuzzUdp
+{
+private:
+   uint16_t _pos;
+
+public:
+   static const uint8_t* rxData;
+   static uint16_t       rxLength;
+   static uint16_t       rxPort;
+   static int            rxReady;
+
+   FuzzUdp() : _pos(0) {}
+
+   int beginMulticast(IPAddress, uint16_t) { return 1; }
+   void stop() {}
+
+   int parsePacket()
+   {
+      if (!rxReady)
+         return 0;
+
+      rxReady = 0;
+      this->_pos = 0;
+      return rxLength;
+   }
+
+   int available() { return rxLength - this->_pos; }
+   int read() { return (this->_pos < rxLength) ? rxData[this->_pos++] : -1; }
+
+   int read(uint8_t* buf, size_t len)
+   {
+      if (len > (size_t)(rxLength - this->_pos))
+         len = rxLength - this->_pos;
+
+      memcpy(buf, &rxData[this->_pos], len);
+      this->_pos += len;
+      return len;
+   }
+
+   void flush() { this->_pos = rxLength; }
+
+   IPAddress remoteIP() { return IPAddress(192, 168, 0, 77); }
+   uint16_t remotePort() { return rxPort; }
+
+   int beginPacket(IPAddress, uint16_t) { return 1; }
+   size_t write(uint8_t) { return 1; }
+   size_t write(const uint8_t*, size_t len) { return len; }
+   int endPacket() { return 1; }
+};
+
+const uint8_t* FuzzUdp::rxData = NULL;
+uint16_t FuzzUdp::rxLength = 0;
+uint16_t FuzzUdp::rxPort = MDNS_SERVER_PORT;
+int FuzzUdp::rxReady = 0;
+
+// the same, with the datagram kept in place for the parser. it gets its own heap copy of
+// exactly the datagram's size, so ASan catches every read past its end.
+class FuzzPeekUdp : public FuzzUdp
+{
+public:
+   const uint8_t* peekPacket() { return FuzzUdp::rxData; }
+};
+
+static void nameFound(const char*, const byte[4]) {}
+static void serviceFound(const char*, MDNSServiceProtocol_t, const char*, const byte[4],
+                         unsigned short, const char*) {}
+
+template <class UdpClass>
+static void fuzzDatagrams(uint8_t flags, const uint8_t* data, size_t size)
+{
+   EthernetBonjour3Class<UdpClass> bonjour("arduino");
+
+   hostSetMicros(0);
+   bonjour.setNameResolvedCallback(nameFound);
+   bonjour.setServiceFoundCallback(serviceFound);
+   bonjour.begin(IPAddress(192, 168, 0, 2));
+   bonjour.addServiceRecord("Web._http", 80, MDNSServiceTCP, "\x7path=/2");
+   bonjour.addServiceSubtype("Web._http", MDNSServiceTCP, "_printer");
+   bonjour.addServiceRecord("Sensor._osc", 9000, MDNSServiceUDP);
+   bonjour.addProxyHost("nas", IPAddress(192, 168, 0, 40));
+   bonjour.addProxyServiceRecord("nas", "Files._smb", 445, MDNSServiceTCP);
+
+   // claim our names first, unless the datagrams are meant to arrive while we probe
+   if (!(flags & FUZZ_PROBING))
+      for (int i = 0; i < 100; i++)
+      {
+         delay(100);
+         bonjour.run();
+      }
+
+   if (flags & FUZZ_RESOLVE)
+      bonjour.resolveName("printer", 5000);
+   if (flags & FUZZ_BROWSE)
+      bonjour.startDiscoveringService("_ipp", MDNSServiceTCP,
+                                      (flags & FUZZ_SUBTYPE) ? "_color" : NULL, 5000);
+
+   FuzzUdp::rxPort = (flags & FUZZ_OTHER_PORT) ? 12345 : MDNS_SERVER_PORT;
+
+   while (size > 0)
+   {
+      size_t len = size;
+
+      if (size >= 2 && (size_t)((data[0] << 8) | data[1]) <= size - 2)
+      {
+         len = (data[0] << 8) | data[1];
+         data += 2;
+         size -= 2;
+      }
+
+      // datagrams can't be larger than that
+      if (len > 0xffff)
+         len = 0xffff;
+
+      uint8_t* datagram = (uint8_t*)malloc(len ? len : 1);
+      memcpy(datagram, data, len);
+
+      FuzzUdp::rxData = datagram;
+      FuzzUdp::rxLength = len;
+      FuzzUdp::rxReady = 1;
+
+      delay(10);
+      bonjour.run();
+
+      FuzzUdp::rxReady = 0;
+      free(datagram);
+
+      data += len;
+      size -= len;
+   }
+
+   // whatever the datagrams started, like address queries for discovered services
+   for (int i = 0; i < 20; i++)
+   {
+      delay(500);
+      bonjour.run();
+   }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+   if (0 == size)
+      return 0;
+
+   if (data[0] & FUZZ_PEEK)
+      fuzzDatagrams<FuzzPeekUdp>(data[0], data + 1, size - 1);
+   else
+      fuzzDatagrams<FuzzUdp>(data[0], data + 1, size - 1);
+
+   return 0;
+}
+
+#ifdef MDNS_FUZZ_MAIN
+
+static int runFile(FILE* file)
+{
+   static uint8_t input[1 << 20];
+   size_t size = fread(input, 1, sizeof(input), file);
+
+   return LLVMFuzzerTestOneInput(input, size);
+}
+
+int main(int argc, char** argv)
+{
+   int i;
+
+   if (argc < 2)
+      return runFile(stdin);
+
+   for (i = 1; i < argc; i++)
+   {
+      FILE* file = fopen(argv[i], "rb");
+
+      if (NULL == file)
+      {
+         fprintf(stderr, "mdns_fuzz: can't read %s\n", argv[i]);
+         return 1;
+      }
+
+      runFile(file);
+      fclose(file);
+   }
+
+   return 0;
+}
+
+#endif
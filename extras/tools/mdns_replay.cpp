@@ -0,0 +1,388 @@
+//  Copyright (C) 2010 Georg Kaindl
+//  http://gkaindl.com
+//
+//  This file is part of Arduino EthernetBonjour3.
+//
+//  EthernetBonjour3 is free software: you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public License
+//  as published by the Free Software Foundation, either version 3 of
+//  the License, or (at your option) any later version.
+//
+//  EthernetBonjour3 is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with EthernetBonjour3. If not, see
+//  <http://www.gnu.org/licenses/>.
+//
+
+// mdns_replay: feeds the mDNS datagrams of a pcap capture to an EthernetBonjour3 instance,
+// writes everything it sends to another pcap file and reports how long each datagram took.
+//
+// build, from the top of the library:
+//    g++ -std=gnu++11 -O2 -Iextras/host -Isrc extras/tools/mdns_replay.cpp -o mdns_replay
+//
+// usage:
+//    mdns_replay [options] capture.pcap
+//       -n name           our host name (default "arduino")
+//       -a a.b.c.d        our address (default 192.168.0.2)
+//       -S name:port[:udp] add a service record, like "Printer._ipp:631" (repeatable)
+//       -w out.pcap       write the datagrams we send to out.pcap
+//       -s factor         replay at factor times the recorded speed (default 0: at once)
+//       -W ms             let the library probe and announce for ms before the capture
+//                         starts (default 3000)
+//       -q                only print the summary
+//       -v                print the library's debug output to stderr
+//
+// the library runs on a virtual clock that follows the capture timestamps, so its timers
+// fire just like they would have on the wire, whatever the replay speed. -s only paces the
+// replay in real time, for watching it next to other tools.
+
+#include <Arduino.h>
+#include <EthernetBonjour3.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "pcap.h"
+
+using namespace mDNS;
+
+// a UdpClass that hands the library one captured datagram at a time, and writes what it
+// sends to a pcap file. there is one wire, shared by all instances.
+class ReplayUdp
+{
+private:
+   std::vector<uint8_t> _out;
+   IPAddress            _outIP;
+   uint16_t             _outPort;
+   uint16_t             _pos;
+
+public:
+   static const uint8_t* rxData;
+   static uint16_t       rxLength;
+   static IPAddress      rxIP;
+   static uint16_t       rxPort;
+   static int            rxReady;
+
+   static PcapWriter*    txWriter;
+   static IPAddress      txIP;
+   static unsigned long  txCount;
+
+   ReplayUdp() : _outPort(0), _pos(0) {}
+
+   int beginMulticast(IPAddress, uint16_t) { return 1; }
+   void stop() {}
+
+   int parsePacket()
+   {
+      if (!rxReady)
+         return 0;
+
+      rxReady = 0;
+      this->_pos = 0;
+      return rxLength;
+   }
+
+   int available() { return rxLength - this->_pos; }
+
+   int read()
+   {
+      return (this->_pos < rxLength) ? rxData[this->_pos++] : -1;
+   }
+
+   int read(uint8_t* buf, size_t len)
+   {
+      if (len > (size_t)(rxLength - this->_pos))
+         len = rxLength - this->_pos;
+
+      memcpy(buf, &rxData[this->_pos], len);
+      this->_pos += len;
+      return len;
+   }
+
+   void flush() { this->_pos = rxLength; }
+
+   IPAddress remoteIP() { return rxIP; }
+   uint16_t remotePort() { return rxPort; }
+
+   int beginPacket(IPAddress ip, uint16_t port)
+   {
+      this->_out.clear();
+      this->_outIP = ip;
+      this->_outPort = port;
+      return 1;
+   }
+
+   size_t write(uint8_t b)
+   {
+      this->_out.push_back(b);
+      return 1;
+   }
+
+   size_t write(const uint8_t* buf, size_t len)
+   {
+      this->_out.insert(this->_out.end(), buf, buf + len);
+      return len;
+   }
+
+   int endPacket()
+   {
+      if (NULL != txWriter)
+         txWriter->writeUdp(hostMicros(), txIP.raw_address(), MDNS_SERVER_PORT,
+                            this->_outIP.raw_address(), this->_outPort,
+                            this->_out.data(), this->_out.size());
+      txCount++;
+      return 1;
+   }
+};
+
+const uint8_t* ReplayUdp::rxData = NULL;
+uint16_t ReplayUdp::rxLength = 0;
+IPAddress ReplayUdp::rxIP;
+uint16_t ReplayUdp::rxPort = 0;
+int ReplayUdp::rxReady = 0;
+PcapWriter* ReplayUdp::txWriter = NULL;
+IPAddress ReplayUdp::txIP;
+unsigned long ReplayUdp::txCount = 0;
+
+// with the library's trace, which -v sends to stderr
+typedef EthernetBonjour3Class<ReplayUdp, MDNSFeatures<1, 1, 1, MDNSSerialLog> > ReplayBonjour;
+
+// runs the library's timers up to (and including) the virtual time untilMicros
+static void runTimersUntil(ReplayBonjour& bonjour, uint64_t untilMicros)
+{
+   for (;;)
+   {
+      unsigned long wait = bonjour.nextWakeupMillis();
+
+      if (MDNS_NO_WAKEUP == wait || hostMicros() + (uint64_t)wait * 1000 > untilMicros)
+         break;
+
+      hostSetMicros(hostMicros() + (uint64_t)wait * 1000);
+      bonjour.run();
+   }
+
+   hostSetMicros(untilMicros);
+}
+
+static int parseAddress(const char* s, IPAddress* pAddress)
+{
+   unsigned a, b, c, d;
+
+   if (4 != sscanf(s, "%u.%u.%u.%u", &a, &b, &c, &d) || a > 255 || b > 255 || c > 255 || d > 255)
+      return 0;
+
+   *pAddress = IPAddress(a, b, c, d);
+   return 1;
+}
+
+static int addService(ReplayBonjour& bonjour, const char* spec)
+{
+   char name[256];
+   unsigned port;
+   char proto[8] = "tcp";
+
+   if (sscanf(spec, "%255[^:]:%u:%7s", name, &port, proto) < 2 || port > 0xffff)
+      return 0;
+
+   return bonjour.addServiceRecord(name, port,
+                                   (0 == strcasecmp(proto, "udp")) ? MDNSServiceUDP : MDNSServiceTCP);
+}
+
+static void usage()
+{
+   fprintf(stderr, "usage: mdns_replay [-n name] [-a address] [-S name:port[:udp]]... "
+                   "[-w out.pcap] [-s factor] [-W ms] [-q] [-v] capture.pcap\n");
+   exit(2);
+}
+
+int main(int argc, char** argv)
+{
+   const char* hostName = MDNS_DEFAULT_NAME;
+   const char* outPath = NULL;
+   const char* inPath = NULL;
+   std::vector<const char*> services;
+   IPAddress localIP(192, 168, 0, 2);
+   double speed = 0;
+   unsigned long warmupMillis = 3000;
+   int quiet = 0;
+   int i;
+
+   for (i = 1; i < argc; i++)
+   {
+      const char* arg = argv[i];
+      const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+      if (0 == strcmp(arg, "-q"))
+         quiet = 1;
+      else if (0 == strcmp(arg, "-v"))
+         hostSetSerialOutput(stderr);
+      else if ('-' == arg[0] && NULL == value)
+         usage();
+      else if (0 == strcmp(arg, "-n"))
+         hostName = argv[++i];
+      else if (0 == strcmp(arg, "-a"))
+      {
+         if (!parseAddress(argv[++i], &localIP))
+            usage();
+      }
+      else if (0 == strcmp(arg, "-S"))
+         services.push_back(argv[++i]);
+      else if (0 == strcmp(arg, "-w"))
+         outPath = argv[++i];
+      else if (0 == strcmp(arg, "-s"))
+         speed = atof(argv[++i]);
+      else if (0 == strcmp(arg, "-W"))
+         warmupMillis = strtoul(argv[++i], NULL, 10);
+      else if ('-' != arg[0] && NULL == inPath)
+         inPath = arg;
+      else
+         usage();
+   }
+
+   if (NULL == inPath)
+      usage();
+
+   PcapReader reader;
+   if (!reader.open(inPath))
+   {
+      fprintf(stderr, "mdns_replay: can't read %s as a pcap file\n", inPath);
+      return 1;
+   }
+
+   PcapWriter writer;
+   if (NULL != outPath)
+   {
+      if (!writer.open(outPath))
+      {
+         fprintf(stderr, "mdns_replay: can't write %s\n", outPath);
+         return 1;
+      }
+      ReplayUdp::txWriter = &writer;
+   }
+   ReplayUdp::txIP = localIP;
+
+   uint64_t frameMicros;
+   const uint8_t* frame;
+   uint32_t frameLength;
+   PcapUdpDatagram_t datagram;
+   int haveDatagram = 0;
+
+   // find the first mDNS datagram, so we know when the capture starts
+   while (!haveDatagram && reader.nextFrame(&frameMicros, &frame, &frameLength))
+      haveDatagram = reader.decodeUdp(frame, frameLength, &datagram) &&
+                     MDNS_SERVER_PORT == datagram.dstPort;
+
+   if (!haveDatagram)
+   {
+      fprintf(stderr, "mdns_replay: no mDNS datagrams in %s\n", inPath);
+      return 1;
+   }
+
+   // our names are claimed before the capture starts, unless -W 0 says otherwise
+   uint64_t firstMicros = frameMicros;
+   uint64_t warmupMicros = std::min((uint64_t)warmupMillis * 1000, firstMicros);
+   hostSetMicros(firstMicros - warmupMicros);
+
+   ReplayBonjour bonjour(hostName);
+   bonjour.begin(localIP);
+   for (i = 0; i < (int)services.size(); i++)
+      if (!addService(bonjour, services[i]))
+         fprintf(stderr, "mdns_replay: can't add service %s\n", services[i]);
+
+   runTimersUntil(bonjour, firstMicros);
+   bonjour.resetStatistics();
+
+   std::vector<double> timings;
+   std::chrono::steady_clock::time_point wallStart = std::chrono::steady_clock::now();
+   unsigned long index = 0, skipped = 0;
+
+   if (!quiet)
+      printf("#     index    time (ms)  source                 bytes  micros  sent\n");
+
+   do
+   {
+      datagram.micros = frameMicros;
+
+      if (!reader.decodeUdp(frame, frameLength, &datagram) || MDNS_SERVER_PORT != datagram.dstPort)
+      {
+         skipped++;
+         continue;
+      }
+
+      if (datagram.micros < hostMicros())
+         datagram.micros = hostMicros(); // captures aren't always in order
+
+      if (speed > 0)
+         std::this_thread::sleep_until(
+            wallStart + std::chrono::microseconds((uint64_t)((datagram.micros - firstMicros) / speed)));
+
+      runTimersUntil(bonjour, datagram.micros);
+
+      ReplayUdp::rxData = datagram.payload;
+      ReplayUdp::rxLength = datagram.length;
+      ReplayUdp::rxIP = IPAddress(datagram.srcIP);
+      ReplayUdp::rxPort = datagram.srcPort;
+      ReplayUdp::rxReady = 1;
+
+      unsigned long sentBefore = ReplayUdp::txCount;
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      bonjour.run();
+      double elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+      timings.push_back(elapsed);
+
+      if (!quiet)
+      {
+         char source[24];
+
+         snprintf(source, sizeof(source), "%u.%u.%u.%u:%u", datagram.srcIP[0], datagram.srcIP[1],
+                  datagram.srcIP[2], datagram.srcIP[3], datagram.srcPort);
+         printf("%12lu %12.3f  %-21s  %6u %7.1f %5lu\n", index,
+                (datagram.micros - firstMicros) / 1000.0, source, datagram.length, elapsed,
+                ReplayUdp::txCount - sentBefore);
+      }
+
+      index++;
+   } while (reader.nextFrame(&frameMicros, &frame, &frameLength));
+
+   // whatever the last datagrams set in motion still gets sent
+   runTimersUntil(bonjour, hostMicros() + 10000000);
+
+   MDNSStatistics_t stats;
+   bonjour.getStatistics(&stats);
+
+   double total = 0;
+   for (i = 0; i < (int)timings.size(); i++)
+      total += timings[i];
+   std::sort(timings.begin(), timings.end());
+
+   printf("\n%lu mDNS datagrams replayed, %lu other frames skipped\n", index, skipped);
+   if (!timings.empty())
+      printf("processing time (us): total %.1f, mean %.2f, median %.2f, p99 %.2f, max %.2f\n",
+             total, total / timings.size(), timings[timings.size() / 2],
+             timings[(timings.size() * 99) / 100], timings.back());
+
+   printf("received %lu (%lu bytes): %lu queries, %lu responses, %lu dropped early, "
+          "%lu parse errors, %lu truncated\n",
+          (unsigned long)stats.rxPackets, (unsigned long)stats.rxBytes,
+          (unsigned long)stats.rxQueries, (unsigned long)stats.rxResponses,
+          (unsigned long)stats.rxDropped, (unsigned long)stats.rxParseErrors,
+          (unsigned long)stats.rxTruncated);
+
+   unsigned long sent = 0, sentBytes = 0;
+   for (i = 0; i < NumMDNSPacketTypes; i++)
+   {
+      sent += stats.txPackets[i];
+      sentBytes += stats.txBytes[i];
+   }
+   printf("sent %lu (%lu bytes), %lu send errors, %lu allocation failures\n", sent, sentBytes,
+          (unsigned long)stats.txErrors, (unsigned long)stats.allocFailures);
+
+   return 0;
+}
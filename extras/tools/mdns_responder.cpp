@@ -0,0 +1,267 @@
+//  Copyright (C) 2010 Georg Kaindl
+//  http://gkaindl.com
+//
+//  This file is part of Arduino EthernetBonjour3.
+//
+//  EthernetBonjour3 is free software: you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public License
+//  as published by the Free Software Foundation, either version 3 of
+//  the License, or (at your option) any later version.
+//
+//  EthernetBonjour3 is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with EthernetBonjour3. If not, see
+//  <http://www.gnu.org/licenses/>.
+//
+
+
+// mdns_responder: advertises services and looks up names and services on a real network,
+// with the library running on its own thread (see extras/host/MDNSThread.h).
+//
+// build, from the top of the library:
+//    g++ -std=gnu++11 -O2 -pthread -Iextras/host -Isrc extras/tools/mdns_responder.cpp
+//       -o mdns_responder
+//
+// usage:
+//    mdns_responder [options] -a a.b.c.d
+//       -a a.b.c.d         our address, the one we answer with
+//       -i a.b.c.d         the address of the interface to use (default: the kernel picks)
+//       -n name            our host name (default "arduino")
+//       -S name:port[:udp][@host]
+//                          add a service record, like "Printer._ipp:631", optionally for a
+//                          proxy host, like "Printer._ipp:631@printer" (repeatable)
+//       -P name=a.b.c.d    answer for name.local with a.b.c.d, for a device that doesn't
+//                          speak mDNS itself (repeatable)
+//       -r name            look up the address of name.local (repeatable)
+//       -b type[:udp]      browse for a service type, like "_ipp" (repeatable)
+//       -t seconds         quit after this long (default: on Ctrl-C)
+//
+// the results are printed by the main thread, which the callbacks are handed to.
+
+#include <signal.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include <Arduino.h>
+#include <EthernetBonjour3.h>
+#include <MDNSThread.h>
+
+using namespace mDNS;
+
+// runs the callbacks of the I/O thread on the main thread
+class MainThreadExecutor
+{
+private:
+   std::mutex                         _lock;
+   std::condition_variable            _ready;
+   std::deque<std::function<void()> > _callbacks;
+
+public:
+   void post(const std::function<void()>& callback)
+   {
+      std::lock_guard<std::mutex> guard(this->_lock);
+      this->_callbacks.push_back(callback);
+      this->_ready.notify_one();
+   }
+
+   // runs the callbacks that arrive until deadline
+   void runUntil(std::chrono::steady_clock::time_point deadline, volatile sig_atomic_t* quit)
+   {
+      std::unique_lock<std::mutex> guard(this->_lock);
+
+      while (!*quit && std::chrono::steady_clock::now() < deadline)
+      {
+         // wake up now and then, to notice Ctrl-C
+         this->_ready.wait_for(guard, std::chrono::milliseconds(100));
+
+         while (!this->_callbacks.empty())
+         {
+            std::function<void()> callback = this->_callbacks.front();
+            this->_callbacks.pop_front();
+
+            guard.unlock();
+            callback();
+            guard.lock();
+         }
+      }
+   }
+};
+
+static volatile sig_atomic_t quit = 0;
+
+static void onSignal(int)
+{
+   quit = 1;
+}
+
+static int parseAddress(const char* s, IPAddress* pAddress)
+{
+   unsigned a, b, c, d;
+
+   if (4 != sscanf(s, "%u.%u.%u.%u", &a, &b, &c, &d) || a > 255 || b > 255 || c > 255 || d > 255)
+      return 0;
+
+   *pAddress = IPAddress(a, b, c, d);
+   return 1;
+}
+
+static void usage()
+{
+   fprintf(stderr, "usage: mdns_responder -a address [-i address] [-n name] "
+                   "[-S name:port[:udp][@host]]... [-P name=address]... [-r name]... "
+                   "[-b type[:udp]]... [-t seconds]\n");
+   exit(2);
+}
+
+int main(int argc, char** argv)
+{
+   const char* hostName = MDNS_DEFAULT_NAME;
+   std::vector<const char*> services, proxyHosts, names, types;
+   IPAddress localIP;
+   int haveAddress = 0;
+   long seconds = 0;
+   int i;
+
+   for (i = 1; i < argc; i++)
+   {
+      const char* arg = argv[i];
+
+      if (i + 1 >= argc)
+         usage();
+      else if (0 == strcmp(arg, "-a"))
+      {
+         if (!parseAddress(argv[++i], &localIP))
+            usage();
+         haveAddress = 1;
+      }
+      else if (0 == strcmp(arg, "-i"))
+      {
+         if (!parseAddress(argv[++i], &MDNSPosixUdp::multicastInterface()))
+            usage();
+      }
+      else if (0 == strcmp(arg, "-n"))
+         hostName = argv[++i];
+      else if (0 == strcmp(arg, "-S"))
+         services.push_back(argv[++i]);
+      else if (0 == strcmp(arg, "-P"))
+         proxyHosts.push_back(argv[++i]);
+      else if (0 == strcmp(arg, "-r"))
+         names.push_back(argv[++i]);
+      else if (0 == strcmp(arg, "-b"))
+         types.push_back(argv[++i]);
+      else if (0 == strcmp(arg, "-t"))
+         seconds = atol(argv[++i]);
+      else
+         usage();
+   }
+
+   if (!haveAddress)
+      usage();
+
+   signal(SIGINT, onSignal);
+   signal(SIGTERM, onSignal);
+
+   MainThreadExecutor executor;
+   MDNSResponderThread<> mdns(hostName, [&executor](std::function<void()> callback) {
+      executor.post(callback);
+   });
+
+   for (i = 0; i < (int)proxyHosts.size(); i++)
+   {
+      char name[64];
+      char address[32];
+      IPAddress proxyIP;
+
+      if (2 != sscanf(proxyHosts[i], "%63[^=]=%31s", name, address) || !parseAddress(address, &proxyIP))
+      {
+         fprintf(stderr, "mdns_responder: can't add proxy host %s\n", proxyHosts[i]);
+         continue;
+      }
+
+      mdns.addProxyHost(name, proxyIP);
+   }
+
+   for (i = 0; i < (int)services.size(); i++)
+   {
+      char name[256];
+      unsigned port;
+      char proto[8] = "tcp";
+      char host[64] = "";
+
+      if (sscanf(services[i], "%255[^:]:%u", name, &port) < 2 || port > 0xffff)
+      {
+         fprintf(stderr, "mdns_responder: can't add service %s\n", services[i]);
+         continue;
+      }
+
+      // the rest is ":udp", "@host" or both, in that order
+      const char* rest = strchr(strchr(services[i], ':') + 1, ':');
+      const char* at = strchr(strchr(services[i], ':') + 1, '@');
+
+      if (NULL != rest && (NULL == at || rest < at))
+         sscanf(rest, ":%7[^@]", proto);
+      if (NULL != at)
+         sscanf(at, "@%63s", host);
+
+      MDNSServiceProtocol_t serviceProto = (0 == strcasecmp(proto, "udp")) ? MDNSServiceUDP : MDNSServiceTCP;
+
+      if (0 != host[0])
+         mdns.addProxyServiceRecord(host, name, port, serviceProto);
+      else
+         mdns.addServiceRecord(name, port, serviceProto);
+   }
+
+   if (!mdns.start(localIP))
+   {
+      perror("mdns_responder: can't open the mDNS socket");
+      return 1;
+   }
+
+   for (i = 0; i < (int)names.size(); i++)
+   {
+      std::string name(names[i]);
+
+      mdns.resolve(names[i], 5000, [name](bool found, IPAddress address) {
+         if (found)
+            printf("%s.local: %u.%u.%u.%u\n", name.c_str(), address[0], address[1], address[2],
+                   address[3]);
+         else
+            printf("%s.local: no answer\n", name.c_str());
+      });
+   }
+
+   for (i = 0; i < (int)types.size(); i++)
+   {
+      char type[64];
+      char proto[8] = "tcp";
+
+      if (sscanf(types[i], "%63[^:]:%7s", type, proto) < 1)
+         continue;
+
+      mdns.browse(type, (0 == strcasecmp(proto, "udp")) ? MDNSServiceUDP : MDNSServiceTCP, NULL,
+                  seconds * 1000, [](const MDNSServiceInstance* instance) {
+         if (NULL != instance)
+            printf("%s.%s: %u.%u.%u.%u:%u\n", instance->name.c_str(), instance->type.c_str(),
+                   instance->address[0], instance->address[1], instance->address[2],
+                   instance->address[3], instance->port);
+      });
+   }
+
+   std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+   if (seconds > 0)
+      deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+
+   executor.runUntil(deadline, &quit);
+
+   // sends the goodbyes
+   mdns.stop();
+
+   return 0;
+}
@@ -0,0 +1,290 @@
+//  Copyright (C) 2010 Georg Kaindl
+//  http://gkaindl.com
+//
+//  This file is part of Arduino EthernetBonjour3.
+//
+//  EthernetBonjour3 is free software: you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public License
+//  as published by the Free Software Foundation, either version 3 of
+//  the License, or (at your option) any later version.
+//
+//  EthernetBonjour3 is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with EthernetBonjour3. If not, see
+//  <http://www.gnu.org/licenses/>.
+//
+
+// reads and writes classic libpcap files (not pcapng; "tcpdump -w" and "editcap -F pcap"
+// produce these), and picks the UDP/IPv4 datagrams out of their frames.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define PCAP_MAGIC_MICROS     (0xa1b2c3d4)
+#define PCAP_MAGIC_NANOS      (0xa1b23c4d)
+#define PCAP_SNAPLEN          (65535)
+
+#define PCAP_LINKTYPE_NULL       (0)     // BSD loopback
+#define PCAP_LINKTYPE_ETHERNET   (1)
+#define PCAP_LINKTYPE_RAW        (101)   // bare IP packets
+#define PCAP_LINKTYPE_LINUX_SLL  (113)   // "tcpdump -i any"
+#define PCAP_LINKTYPE_IPV4       (228)
+
+typedef struct _PcapUdpDatagram_t {
+   uint64_t       micros;        // capture time
+   uint8_t        srcIP[4];
+   uint8_t        dstIP[4];
+   uint16_t       srcPort;
+   uint16_t       dstPort;
+   const uint8_t* payload;       // points into the frame
+   uint16_t       length;
+} PcapUdpDatagram_t;
+
+static inline uint16_t _pcapBE16(const uint8_t* p) { return ((uint16_t)p[0] << 8) | p[1]; }
+
+class PcapReader
+{
+private:
+   FILE*    _file;
+   int      _swapped;
+   int      _nanos;
+   uint32_t _linkType;
+   uint8_t  _frame[PCAP_SNAPLEN];
+
+   uint32_t _u32(const uint8_t* p)
+   {
+      uint32_t v;
+      memcpy(&v, p, sizeof(v));
+      return this->_swapped ? __builtin_bswap32(v) : v;
+   }
+
+public:
+   PcapReader() : _file(NULL), _swapped(0), _nanos(0), _linkType(0) {}
+   ~PcapReader() { this->close(); }
+
+   // return values:
+   // 1 on success
+   // 0 if the file can't be read or isn't a classic pcap file
+   int open(const char* path)
+   {
+      uint8_t header[24];
+
+      this->_file = fopen(path, "rb");
+      if (NULL == this->_file || 1 != fread(header, sizeof(header), 1, this->_file))
+         return 0;
+
+      uint32_t magic;
+      memcpy(&magic, header, sizeof(magic));
+      this->_swapped = (PCAP_MAGIC_MICROS != magic && PCAP_MAGIC_NANOS != magic);
+
+      magic = this->_u32(header);
+      if (PCAP_MAGIC_MICROS != magic && PCAP_MAGIC_NANOS != magic)
+         return 0;
+
+      this->_nanos = (PCAP_MAGIC_NANOS == magic);
+      this->_linkType = this->_u32(&header[20]) & 0x0fffffff;
+
+      return 1;
+   }
+
+   void close()
+   {
+      if (NULL != this->_file)
+         fclose(this->_file);
+      this->_file = NULL;
+   }
+
+   uint32_t linkType() const { return this->_linkType; }
+
+   // reads the next frame into our buffer.
+   // return values:
+   // 1 on success, with *pMicros, *pFrame and *pLength set
+   // 0 at the end of the file (or a truncated one)
+   int nextFrame(uint64_t* pMicros, const uint8_t** pFrame, uint32_t* pLength)
+   {
+      uint8_t header[16];
+
+      if (NULL == this->_file || 1 != fread(header, sizeof(header), 1, this->_file))
+         return 0;
+
+      uint32_t sec = this->_u32(&header[0]);
+      uint32_t frac = this->_u32(&header[4]);
+      uint32_t capLen = this->_u32(&header[8]);
+
+      if (capLen > sizeof(this->_frame))
+         return 0;
+      if (capLen > 0 && 1 != fread(this->_frame, capLen, 1, this->_file))
+         return 0;
+
+      *pMicros = (uint64_t)sec * 1000000 + (this->_nanos ? frac / 1000 : frac);
+      *pFrame = this->_frame;
+      *pLength = capLen;
+
+      return 1;
+   }
+
+   // finds the UDP/IPv4 datagram in a frame of our link type. IPv6, fragments and
+   // anything truncated by the capture are skipped.
+   // return values:
+   // 1 if *pDatagram was filled in
+   // 0 otherwise
+   int decodeUdp(const uint8_t* frame, uint32_t length, PcapUdpDatagram_t* pDatagram)
+   {
+      uint32_t offset = 0;
+
+      switch (this->_linkType)
+      {
+      case PCAP_LINKTYPE_NULL:
+         offset = 4;
+         break;
+      case PCAP_LINKTYPE_ETHERNET:
+      {
+         uint16_t etherType;
+
+         offset = 12;
+         do
+         {
+            if (offset + 2 > length)
+               return 0;
+            etherType = _pcapBE16(&frame[offset]);
+            offset += 2;
+            if (0x8100 == etherType || 0x88a8 == etherType)
+               offset += 2; // VLAN tag
+         } while (0x8100 == etherType || 0x88a8 == etherType);
+
+         if (0x0800 != etherType)
+            return 0;
+         break;
+      }
+      case PCAP_LINKTYPE_LINUX_SLL:
+         if (16 > length || 0x0800 != _pcapBE16(&frame[14]))
+            return 0;
+         offset = 16;
+         break;
+      case PCAP_LINKTYPE_RAW:
+      case PCAP_LINKTYPE_IPV4:
+         break;
+      default:
+         return 0;
+      }
+
+      const uint8_t* ip = &frame[offset];
+
+      if (offset + 20 > length || 4 != (ip[0] >> 4) || 17 != ip[9])
+         return 0;
+
+      uint32_t headerLen = (ip[0] & 0x0f) * 4;
+      uint32_t totalLen = _pcapBE16(&ip[2]);
+
+      if (headerLen < 20 || (_pcapBE16(&ip[6]) & 0x3fff) || totalLen < headerLen + 8 ||
+          offset + totalLen > length)
+         return 0;
+
+      const uint8_t* udp = &ip[headerLen];
+      uint16_t udpLen = _pcapBE16(&udp[4]);
+
+      if (udpLen < 8 || headerLen + udpLen > totalLen)
+         return 0;
+
+      memcpy(pDatagram->srcIP, &ip[12], 4);
+      memcpy(pDatagram->dstIP, &ip[16], 4);
+      pDatagram->srcPort = _pcapBE16(&udp[0]);
+      pDatagram->dstPort = _pcapBE16(&udp[2]);
+      pDatagram->payload = &udp[8];
+      pDatagram->length = udpLen - 8;
+
+      return 1;
+   }
+};
+
+// writes UDP/IPv4 datagrams as bare IP packets (PCAP_LINKTYPE_RAW).
+class PcapWriter
+{
+private:
+   FILE* _file;
+
+   void _u32(uint32_t v) { fwrite(&v, sizeof(v), 1, this->_file); }
+
+public:
+   PcapWriter() : _file(NULL) {}
+   ~PcapWriter() { this->close(); }
+
+   // return values:
+   // 1 on success
+   // 0 otherwise
+   int open(const char* path)
+   {
+      this->_file = fopen(path, "wb");
+      if (NULL == this->_file)
+         return 0;
+
+      uint16_t version[2] = { 2, 4 };
+
+      this->_u32(PCAP_MAGIC_MICROS);
+      fwrite(version, sizeof(version), 1, this->_file);
+      this->_u32(0); // time zone
+      this->_u32(0); // timestamp accuracy
+      this->_u32(PCAP_SNAPLEN);
+      this->_u32(PCAP_LINKTYPE_RAW);
+
+      return 1;
+   }
+
+   void close()
+   {
+      if (NULL != this->_file)
+         fclose(this->_file);
+      this->_file = NULL;
+   }
+
+   void writeUdp(uint64_t micros, const uint8_t srcIP[4], uint16_t srcPort,
+                 const uint8_t dstIP[4], uint16_t dstPort, const uint8_t* payload,
+                 uint16_t length)
+   {
+      if (NULL == this->_file || length > PCAP_SNAPLEN - 28)
+         return;
+
+      uint8_t header[28];
+      uint16_t totalLen = length + 28;
+      uint32_t sum = 0;
+      int i;
+
+      memset(header, 0, sizeof(header));
+      header[0] = 0x45;               // IPv4, 20 byte header
+      header[2] = totalLen >> 8;
+      header[3] = totalLen & 0xff;
+      header[8] = 255;                // mDNS wants a TTL of 255
+      header[9] = 17;                 // UDP
+      memcpy(&header[12], srcIP, 4);
+      memcpy(&header[16], dstIP, 4);
+
+      for (i = 0; i < 20; i += 2)
+         sum += _pcapBE16(&header[i]);
+      while (sum >> 16)
+         sum = (sum & 0xffff) + (sum >> 16);
+      header[10] = ~sum >> 8;
+      header[11] = ~sum & 0xff;
+
+      header[20] = srcPort >> 8;
+      header[21] = srcPort & 0xff;
+      header[22] = dstPort >> 8;
+      header[23] = dstPort & 0xff;
+      header[24] = (length + 8) >> 8;
+      header[25] = (length + 8) & 0xff;
+      // no UDP checksum, which IPv4 allows
+
+      this->_u32((uint32_t)(micros / 1000000));
+      this->_u32((uint32_t)(micros % 1000000));
+      this->_u32(totalLen);
+      this->_u32(totalLen);
+      fwrite(header, sizeof(header), 1, this->_file);
+      fwrite(payload, length, 1, this->_file);
+   }
+};
@@ -32,6 +32,10 @@ typedef uint8_t byte;
 #include "EthernetBonjour3_Namespace.h"
 
 #include "utility/endian.h"
+#include "utility/IPv6Address.h"
+#include "utility/UdpTraits.h"
+#include "utility/Features.h"
+#include "utility/Arena.h"
 
 BEGIN_MDNS_NAMESPACE
 
@@ -40,6 +44,45 @@ typedef enum _MDNSState_t {
    MDNSStateQuerySent
 } MDNSState_t;
 
+typedef enum _MDNSProbeState_t {
+   MDNSProbeStateStopped,
+   MDNSProbeStateProbing,
+   MDNSProbeStateDone
+} MDNSProbeState_t;
+
+typedef enum _MDNSTimer_t {
+   MDNSTimerAddressResend,
+   MDNSTimerProbe,
+   MDNSTimerAnnounce,
+   MDNSTimerRefresh,
+   MDNSTimerServiceRefresh,
+   NumMDNSTimers
+} MDNSTimer_t;
+
+typedef enum _MDNSPacketType_t {
+   MDNSPacketTypeMyIPAnswer,
+   MDNSPacketTypeNegativeAnswer,
+   MDNSPacketTypeServiceRecord,
+   MDNSPacketTypeServiceRecordRelease,
+   MDNSPacketTypeNameQuery,
+   MDNSPacketTypeServiceQuery,
+   MDNSPacketTypeAddressQuery,
+   MDNSPacketTypeProbe,
+   MDNSPacketTypeGoodbye,
+   MDNSPacketTypeAddressGoodbye,
+   MDNSPacketTypeAnnounce,
+   MDNSPacketTypeServiceTxt,
+   MDNSPacketTypeServiceSubtype,
+   MDNSPacketTypeHostRefresh,
+   MDNSPacketTypeServiceRefresh,
+   MDNSPacketTypeProxyHostAnswer,
+   MDNSPacketTypeProxyHostGoodbye,
+   MDNSPacketTypeServiceInstanceAnswer,
+   NumMDNSPacketTypes
+} MDNSPacketType_t;
+
+#define  MDNS_NO_WAKEUP          ((unsigned long)-1)
+
 typedef enum _MDNSError_t {
    MDNSTryLater = 3,
    MDNSNothingToDo = 2,
@@ -65,74 +108,331 @@ typedef enum _MDNSServiceProtocol_t {
 
 typedef MDNSServiceProtocol_t MDNSServiceProtocol;
 
+#define  NumMDNSServiceSubtypes  (2)
+
+// the parts of a service record that point to constants instead of the heap, so that they
+// aren't freed. records of a static table (see MDNS_STATIC_SERVICE) start with all of them.
+#define  MDNS_STATIC_RECORD      (0x01)   // the record itself
+#define  MDNS_STATIC_NAME        (0x02)
+#define  MDNS_STATIC_SERVNAME    (0x04)
+#define  MDNS_STATIC_TXT         (0x08)
+#define  MDNS_STATIC_ALL         (0x0f)
+
 typedef struct _MDNSServiceRecord_t {
    uint16_t                port;
    MDNSServiceProtocol_t   proto;
    uint8_t*                name;
    uint8_t*                servName;
-   uint8_t*                textContent;
+   uint8_t*                textContent; // TXT rdata in wire form: length-prefixed strings
+   uint16_t                textLength;
+   uint8_t*                subtypes[NumMDNSServiceSubtypes]; // "_printer._sub._http._tcp.local"
+   uint8_t                 probed;
+   uint8_t                 staticParts; // MDNS_STATIC_... flags
+   uint8_t                 host;        // the SRV target: 0 for us, 1 + the index of a proxy host
 } MDNSServiceRecord_t;
 
+#define  MDNS_STATIC_PROTO_tcp   (MDNS_NAMESPACE::MDNSServiceTCP)
+#define  MDNS_STATIC_PROTO_udp   (MDNS_NAMESPACE::MDNSServiceUDP)
+
+// a service record known at compile time, for tables of them like
+//    MDNSServiceRecord_t services[] = {
+//       MDNS_STATIC_SERVICE("Web", "_http", tcp, 80, "\x7path=/2"),
+//       MDNS_STATIC_SERVICE("Sensor", "_osc", udp, 9000, "")
+//    };
+// that addServiceRecords() takes. all names are put together by the compiler, and the table
+// is initialized statically, so nothing is copied to the heap. instance, type and txt have to
+// be string literals, proto is tcp or udp. txt is the TXT rdata in wire form, and may contain
+// zero bytes.
+#define  MDNS_STATIC_SERVICE(instance, type, proto, port, txt)                             \
+   { (port), MDNS_STATIC_PROTO_##proto, (uint8_t*)(instance "." type),                      \
+     (uint8_t*)(type "._" #proto ".local"), (uint8_t*)(txt), (uint16_t)(sizeof(txt) - 1),   \
+     { NULL }, 0, MDNS_STATIC_ALL, 0 }
+
+// identifies a lookup started with resolveNameAsync() or discoverServiceAsync(). a handle
+// isn't handed out again soon after its lookup ended, so a stale one doesn't cancel the
+// lookup of somebody else.
+typedef uint16_t MDNSHandle_t;
+
+#define  MDNS_INVALID_HANDLE     (0)
+
+// the callbacks of those lookups get the context passed along with the callback, and the
+// handle of the lookup they report on.
+typedef void (*MDNSNameResolvedCallback)(void*, MDNSHandle_t, const char*, const byte[4]);
+typedef void (*MDNSServiceFoundCallback)(void*, MDNSHandle_t, const char*, MDNSServiceProtocol_t,
+                                         const char*, const byte[4], unsigned short, const char*);
+
+typedef struct _MDNSQuery_t {
+   uint8_t*                 name;            // "printer.local", "_ipp._tcp.local", NULL if unused
+   MDNSHandle_t             handle;
+   uint8_t                  isService;       // browsing for instances of name, not resolving it
+   MDNSServiceProtocol_t    proto;
+   uint8_t                  subtypeLength;   // "_color._sub." when browsing for a subtype
+   uint8_t                  hasTimeout;
+   unsigned long            resendDeadline;
+   unsigned long            timeoutDeadline;
+   MDNSNameResolvedCallback nameCallback;
+   MDNSServiceFoundCallback serviceCallback;
+   void*                    context;
+} MDNSQuery_t;
+
+typedef struct _MDNSPendingService_t {
+   uint8_t*                name;
+   uint8_t*                target;
+   uint8_t*                txt;
+   uint16_t                port;
+   uint8_t                 tries;
+   MDNSHandle_t            query;   // the browse that found it
+} MDNSPendingService_t;
+
+// counters for telemetry, see getStatistics(). they wrap around on overflow.
+typedef struct _MDNSStatistics_t {
+   uint32_t                rxPackets;       // datagrams received
+   uint32_t                rxBytes;
+   uint32_t                rxQueries;       // datagrams parsed as queries...
+   uint32_t                rxResponses;     // ...or responses
+   uint32_t                rxDropped;       // datagrams dropped after looking at their header
+   uint32_t                rxParseErrors;   // datagrams too short, or with questions past their end
+   uint32_t                rxTruncated;     // queries with the TC bit set
+   uint32_t                txPackets[NumMDNSPacketTypes];
+   uint32_t                txBytes[NumMDNSPacketTypes];
+   uint32_t                txErrors;        // datagrams the socket refused to send
+   uint32_t                allocFailures;   // datagrams we had no memory for
+   unsigned long           maxRunMicros;    // the longest run() so far
+} MDNSStatistics_t;
+
 typedef void (*BonjourNameFoundCallback)(const char*, const byte[4]);
+typedef void (*BonjourNameRegisteredCallback)(const char*);
 typedef void (*BonjourServiceFoundCallback)(const char*, MDNSServiceProtocol_t, const char*,
                                             const byte[4], unsigned short, const char*);
 
 #define  NumMDNSServiceRecords   (8)
+#define  NumMDNSPendingServices  (4)
+#define  NumMDNSQueries          (4)   // lookups running at the same time, at most 8
+#define  NumMDNSInterfaces       (2)
+#define  NumMDNSProxyHosts       (8)   // hosts we answer for on behalf of others, at most 255
 
+// a host we answer for in place of a device that doesn't speak mDNS itself (see
+// addProxyHost()). its name is probed for and announced along with ours, and service
+// records can point to it instead of to us.
+typedef struct _MDNSProxyHost_t {
+   uint8_t*                name;       // "printer.local", NULL if unused
+   IPAddress               address;
+   uint8_t                 probed;
+   uint8_t                 askedFor;   // MDNS_PROXY_ASKED_... flags, while we answer a query
+} MDNSProxyHost_t;
+
+// everything we keep per network interface: the socket, and the addresses we answer with
+// for queries that arrive on it. service records and queries are shared by all of them.
 template <class UdpClass>
+struct MDNSInterface_t {
+   UdpClass                socket;
+   IPAddress               localIP;
+   IPv6Address             localIPv6;
+   uint8_t                 active;
+   uint8_t                 hasIPv6;
+   uint8_t                 ipv6Multicast;
+};
+
+// Features is an MDNSFeatures policy, which selects the parts of the protocol compiled in
+template <class UdpClass, class Features = MDNSAllFeatures>
 class EthernetBonjour3Class
 {
 private:
- 	UdpClass _socket;
+   typedef typename Features::LogPolicy Log;
 
-   IPAddress _localIP;
+   // a build without the service browser has no services waiting for an address. the table
+   // keeps a single unused slot then, since there are no zero-length arrays.
+   enum { _numPendingServices = Features::browser ? NumMDNSPendingServices : 0 };
+   enum { _numQueries = (Features::resolver || Features::browser) ? NumMDNSQueries : 0 };
+   enum { _numProxyHosts = Features::proxy ? NumMDNSProxyHosts : 0 };
+
+   MDNSInterface_t<UdpClass>  _interfaces[NumMDNSInterfaces];
+   MDNSInterface_t<UdpClass>* _iface; // the one we're receiving from or sending on right now
 
    MDNSDataInternal_t    _mdnsData;
    MDNSState_t           _state;
+   uint8_t              _runMaxPackets;
+   unsigned long        _runMaxMicros;
+   uint8_t              _runFirstInterface; // where the next run() starts reading
+   uint8_t              _interruptMode;
+   volatile uint8_t     _rxPending;
+   MDNSArena*           _arena; // where names and records live, NULL for the heap
+   uint8_t              _running;
    uint8_t*             _bonjourName;
    MDNSServiceRecord_t* _serviceRecords[NumMDNSServiceRecords];
-   unsigned long        _lastAnnounceMillis;
-   
-   uint8_t*             _resolveNames[2];
-   unsigned long        _resolveLastSendMillis[2];
-   unsigned long        _resolveTimeouts[2];
+   MDNSProxyHost_t      _proxyHosts[_numProxyHosts > 0 ? _numProxyHosts : 1];
+
+   MDNSProbeState_t     _probeState;
+   uint8_t              _probeCount;
+   uint8_t              _probeConflicts;
+   uint8_t              _hostProbed;
+
+   uint8_t              _announceCount;
+
+   uint32_t             _hostTTL;
+   uint32_t             _serviceTTL;
+
+   unsigned long        _timerDeadlines[NumMDNSTimers];
+   uint16_t             _timersArmed;
    
-   MDNSServiceProtocol_t _resolveServiceProto;
+   MDNSQuery_t          _queries[_numQueries > 0 ? _numQueries : 1];
+   uint16_t             _querySerial;
+   MDNSHandle_t         _legacyQueries[2]; // of resolveName() and startDiscoveringService()
+
+   MDNSPendingService_t _pendingServices[_numPendingServices > 0 ? _numPendingServices : 1];
    
+   MDNSStatistics_t     _stats;
+
    BonjourNameFoundCallback      _nameFoundCallback;
    BonjourServiceFoundCallback   _serviceFoundCallback;
+   BonjourNameRegisteredCallback _nameRegisteredCallback;
 
    MDNSError_t _processMDNSQuery();
+   uint16_t _readPacketHead(uint16_t udpLen, uint8_t* head);
+   int _wantPacket(uint16_t udpLen, const uint8_t* head, uint16_t headLen);
+   int _matchFirstLabel(const uint8_t* name, const uint8_t* label, uint8_t len);
+   int _hasOwnedRecord(const uint8_t* pkt, uint16_t pktLen);
    MDNSError_t _sendMDNSMessage(uint32_t peerAddress, uint32_t xid, int type, int serviceRecord);
+   MDNSError_t _sendMDNSMessageOnInterface(uint32_t peerAddress, uint32_t xid, int type,
+                                           int serviceRecord);
+   uint16_t _writeMDNSMessage(const struct _DNSHeader_t* dnsHeader, int type, int serviceRecord);
+   int _countSentPacket(int type, uint16_t len, int sent);
+
+   void* _alloc(uint16_t size, void* owner);
+   void _free(void* p);
+   void _setOwner(void* p, void* owner);
+   void _compactArena();
 
 
    void _writeDNSName(const uint8_t* name, uint16_t* pPtr, uint8_t* buf, int bufSize,
                       int zeroTerminate);
-   void _writeMyIPAnswerRecord(uint16_t* pPtr, uint8_t* buf, int bufSize);
+   void _writeAddressRecord(const uint8_t* name, const IPAddress& address, uint16_t* pPtr,
+                            uint8_t* buf, int bufSize, uint32_t ttl, uint8_t cacheFlush);
+   void _writeMyIPAnswerRecord(uint16_t* pPtr, uint8_t* buf, int bufSize, uint32_t ttl,
+                               uint8_t cacheFlush);
+   void _writeHostRecords(uint8_t host, uint16_t* pPtr, uint8_t* buf, int bufSize, uint32_t ttl,
+                          uint8_t cacheFlush);
+   void _writeMyIPv6AnswerRecord(uint16_t* pPtr, uint8_t* buf, int bufSize, uint32_t ttl,
+                                 uint8_t cacheFlush);
    void _writeServiceRecordName(int recordIndex, uint16_t* pPtr, uint8_t* buf, int bufSize, int tld);
+   void _writeServiceRecordSRV(int recordIndex, uint16_t* pPtr, uint8_t* buf, int bufSize,
+                               uint32_t ttl, uint8_t cacheFlush);
+   void _writeServiceRecordTXT(int recordIndex, uint16_t* pPtr, uint8_t* buf, int bufSize,
+                               uint32_t ttl);
    void _writeServiceRecordPTR(int recordIndex, uint16_t* pPtr, uint8_t* buf, int bufSize,
                                uint32_t ttl);
+   void _writeDNSSDServicePTR(int recordIndex, uint16_t* pPtr, uint8_t* buf, int bufSize,
+                              uint32_t ttl);
+   void _writeServiceSubtypePTR(int recordIndex, int subtype, uint16_t* pPtr, uint8_t* buf,
+                                int bufSize, uint32_t ttl);
+   void _writeNSECRecord(int recordIndex, uint16_t* pPtr, uint8_t* buf, int bufSize, uint32_t ttl);
    
-   int _initQuery(uint8_t idx, const char* name, unsigned long timeout);
-   void _cancelQuery(uint8_t idx);
+   int _beginInterface(uint8_t index, IPAddress localIP);
+   int _hasIPv6();
+
+   void _armTimer(MDNSTimer_t timer, unsigned long now, unsigned long delay);
+   void _disarmTimer(MDNSTimer_t timer);
+   int _timerExpired(MDNSTimer_t timer, unsigned long now);
+
+   int _newQuery(uint8_t* name);
+   MDNSHandle_t _startQuery(int idx, unsigned long timeout);
+   MDNSError_t _sendQuery(int idx, unsigned long now);
+   int _findQuery(MDNSHandle_t handle);
+   int _hasQueries();
+   void _cancelQuery(int idx);
+   void _finishedResolvingName(int idx, const byte ipAddr[4]);
+   void _queryTypeName(const MDNSQuery_t* query, char* typeName);
+   static void _legacyNameResolved(void* context, MDNSHandle_t handle, const char* name,
+                                   const byte ipAddr[4]);
+   static void _legacyServiceFound(void* context, MDNSHandle_t handle, const char* type,
+                                   MDNSServiceProtocol_t proto, const char* name,
+                                   const byte ipAddr[4], unsigned short port, const char* txt);
    
    uint8_t* _findFirstDotFromRight(const uint8_t* str);
    
    void _removeServiceRecord(int idx);
-   
-   int _matchStringPart(const uint8_t** pCmpStr, int* pCmpLen, const uint8_t* buf,
-                        int dataLen);
+   int _addServiceRecord(const char* name, uint16_t port, MDNSServiceProtocol_t proto,
+                         const char* textContent, uint8_t host);
+   int _findServiceRecord(const char* name, MDNSServiceProtocol_t proto);
+   int _findTxtEntry(const MDNSServiceRecord_t* record, const char* key, uint16_t* pOffset);
+   int _setTxtContent(MDNSServiceRecord_t* record, const uint8_t* content, uint16_t length);
+   int _countServiceSubtypes(int idx);
+   void _processSubtypeQueries(const uint8_t* pkt, uint16_t pktLen, uint16_t qCnt,
+                               uint8_t* subtypesAskedFor);
    
    const uint8_t* _postfixForProtocol(MDNSServiceProtocol_t proto);
-   
-   void _finishedResolvingName(char* name, const byte ipAddr[4]);
+
+   int _addPendingService(uint8_t* name, uint8_t* target, uint8_t* txt, uint16_t port,
+                          MDNSHandle_t query);
+   void _removePendingService(int idx);
+   void _cancelPendingServices(MDNSHandle_t query);
+   int _hasPendingServices();
+   int _findPendingTarget(const uint8_t* target);
+   void _processPendingServices(const uint8_t* pkt, uint16_t pktLen, uint16_t qCnt,
+                                uint16_t recordCnt);
+
+   int _processQuestions(const uint8_t* pkt, uint16_t pktLen, uint16_t qCnt,
+                         uint8_t* recordsAskedFor, uint8_t* pHostRecordMissing);
+   int _processResponse(const uint8_t* pkt, uint16_t pktLen, uint16_t qCnt, uint16_t recordCnt);
+
+   int _nextDNSQuestion(const uint8_t* pkt, uint16_t pktLen, uint16_t* pOffset,
+                        struct _DNSRecord_t* pRecord);
+   int _nextDNSRecord(const uint8_t* pkt, uint16_t pktLen, uint16_t* pOffset,
+                      struct _DNSRecord_t* pRecord);
+   int _skipDNSQuestions(const uint8_t* pkt, uint16_t pktLen, uint16_t* pOffset, uint16_t qCnt);
+   int _nextDNSLabel(const uint8_t* pkt, uint16_t pktLen, uint16_t* pOffset, int* pHops);
+   uint16_t _skipDNSName(const uint8_t* pkt, uint16_t pktLen, uint16_t offset);
+   int _readDNSName(const uint8_t* pkt, uint16_t pktLen, uint16_t offset, uint8_t* name,
+                    int nameSize);
+   int _matchDNSName(const uint8_t* pkt, uint16_t pktLen, uint16_t offset, const uint8_t* name,
+                     const uint8_t* suffix = NULL);
+   int _compareDNSName(const uint8_t* pkt, uint16_t pktLen, uint16_t offset, const uint8_t* name);
+   int _matchDNSNames(const uint8_t* pkt, uint16_t pktLen, uint16_t offset1, uint16_t offset2);
+   int _readDNSLabel(const uint8_t* pkt, uint16_t pktLen, uint16_t offset, uint8_t* label,
+                     int labelSize);
+
+   void _startProbing(unsigned long delay);
+   void _finishedProbing();
+   void _startAnnouncing();
+   void _announce();
+   unsigned long _refreshDelay(uint32_t ttl);
+   void _processProbeConflicts(const uint8_t* pkt, uint16_t pktLen, uint8_t isResponse,
+                               uint16_t qCnt, uint16_t aCnt, uint16_t aaCnt, uint16_t addCnt);
+   int _compareProbeRecord(int recordIndex, const uint8_t* pkt, uint16_t pktLen, uint16_t type,
+                           uint16_t cls, uint16_t offset, uint16_t dataLen);
+   int _numberedHostName(const uint8_t* name, uint8_t** pName);
+   int _renameBonjourName();
+   int _renameServiceRecord(int idx);
+
+   const uint8_t* _hostName(uint8_t host);
+   uint16_t _hostRecordCount(uint8_t host);
+   int _findProxyHost(const char* name);
+   uint16_t _countProxyHosts(uint8_t probed);
+   void _removeProxyHost(int idx);
+   int _renameProxyHost(int idx);
 
 public:
    EthernetBonjour3Class(const char* bonjourName);
-   virtual ~EthernetBonjour3Class() {};
+   virtual ~EthernetBonjour3Class();
    
    int begin(IPAddress localIP);
-   void run();
+   int addInterface(IPAddress localIP);
+   int setLocalIPv6(const IPv6Address& localIPv6, uint8_t interfaceIndex = 0);
+   int updateLocalIP(IPAddress localIP, uint8_t interfaceIndex = 0);
+   void end();
+   int run();
+
+   void setRunBudget(uint8_t maxPackets, unsigned long maxMicros);
+   void setInterruptMode(int enabled);
+   void notifyPacketAvailable();
+   unsigned long nextWakeupMillis();
+
+   void setRecordTTLs(uint32_t hostTTL, uint32_t serviceTTL);
+
+   int setArena(MDNSArena* arena);
+
+   void getStatistics(MDNSStatistics_t* stats);
+   void resetStatistics();
    
    int setBonjourName(const char* bonjourName);
    
@@ -140,11 +440,30 @@ public:
    int addServiceRecord(const char* name, uint16_t port, MDNSServiceProtocol_t proto,
                         const char* textContent);
    
+   int addServiceRecords(MDNSServiceRecord_t* records, uint8_t count);
+
+   int addProxyHost(const char* name, IPAddress address);
+   void removeProxyHost(const char* name);
+   int addProxyServiceRecord(const char* hostName, const char* name, uint16_t port,
+                             MDNSServiceProtocol_t proto, const char* textContent = NULL);
+
    void removeServiceRecord(uint16_t port, MDNSServiceProtocol_t proto);
    void removeServiceRecord(const char* name, uint16_t port, MDNSServiceProtocol_t proto);
       
    void removeAllServiceRecords();
+
+   int setServiceTxt(const char* name, MDNSServiceProtocol_t proto, const char* key,
+                     const uint8_t* value, uint8_t valueLength);
+   int setServiceTxt(const char* name, MDNSServiceProtocol_t proto, const char* key,
+                     const char* value);
+   int removeServiceTxt(const char* name, MDNSServiceProtocol_t proto, const char* key);
+   int updateTxt(const char* name, MDNSServiceProtocol_t proto);
+
+   int addServiceSubtype(const char* name, MDNSServiceProtocol_t proto, const char* subtype);
    
+   void setNameRegisteredCallback(BonjourNameRegisteredCallback newCallback);
+   int isNameRegistered();
+
    void setNameResolvedCallback(BonjourNameFoundCallback newCallback);
    int resolveName(const char* name, unsigned long timeout);
    void cancelResolveName();
@@ -153,8 +472,18 @@ public:
    void setServiceFoundCallback(BonjourServiceFoundCallback newCallback);
    int startDiscoveringService(const char* serviceName, MDNSServiceProtocol_t proto,
                                unsigned long timeout);
+   int startDiscoveringService(const char* serviceName, MDNSServiceProtocol_t proto,
+                               const char* subtype, unsigned long timeout);
    void stopDiscoveringService();
    int isDiscoveringService();
+
+   MDNSHandle_t resolveNameAsync(const char* name, unsigned long timeout,
+                                 MDNSNameResolvedCallback callback, void* context);
+   MDNSHandle_t discoverServiceAsync(const char* serviceName, MDNSServiceProtocol_t proto,
+                                     const char* subtype, unsigned long timeout,
+                                     MDNSServiceFoundCallback callback, void* context);
+   int cancelRequest(MDNSHandle_t handle);
+   int isRequestActive(MDNSHandle_t handle);
 };
 
 END_MDNS_NAMESPACE
@@ -24,6 +24,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 
 #include "EthernetBonjour3_Namespace.h"
 
@@ -35,22 +36,81 @@ BEGIN_MDNS_NAMESPACE
 #define MDNS_SERVER_PORT (5353)
 #define MDNS_NQUERY_RESEND_TIME (1000)	// 1 second, name query resend timeout
 #define MDNS_SQUERY_RESEND_TIME (10000) // 10 seconds, service query resend timeout
-#define MDNS_RESPONSE_TTL (2*60)		// two minutes (in seconds)
-#define MDNS_RESPONSE_TTL_10 (10*60)	// ten minutes (in seconds)
+#define MDNS_AQUERY_RESEND_TIME (1000)	// 1 second, SRV target address query resend timeout
+#define MDNS_AQUERY_MAX_TRIES (3)		// give up on a SRV target after this many address queries
+#define MDNS_HOST_RECORD_TTL (2*60)		// two minutes (in seconds), records with our host name: A, AAAA, SRV
+#define MDNS_SERVICE_RECORD_TTL (75*60)	// 75 minutes (in seconds), all other records: PTR, TXT
+#define MDNS_REFRESH_PERCENT (80)		// re-announce records when this much of their TTL has passed
+#define MDNS_PROBE_WAIT (250)			// 250 ms between probes
+#define MDNS_PROBE_COUNT (3)			// number of probes before we own a name
+#define MDNS_PROBE_DEFER (1000)			// 1 second, wait after losing a simultaneous probe tiebreak
+#define MDNS_PROBE_MAX_CONFLICTS (15)	// after this many conflicts, slow down probing...
+#define MDNS_PROBE_RATE_LIMIT (5000)	// ...to one probe cycle every 5 seconds
+#define MDNS_ANNOUNCE_COUNT (3)			// number of announcements after claiming a name
+#define MDNS_ANNOUNCE_INTERVAL (1000)	// 1 second between the first announcements, doubling after that
 
 #define MDNS_MAX_SERVICES_PER_PACKET (6)
+#define MDNS_RUN_MAX_PACKETS (8)	  // default max. number of datagrams handled per run()
+#define MDNS_RUN_MAX_MICROS (0)		  // default max. time spent handling datagrams per run(), 0: no limit
+#define MDNS_MAX_NAME_HOPS (8) // max. number of compression pointers followed per name
+#define MDNS_MAX_TXT_LENGTH (400)		// max. size of the TXT rdata of a service, in bytes
+#define MDNS_MAX_LABEL_LEN (63)			// max. length of a single DNS label
+#define MDNS_HANDLE_SLOT_BITS (3)		// low bits of a query handle, its index in _queries
+#define MDNS_PROXY_ASKED_ADDRESS (0x01)	// a query asks for the address of a proxy host...
+#define MDNS_PROXY_ASKED_MISSING (0x02)	// ...or for a type of record it doesn't have
+#define MDNS_SERVICE_ASKED_PTR (0x01)		// a query browses for the type of a service...
+#define MDNS_SERVICE_ASKED_INSTANCE (0x02)	// ...asks for the SRV or TXT of its instance...
+#define MDNS_SERVICE_ASKED_MISSING (0x04)	// ...or for a type of record the instance doesn't have
+
+// record indexes below 0 stand for host names: -1 for ours, -2 for the first proxy host...
+#define MDNS_HOST_RECORD(host) (-1 - (int)(host))
 
 static uint8_t mdnsMulticastIPAddr[] = {224, 0, 0, 251};
+static const uint8_t mdnsMulticastIPv6Addr[] = {0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xfb};
 
-typedef enum _MDNSPacketType_t
+// compares len bytes of a label from a packet to the start of a string, ignoring case. unlike
+// strncasecmp(), a zero byte in the label doesn't end the comparison early.
+// return values:
+// 1 if they are equal
+// 0 otherwise (also if str is shorter than len)
+static inline int mdnsLabelEquals(const uint8_t *str, const uint8_t *label, uint8_t len)
+{
+	uint8_t i;
+
+	for (i = 0; i < len; i++)
+		if (0 == str[i] || tolower(str[i]) != tolower(label[i]))
+			return 0;
+
+	return 1;
+}
+
+// compares two dotted names, ignoring case.
+// return values:
+// 1 if they are equal
+// 0 otherwise
+static inline int mdnsNameEquals(const uint8_t *a, const uint8_t *b)
+{
+	for (; 0 != *a; a++, b++)
+		if (tolower(*a) != tolower(*b))
+			return 0;
+
+	return (0 == *b);
+}
+
+// return value:
+// the length to which the first len bytes of str have to be cut to fit into maxLen bytes.
+// a UTF-8 character isn't cut in half.
+static inline int mdnsTrimLabel(const uint8_t *str, int len, int maxLen)
 {
-	MDNSPacketTypeMyIPAnswer,
-	MDNSPacketTypeNoIPv6AddrAvailable,
-	MDNSPacketTypeServiceRecord,
-	MDNSPacketTypeServiceRecordRelease,
-	MDNSPacketTypeNameQuery,
-	MDNSPacketTypeServiceQuery,
-} MDNSPacketType_t;
+	if (len <= maxLen)
+		return len;
+
+	len = maxLen;
+	while (len > 0 && 0x80 == (str[len] & 0xc0))
+		len--;
+
+	return len;
+}
 
 typedef struct _DNSHeader_t
 {
@@ -71,6 +131,17 @@ typedef struct _DNSHeader_t
 	uint16_t additionalCount;
 } __attribute__((__packed__)) DNSHeader_t;
 
+// where the parts of a question or resource record are in a received packet. questions
+// have no TTL and data, so dataOffset and dataLength are 0 for them.
+typedef struct _DNSRecord_t
+{
+	uint16_t nameOffset;
+	uint16_t type;
+	uint16_t cls;
+	uint16_t dataOffset;
+	uint16_t dataLength;
+} DNSRecord_t;
+
 typedef enum _DNSOpCode_t
 {
 	DNSOpQuery = 0,
@@ -80,1490 +151,4416 @@ typedef enum _DNSOpCode_t
 	DNSOpUpdate = 5
 } DNSOpCode_t;
 
-template <class UdpClass>
-EthernetBonjour3Class<UdpClass>::EthernetBonjour3Class(const char *bonjourName)
+template <class UdpClass, class Features>
+EthernetBonjour3Class<UdpClass, Features>::EthernetBonjour3Class(const char *bonjourName)
 {
 	memset(&this->_mdnsData, 0, sizeof(MDNSDataInternal_t));
 	memset(&this->_serviceRecords, 0, sizeof(this->_serviceRecords));
 
+	for (int i = 0; i < _numProxyHosts; i++)
+	{
+		this->_proxyHosts[i].name = NULL;
+		this->_proxyHosts[i].probed = 0;
+		this->_proxyHosts[i].askedFor = 0;
+	}
+
 	this->_state = MDNSStateIdle;
 
+	for (int i = 0; i < NumMDNSInterfaces; i++)
+	{
+		this->_interfaces[i].active = 0;
+		this->_interfaces[i].hasIPv6 = 0;
+		this->_interfaces[i].ipv6Multicast = 0;
+	}
+	this->_iface = NULL;
+
+	this->_runMaxPackets = MDNS_RUN_MAX_PACKETS;
+	this->_runMaxMicros = MDNS_RUN_MAX_MICROS;
+	this->_runFirstInterface = 0;
+	this->_interruptMode = 0;
+	this->_rxPending = 0;
+
+	this->_probeState = MDNSProbeStateStopped;
+	this->_probeCount = 0;
+	this->_probeConflicts = 0;
+	this->_hostProbed = 0;
+	this->_announceCount = 0;
+
+	this->_hostTTL = MDNS_HOST_RECORD_TTL;
+	this->_serviceTTL = MDNS_SERVICE_RECORD_TTL;
+
+	this->_timersArmed = 0;
+	memset(&this->_timerDeadlines, 0, sizeof(this->_timerDeadlines));
+
+	this->_nameFoundCallback = NULL;
+	this->_serviceFoundCallback = NULL;
+	this->_nameRegisteredCallback = NULL;
+
+	this->_arena = NULL;
+	this->_running = 0;
+
 	this->_bonjourName = NULL;
 	this->setBonjourName(bonjourName);
 
-	this->_resolveNames[0] = NULL;
-	this->_resolveNames[1] = NULL;
+	memset(&this->_queries, 0, sizeof(this->_queries));
+	this->_querySerial = 0;
+	this->_legacyQueries[0] = this->_legacyQueries[1] = MDNS_INVALID_HANDLE;
 
-	this->_lastAnnounceMillis = 0;
+	memset(&this->_pendingServices, 0, sizeof(this->_pendingServices));
+	memset(&this->_stats, 0, sizeof(this->_stats));
+}
+
+template <class UdpClass, class Features>
+EthernetBonjour3Class<UdpClass, Features>::~EthernetBonjour3Class()
+{
+	int i;
+
+	this->end();
+
+	for (i = 0; i < _numQueries; i++)
+		this->_cancelQuery(i);
+
+	this->removeAllServiceRecords();
+
+	for (i = 0; i < _numProxyHosts; i++)
+		this->_free(this->_proxyHosts[i].name);
+
+	this->_free(this->_bonjourName);
 }
 
 // return values:
 // 1 on success
 // 0 otherwise
-template <class UdpClass>
-int EthernetBonjour3Class<UdpClass>::begin(IPAddress localIP)
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::begin(IPAddress localIP)
 {
-	// if we were called very soon after the board was booted, we need to give the
-	// EthernetShield (WIZnet) some time to come up. Hence, we delay until millis() is at
-	// least 3000. This is necessary, so that if we need to add a service record directly
-	// after begin, the announce packet does not get lost in the bowels of the WIZnet chip.
-	//while (millis() < 3000) delay(100);
-
-	_localIP = localIP;
+	// we don't wait for anything here: nothing is sent before the first probe, which run()
+	// sends a little later, so a service record added directly after begin doesn't get lost
+	// in the bowels of the WIZnet chip while it comes up.
+	int status = this->_beginInterface(0, localIP);
 
-	Serial.println(localIP);
-	Serial.println(_localIP);
+	// probe for our names before we claim them. the initial delay is derived from our
+	// address, so that a fleet of boards powered up together doesn't probe in lockstep.
+	this->_probeState = MDNSProbeStateDone;
+	this->_startProbing(localIP[3] % MDNS_PROBE_WAIT);
 
-	return _socket.beginMulticast(mdnsMulticastIPAddr, MDNS_SERVER_PORT);
+	return status;
 }
 
+// makes us respond on one more network segment, with its own socket and address. queries
+// arriving there are answered with localIP. call this after begin().
 // return values:
 // 1 on success
 // 0 otherwise
-template <class UdpClass>
-int EthernetBonjour3Class<UdpClass>::_initQuery(uint8_t idx, const char *name, unsigned long timeout)
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::addInterface(IPAddress localIP)
 {
-	Serial.println("_initQuery");
-
-	int statusCode = 0;
+	int i;
 
-	if (NULL == this->_resolveNames[idx] && NULL != ((0 == idx) ? (void *)this->_nameFoundCallback : (void *)this->_serviceFoundCallback))
-	{
-		this->_resolveNames[idx] = (uint8_t *)name;
+	if (MDNSProbeStateStopped == this->_probeState)
+		return 0;
 
-		if (timeout)
-			this->_resolveTimeouts[idx] = millis() + timeout;
-		else
-			this->_resolveTimeouts[idx] = 0;
+	for (i = 1; i < NumMDNSInterfaces; i++)
+		if (!this->_interfaces[i].active)
+			break;
 
-		statusCode = (MDNSSuccess == this->_sendMDNSMessage(0,
-															0,
-															(idx == 0) ? MDNSPacketTypeNameQuery : MDNSPacketTypeServiceQuery,
-															0));
-	}
-	else
-		free((void *)name);
+	if (i >= NumMDNSInterfaces || !this->_beginInterface(i, localIP))
+		return 0;
 
-	return statusCode;
-}
+	// the names we have already claimed are news on this segment
+	if (this->_hostProbed)
+		this->_startAnnouncing();
 
-template <class UdpClass>
-void EthernetBonjour3Class<UdpClass>::_cancelQuery(uint8_t idx)
-{
-	if (NULL != this->_resolveNames[idx])
-	{
-		free(this->_resolveNames[idx]);
-		this->_resolveNames[idx] = NULL;
-	}
+	return 1;
 }
 
+// opens the socket of an interface and joins the mDNS group(s) on it.
 // return values:
 // 1 on success
 // 0 otherwise
-template <class UdpClass>
-int EthernetBonjour3Class<UdpClass>::resolveName(const char *name, unsigned long timeout)
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_beginInterface(uint8_t index, IPAddress localIP)
 {
-	this->cancelResolveName();
+	MDNSInterface_t<UdpClass> *iface = &this->_interfaces[index];
+
+	iface->localIP = localIP;
 
-	char *n = (char *)malloc(strlen(name) + 7);
-	if (NULL == n)
+	if (!iface->socket.beginMulticast(mdnsMulticastIPAddr, MDNS_SERVER_PORT))
 		return 0;
 
-	strcpy(n, name);
-	strcat(n, MDNS_TLD);
+	// if we have an IPv6 address and our socket can do IPv6, we listen on FF02::FB, too
+	if (Features::ipv6 && iface->hasIPv6)
+		iface->ipv6Multicast = MDNSUdpIPv6<UdpClass>::beginMulticast(iface->socket,
+																	 IPv6Address(mdnsMulticastIPv6Addr),
+																	 MDNS_SERVER_PORT) > 0;
 
-	return this->_initQuery(0, n, timeout);
-}
+	iface->active = 1;
 
-template <class UdpClass>
-void EthernetBonjour3Class<UdpClass>::setNameResolvedCallback(BonjourNameFoundCallback newCallback)
-{
-	this->_nameFoundCallback = newCallback;
+	return 1;
 }
 
-template <class UdpClass>
-void EthernetBonjour3Class<UdpClass>::cancelResolveName()
+// return value:
+// 1 if the interface we're receiving from or sending on has an IPv6 address, 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_hasIPv6()
 {
-	this->_cancelQuery(0);
+	return Features::ipv6 && this->_iface->hasIPv6;
 }
 
-template <class UdpClass>
-int EthernetBonjour3Class<UdpClass>::isResolvingName()
+// makes us a dual-stack responder on the given interface: we answer for our host name with
+// an AAAA record for localIPv6 in addition to the A record. an unspecified address turns
+// this off again. builds without IPv6 support (see MDNSFeatures) always fail.
+// return values:
+// 1 on success
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::setLocalIPv6(const IPv6Address &localIPv6, uint8_t interfaceIndex)
 {
-	return (NULL != this->_resolveNames[0]);
-}
+	if (!Features::ipv6 || interfaceIndex >= NumMDNSInterfaces)
+		return 0;
 
-template <class UdpClass>
-void EthernetBonjour3Class<UdpClass>::setServiceFoundCallback(BonjourServiceFoundCallback newCallback)
-{
-	this->_serviceFoundCallback = newCallback;
+	MDNSInterface_t<UdpClass> *iface = &this->_interfaces[interfaceIndex];
+
+	iface->localIPv6 = localIPv6;
+	iface->hasIPv6 = !localIPv6.isUnspecified();
+
+	if (!iface->active)
+		return 1;
+
+	if (iface->hasIPv6 && !iface->ipv6Multicast)
+		iface->ipv6Multicast = MDNSUdpIPv6<UdpClass>::beginMulticast(iface->socket,
+																	 IPv6Address(mdnsMulticastIPv6Addr),
+																	 MDNS_SERVER_PORT) > 0;
+
+	// tell everybody about our new set of addresses
+	if (this->_hostProbed)
+		this->_startAnnouncing();
+
+	return 1;
 }
 
+// call this when an interface got a new IPv4 address, e.g. after a DHCP renewal or when its
+// link came back up. we say goodbye to the old address on that interface, then announce
+// the new one together with all our services.
 // return values:
 // 1 on success
 // 0 otherwise
-template <class UdpClass>
-int EthernetBonjour3Class<UdpClass>::startDiscoveringService(const char *serviceName,
-															 MDNSServiceProtocol_t proto,
-															 unsigned long timeout)
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::updateLocalIP(IPAddress localIP, uint8_t interfaceIndex)
 {
-	this->stopDiscoveringService();
-
-	char *n = (char *)malloc(strlen(serviceName) + 13);
-	if (NULL == n)
+	if (interfaceIndex >= NumMDNSInterfaces)
 		return 0;
 
-	strcpy(n, serviceName);
+	MDNSInterface_t<UdpClass> *iface = &this->_interfaces[interfaceIndex];
 
-	const uint8_t *srv_type = this->_postfixForProtocol(proto);
-	if (srv_type)
-		strcat(n, (const char *)srv_type);
+	if (iface->active && (uint32_t)iface->localIP == (uint32_t)localIP)
+		return 1;
 
-	this->_resolveServiceProto = proto;
+	if (iface->active && this->_hostProbed && 0 != (uint32_t)iface->localIP)
+	{
+		MDNSInterface_t<UdpClass> *saved = this->_iface;
 
-	return this->_initQuery(1, n, timeout);
-}
+		this->_iface = iface; // _sendMDNSMessage only sends on this one now
+		(void)this->_sendMDNSMessage(0, 0, (int)MDNSPacketTypeAddressGoodbye, 0);
+		this->_iface = saved;
+	}
 
-template <class UdpClass>
-void EthernetBonjour3Class<UdpClass>::stopDiscoveringService()
-{
-	this->_cancelQuery(1);
+	iface->localIP = localIP;
+
+	if (iface->active && this->_hostProbed)
+		this->_startAnnouncing();
+
+	return 1;
 }
 
-template <class UdpClass>
-int EthernetBonjour3Class<UdpClass>::isDiscoveringService()
+// sets the TTLs (in seconds) we give our records: hostTTL for the ones that carry our host
+// name or address (A, AAAA, SRV), serviceTTL for all others (PTR, TXT). RFC 6762 recommends
+// 120 and 4500 seconds, which are the defaults. we re-announce each kind of record shortly
+// before it expires, so longer TTLs mean less traffic. 0 selects the default.
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::setRecordTTLs(uint32_t hostTTL, uint32_t serviceTTL)
 {
-	return (NULL != this->_resolveNames[1]);
+	this->_hostTTL = (0 != hostTTL) ? hostTTL : MDNS_HOST_RECORD_TTL;
+	this->_serviceTTL = (0 != serviceTTL) ? serviceTTL : MDNS_SERVICE_RECORD_TTL;
+
+	// everybody should learn about the new TTLs, and our refresh schedule changes
+	if (this->_hostProbed)
+		this->_startAnnouncing();
 }
 
-// return value:
-// A DNSError_t (DNSSuccess on success, something else otherwise)
-// in "int" mode: positive on success, negative on error
-template <class UdpClass>
-MDNSError_t EthernetBonjour3Class<UdpClass>::_sendMDNSMessage(uint32_t peerAddress, uint32_t xid, int type,
-															  int serviceRecord)
+// keeps our host name, service records, TXT data and the names of queries in arena instead
+// of on the heap, see MDNSArena. call this before adding services or starting queries. the
+// arena has to stay around as long as we do.
+// return values:
+// 1 on success
+// 0 otherwise (too late, or no room for our host name in the arena)
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::setArena(MDNSArena *arena)
 {
-	MDNSError_t statusCode = MDNSSuccess;
-	uint16_t ptr = 0;
+	int i;
 
-	DNSHeader_t dnsHeaderBuf;
-	DNSHeader_t *dnsHeader = &dnsHeaderBuf;
+	for (i = 0; i < NumMDNSServiceRecords; i++)
+		if (NULL != this->_serviceRecords[i])
+			return 0;
 
-	uint8_t *buf;
+	for (i = 0; i < _numProxyHosts; i++)
+		if (NULL != this->_proxyHosts[i].name)
+			return 0;
 
-	memset(dnsHeader, 0, sizeof(DNSHeader_t));
+	if (this->_hasQueries() || this->_hasPendingServices())
+		return 0;
 
-	dnsHeader->xid = __htons(xid);
-	dnsHeader->opCode = DNSOpQuery;
+	// our host name moves over
+	MDNSArena *oldArena = this->_arena;
+	uint8_t *oldName = this->_bonjourName;
 
-	switch (type)
+	this->_arena = arena;
+
+	if (NULL != oldName)
 	{
-	case MDNSPacketTypeServiceRecordRelease:
-	case MDNSPacketTypeMyIPAnswer:
-		dnsHeader->answerCount = __htons(1);
-		dnsHeader->queryResponse = 1;
-		dnsHeader->authoritiveAnswer = 1;
-		break;
-	case MDNSPacketTypeServiceRecord:
-		dnsHeader->answerCount = __htons(4);
-		dnsHeader->additionalCount = __htons(1);
-		dnsHeader->queryResponse = 1;
-		dnsHeader->authoritiveAnswer = 1;
-		break;
-	case MDNSPacketTypeNameQuery:
-	case MDNSPacketTypeServiceQuery:
-		dnsHeader->queryCount = __htons(1);
-		break;
-	case MDNSPacketTypeNoIPv6AddrAvailable:
-		dnsHeader->queryCount = __htons(1);
-		dnsHeader->additionalCount = __htons(1);
-		dnsHeader->responseCode = 0x03;
-		dnsHeader->authoritiveAnswer = 1;
-		dnsHeader->queryResponse = 1;
-		break;
-	}
+		if (NULL == this->_alloc(strlen((char *)oldName) + 1, &this->_bonjourName))
+		{
+			this->_arena = oldArena;
+			this->_bonjourName = oldName;
+			return 0;
+		}
 
-	Serial.print("_sendMDNSMessage ");
-	Serial.print("peerAddress:");
-	Serial.print(peerAddress);
-	Serial.print(" xid:");
-	Serial.print(xid);
-	Serial.print(" type:");
-	Serial.print(type);
-	Serial.print(" serviceRecord:");
-	Serial.println(serviceRecord);
+		strcpy((char *)this->_bonjourName, (const char *)oldName);
 
-	_socket.beginPacket(mdnsMulticastIPAddr, MDNS_SERVER_PORT);
-	_socket.write((uint8_t *)dnsHeader, sizeof(DNSHeader_t));
+		if (NULL != oldArena && oldArena->contains(oldName))
+			oldArena->free(oldName);
+		else
+			free(oldName);
+	}
 
-	ptr += sizeof(DNSHeader_t);
-	buf = (uint8_t *)dnsHeader;
+	return 1;
+}
 
-	// construct the answer section
-	switch (type)
-	{
-	case MDNSPacketTypeMyIPAnswer:
-	{
-		this->_writeMyIPAnswerRecord(&ptr, buf, sizeof(DNSHeader_t));
-		break;
-	}
+// return value:
+// a block of size bytes from the arena, or from the heap if we have none, or NULL. its
+// address is also stored at owner, which is where the pointer to it is kept. the arena
+// moves blocks when it's compacted and updates that pointer then, so every block must
+// have an owner (see _setOwner()) until it is freed again.
+template <class UdpClass, class Features>
+void *EthernetBonjour3Class<UdpClass, Features>::_alloc(uint16_t size, void *owner)
+{
+	if (NULL != this->_arena)
+		return this->_arena->alloc(size, owner);
 
-	case MDNSPacketTypeServiceRecord:
-	{
+	void *p = malloc(size);
+	memcpy(owner, &p, sizeof(void *));
 
-		// SRV location record
-		this->_writeServiceRecordName(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), 0);
+	return p;
+}
 
-		buf[0] = 0x00;
-		buf[1] = 0x21; // SRV record
-		buf[2] = 0x80; // cache flush
-		buf[3] = 0x01; // class IN
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_free(void *p)
+{
+	if (NULL == p)
+		return;
 
-		// ttl
-		*((uint32_t *)&buf[4]) = __htonl(MDNS_RESPONSE_TTL_10);
+	if (NULL != this->_arena && this->_arena->contains(p))
+		this->_arena->free(p);
+	else
+		free(p);
+}
 
-		// data length
-		*((uint16_t *)&buf[8]) = __htons(8 + strlen((char *)this->_bonjourName));
+// tells the arena that the pointer to block p is now kept at owner
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_setOwner(void *p, void *owner)
+{
+	if (NULL != this->_arena && this->_arena->contains(p))
+		this->_arena->setOwner(p, owner);
+}
 
-		_socket.write((uint8_t *)buf, 10);
-		ptr += 10;
-		// priority and weight
-		buf[0] = buf[1] = buf[2] = buf[3] = 0;
+// merges the free space of the arena into one piece. only call it where no pointers into
+// the arena are held, except by owners. nothing is moved while run() is busy, because the
+// callbacks it calls may well end up here.
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_compactArena()
+{
+	if (NULL != this->_arena && !this->_running)
+		this->_arena->compact();
+}
 
-		// port
-		*((uint16_t *)&buf[4]) = __htons(this->_serviceRecords[serviceRecord]->port);
+// copies our counters to *stats. see MDNSStatistics_t.
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::getStatistics(MDNSStatistics_t *stats)
+{
+	if (NULL != stats)
+		memcpy(stats, &this->_stats, sizeof(MDNSStatistics_t));
+}
 
-		_socket.write((uint8_t *)buf, 6);
-		ptr += 6;
-		// target
-		this->_writeDNSName(this->_bonjourName, &ptr, buf, sizeof(DNSHeader_t), 1);
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::resetStatistics()
+{
+	memset(&this->_stats, 0, sizeof(this->_stats));
+}
 
-		// TXT record
-		this->_writeServiceRecordName(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), 0);
+// sends goodbyes (TTL 0) for all our records in one packet and stops responding.
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::end()
+{
+	int i;
 
-		buf[0] = 0x00;
-		buf[1] = 0x10; // TXT record
-		buf[2] = 0x80; // cache flush
-		buf[3] = 0x01; // class IN
+	if (MDNSProbeStateStopped == this->_probeState)
+		return;
 
-		// ttl
-		*((uint32_t *)&buf[4]) = __htonl(MDNS_RESPONSE_TTL_10);
+	for (i = 0; i < _numQueries; i++)
+		this->_cancelQuery(i);
 
-		_socket.write((uint8_t *)buf, 8);
-		ptr += 8;
+	if (this->_hostProbed)
+		(void)this->_sendMDNSMessage(0, 0, (int)MDNSPacketTypeGoodbye, 0);
 
-		// data length && text
-		if (NULL == this->_serviceRecords[serviceRecord]->textContent)
-		{
-			buf[0] = 0x00;
-			buf[1] = 0x01;
-			buf[2] = 0x00;
+	// nothing has been claimed anymore, so nothing more will be sent
+	this->_probeState = MDNSProbeStateStopped;
+	this->_hostProbed = 0;
+	this->_timersArmed = 0;
 
-			_socket.write((uint8_t *)buf, 3);
-			ptr += 3;
-		}
-		else
-		{
-			int slen = strlen((char *)this->_serviceRecords[serviceRecord]->textContent);
-			*((uint16_t *)buf) = __htons(slen);
-			_socket.write((uint8_t *)buf, 2);
-			ptr += 2;
+	for (i = 0; i < NumMDNSServiceRecords; i++)
+		if (NULL != this->_serviceRecords[i])
+			this->_serviceRecords[i]->probed = 0;
 
-			_socket.write((uint8_t *)this->_serviceRecords[serviceRecord]->textContent, slen);
-			ptr += slen;
-		}
+	for (i = 0; i < _numProxyHosts; i++)
+		this->_proxyHosts[i].probed = 0;
 
-		// PTR record (for the dns-sd service in general)
-		this->_writeDNSName((const uint8_t *)DNS_SD_SERVICE, &ptr, buf,
-							sizeof(DNSHeader_t), 1);
+	for (i = 0; i < NumMDNSInterfaces; i++)
+	{
+		if (this->_interfaces[i].active)
+			this->_interfaces[i].socket.stop();
 
-		buf[0] = 0x00;
-		buf[1] = 0x0c; // PTR record
-		buf[2] = 0x00; // no cache flush
-		buf[3] = 0x01; // class IN
+		this->_interfaces[i].active = 0;
+		this->_interfaces[i].ipv6Multicast = 0;
+	}
+}
 
-		// ttl
-		*((uint32_t *)&buf[4]) = __htonl(MDNS_RESPONSE_TTL);
+// takes ownership of name, which becomes the name we ask for in a free query slot.
+// return values:
+// the index of the slot
+// -1 if all of them are taken (name is freed then)
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_newQuery(uint8_t *name)
+{
+	static_assert(NumMDNSQueries <= (1 << MDNS_HANDLE_SLOT_BITS), "too many queries for a handle");
 
-		// data length.
-		uint16_t dlen = strlen((char *)this->_serviceRecords[serviceRecord]->servName) + 2;
-		*((uint16_t *)&buf[8]) = __htons(dlen);
+	int i;
 
-		_socket.write((uint8_t *)buf, 10);
-		ptr += 10;
+	for (i = 0; i < _numQueries; i++)
+	{
+		MDNSQuery_t *query = &this->_queries[i];
 
-		this->_writeServiceRecordName(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), 1);
+		if (NULL != query->name)
+			continue;
 
-		// PTR record (our service)
-		this->_writeServiceRecordPTR(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), MDNS_RESPONSE_TTL_10);
+		memset(query, 0, sizeof(MDNSQuery_t));
+		query->name = name;
+		this->_setOwner(name, &query->name);
 
-		// finally, our IP address as additional record
-		this->_writeMyIPAnswerRecord(&ptr, buf, sizeof(DNSHeader_t));
+		// the serial in the upper bits tells apart the lookups that used the same slot
+		this->_querySerial = (this->_querySerial + 1) & (0xffff >> MDNS_HANDLE_SLOT_BITS);
+		if (0 == this->_querySerial)
+			this->_querySerial = 1;
 
-		break;
-	}
+		query->handle = (MDNSHandle_t)((this->_querySerial << MDNS_HANDLE_SLOT_BITS) | i);
 
-	case MDNSPacketTypeServiceRecordRelease:
-	{
-		// just send our service PTR with a TTL of zero
-		this->_writeServiceRecordPTR(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), 0);
-		break;
+		return i;
 	}
-	case MDNSPacketTypeNameQuery:
-	case MDNSPacketTypeServiceQuery:
-	{
-		// construct a query for the currently set _resolveNames[0]
-		this->_writeDNSName(
-			(type == MDNSPacketTypeServiceQuery) ? this->_resolveNames[1] : this->_resolveNames[0],
-			&ptr, buf, sizeof(DNSHeader_t), 1);
 
-		buf[0] = buf[2] = 0x0;
-		buf[1] = (type == MDNSPacketTypeServiceQuery) ? 0x0c : 0x01;
-		buf[3] = 0x1;
+	this->_free(name);
 
-		//		_socket.write((uint8_t *)buf, sizeof(DNSHeader_t));
-		//		ptr += sizeof(DNSHeader_t);
+	return -1;
+}
 
-		_socket.write((uint8_t *)buf, 4);
-		ptr += 4;
+// sends the first query of the lookup in slot idx, once its callback is set.
+// return values:
+// the handle of the lookup
+// MDNS_INVALID_HANDLE if the query couldn't be sent (the slot is free again then)
+template <class UdpClass, class Features>
+MDNSHandle_t EthernetBonjour3Class<UdpClass, Features>::_startQuery(int idx, unsigned long timeout)
+{
+	MDNSQuery_t *query = &this->_queries[idx];
+	unsigned long now = millis();
 
-		this->_resolveLastSendMillis[(type == MDNSPacketTypeServiceQuery) ? 1 : 0] = millis();
+	Log::startQuery((const char *)query->name);
 
-		break;
-	}
-	case MDNSPacketTypeNoIPv6AddrAvailable:
+	query->hasTimeout = (timeout > 0);
+	query->timeoutDeadline = now + timeout;
+
+	if (MDNSSuccess != this->_sendQuery(idx, now))
 	{
-		// since the WIZnet doesn't have IPv6, we will respond with a Not Found message
-		this->_writeDNSName(this->_bonjourName, &ptr, buf, sizeof(DNSHeader_t), 1);
+		this->_cancelQuery(idx);
+		return MDNS_INVALID_HANDLE;
+	}
 
-		buf[0] = buf[2] = 0x0;
-		buf[1] = 0x1c; // AAAA record
-		buf[3] = 0x01;
+	return query->handle;
+}
 
-		_socket.write((uint8_t *)buf, 4);
-		ptr += 4;
+// asks for the name of the lookup in slot idx, and schedules the next time we do.
+template <class UdpClass, class Features>
+MDNSError_t EthernetBonjour3Class<UdpClass, Features>::_sendQuery(int idx, unsigned long now)
+{
+	MDNSQuery_t *query = &this->_queries[idx];
 
-		// send our IPv4 address record as additional record, in case the peer wants it.
-		this->_writeMyIPAnswerRecord(&ptr, buf, sizeof(DNSHeader_t));
+	query->resendDeadline = now + (query->isService ? MDNS_SQUERY_RESEND_TIME : MDNS_NQUERY_RESEND_TIME);
 
-		break;
-	}
-	}
+	return this->_sendMDNSMessage(0,
+								  0,
+								  query->isService ? MDNSPacketTypeServiceQuery : MDNSPacketTypeNameQuery,
+								  idx);
+}
 
-	_socket.endPacket();
+// return values:
+// the index of the running lookup with this handle
+// -1 if there is none (anymore)
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_findQuery(MDNSHandle_t handle)
+{
+	int idx = handle & ((1 << MDNS_HANDLE_SLOT_BITS) - 1);
 
-errorReturn:
+	if (MDNS_INVALID_HANDLE == handle || idx >= _numQueries ||
+		NULL == this->_queries[idx].name || handle != this->_queries[idx].handle)
+		return -1;
 
-	return statusCode;
+	return idx;
 }
 
-// return value:
-// A DNSError_t (DNSSuccess on success, something else otherwise)
-// in "int" mode: positive on success, negative on error
-template <class UdpClass>
-MDNSError_t EthernetBonjour3Class<UdpClass>::_processMDNSQuery()
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_hasQueries()
 {
-	MDNSError_t statusCode = MDNSSuccess;
+	int i;
+	for (i = 0; i < _numQueries; i++)
+		if (NULL != this->_queries[i].name)
+			return 1;
 
-	DNSHeader_t dnsHeaderBuf;
-	DNSHeader_t *dnsHeader = &dnsHeaderBuf;
+	return 0;
+}
 
-	int i, j;
-	uint8_t *buf;
-	uint32_t xid;
-	uint16_t udp_len, qCnt, aCnt, aaCnt, addCnt;
-	uint8_t recordsAskedFor[NumMDNSServiceRecords + 2];
-	uint8_t recordsFound[2];
-	uint8_t wantsIPv6Addr = 0;
-	uint8_t *udpBuffer = NULL;
-	uintptr_t ptr;
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_cancelQuery(int idx)
+{
+	MDNSQuery_t *query = &this->_queries[idx];
 
-	memset(recordsAskedFor, 0, sizeof(uint8_t) * (NumMDNSServiceRecords + 2));
-	memset(recordsFound, 0, sizeof(uint8_t) * 2);
+	if (NULL == query->name)
+		return;
 
-	udp_len = _socket.parsePacket();
-	if (0 == udp_len)
-	{
-		statusCode = MDNSTryLater;
-		goto errorReturn;
-	}
+	// services still waiting for their address belong to the browse we just ended
+	if (query->isService)
+		this->_cancelPendingServices(query->handle);
 
-	udpBuffer = (uint8_t *)malloc(udp_len); //allocate memory to hold _remaining UDP packet
-	if (NULL == udpBuffer)
-	{
-		_socket.flush();
-		statusCode = MDNSOutOfMemory;
-		goto errorReturn;
-	}
-	_socket.read((uint8_t *)udpBuffer, udp_len); //read _remaining UDP packet from W5100/W5200 into memory
-	ptr = (uintptr_t)udpBuffer;
-
-	buf = (uint8_t *)dnsHeader;
-	memcpy((uint8_t *)buf, (uint16_t *)ptr, sizeof(DNSHeader_t));
-
-	xid = __ntohs(dnsHeader->xid);
-	qCnt = __ntohs(dnsHeader->queryCount);
-	aCnt = __ntohs(dnsHeader->answerCount);
-	aaCnt = __ntohs(dnsHeader->authorityCount);
-	addCnt = __ntohs(dnsHeader->additionalCount);
-
-	Serial.print("_processMDNSQuery");
-	Serial.print(" len: ");
-	Serial.print(udp_len + 42);
-	Serial.print(" dnsHeader->queryResponse: ");
-	Serial.print(dnsHeader->queryResponse);
-	Serial.print(" dnsHeader->opCode: ");
-	Serial.print(dnsHeader->opCode);
-	Serial.println("");
-
-	if (0 == dnsHeader->queryResponse &&
-		DNSOpQuery == dnsHeader->opCode &&
-		MDNS_SERVER_PORT == _socket.remotePort())
-	{
-		Serial.print("Message is a query");
-		Serial.print(" qCnt: ");
-		Serial.print(qCnt);
-		Serial.print(" aCnt: ");
-		Serial.print(aCnt);
-		Serial.println("");
-
-		// process an MDNS query
-		int offset = sizeof(DNSHeader_t);
-		uint8_t *buf = (uint8_t *)dnsHeader;
-		int rLen = 0, tLen = 0;
-
-		// read over the query section
-		for (i = 0; i < qCnt; i++)
-		{
-			// construct service name data structures for comparison
-			const uint8_t *servNames[NumMDNSServiceRecords + 2];
-			int servLens[NumMDNSServiceRecords + 2];
-			uint8_t servNamePos[NumMDNSServiceRecords + 2];
-			uint8_t servMatches[NumMDNSServiceRecords + 2];
-
-			// first entry is our own MDNS name, the rest are our services
-			servNames[0] = (const uint8_t *)this->_bonjourName;
-			servNamePos[0] = 0;
-			servLens[0] = strlen((char *)this->_bonjourName);
-			servMatches[0] = 1;
-
-			// second entry is our own the general DNS-SD service
-			servNames[1] = (const uint8_t *)DNS_SD_SERVICE;
-			servNamePos[1] = 0;
-			servLens[1] = strlen((char *)DNS_SD_SERVICE);
-			servMatches[1] = 1;
-
-			for (j = 2; j < NumMDNSServiceRecords + 2; j++)
-			{
-				if (NULL != this->_serviceRecords[j - 2] &&
-					NULL != this->_serviceRecords[j - 2]->servName)
-				{
-					servNames[j] = this->_serviceRecords[j - 2]->servName;
-					servLens[j] = strlen((char *)servNames[j]);
-					servMatches[j] = 1;
-					servNamePos[j] = 0;
-				}
-				else
-				{
-					servNames[j] = NULL;
-					servLens[j] = 0;
-					servMatches[j] = 0;
-					servNamePos[j] = 0;
-				}
-			}
+	this->_free(query->name);
+	memset(query, 0, sizeof(MDNSQuery_t));
+}
 
-			tLen = 0;
-			do
-			{
-				memcpy((uint8_t *)buf, (uint16_t *)(ptr + offset), 1);
-				offset += 1;
+// the lookups of resolveName() and startDiscoveringService() report to the global callbacks
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_legacyNameResolved(void *context, MDNSHandle_t,
+																	const char *name, const byte ipAddr[4])
+{
+	EthernetBonjour3Class *self = (EthernetBonjour3Class *)context;
 
-				rLen = buf[0]; // 1st byte has the length
-				tLen += 1;
+	if (NULL != self->_nameFoundCallback)
+		self->_nameFoundCallback(name, ipAddr);
+}
 
-				if (rLen > 128)
-				{ // handle DNS name compression, kinda, sorta
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_legacyServiceFound(void *context, MDNSHandle_t,
+																	const char *type, MDNSServiceProtocol_t proto,
+																	const char *name, const byte ipAddr[4],
+																	unsigned short port, const char *txt)
+{
+	EthernetBonjour3Class *self = (EthernetBonjour3Class *)context;
 
-					memcpy((uint8_t *)buf, (uint16_t *)(ptr + offset), 1);
-					offset += 1;
+	if (NULL != self->_serviceFoundCallback)
+		self->_serviceFoundCallback(type, proto, name, ipAddr, port, txt);
+}
 
-					for (j = 0; j < NumMDNSServiceRecords + 2; j++)
+// return values:
+// 1 on success
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::resolveName(const char *name, unsigned long timeout)
+{
+	static_assert(Features::resolver, "this build has no name resolver, see MDNSFeatures");
+
+	this->cancelResolveName();
+
+	if (NULL == this->_nameFoundCallback)
+		return 0;
+
+	this->_legacyQueries[0] = this->resolveNameAsync(name, timeout, _legacyNameResolved, this);
+
+	return (MDNS_INVALID_HANDLE != this->_legacyQueries[0]);
+}
+
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::setNameResolvedCallback(BonjourNameFoundCallback newCallback)
+{
+	static_assert(Features::resolver, "this build has no name resolver, see MDNSFeatures");
+
+	this->_nameFoundCallback = newCallback;
+}
+
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::cancelResolveName()
+{
+	(void)this->cancelRequest(this->_legacyQueries[0]);
+	this->_legacyQueries[0] = MDNS_INVALID_HANDLE;
+}
+
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::isResolvingName()
+{
+	return (this->_findQuery(this->_legacyQueries[0]) >= 0);
+}
+
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::setServiceFoundCallback(BonjourServiceFoundCallback newCallback)
+{
+	static_assert(Features::browser, "this build has no service browser, see MDNSFeatures");
+
+	this->_serviceFoundCallback = newCallback;
+}
+
+// return values:
+// 1 on success
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::startDiscoveringService(const char *serviceName,
+																	   MDNSServiceProtocol_t proto,
+																	   unsigned long timeout)
+{
+	return this->startDiscoveringService(serviceName, proto, NULL, timeout);
+}
+
+// like above, but only finds the instances registered with the given subtype, by browsing
+// for "<subtype>._sub.<serviceName>._tcp.local".
+// return values:
+// 1 on success
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::startDiscoveringService(const char *serviceName,
+																	   MDNSServiceProtocol_t proto,
+																	   const char *subtype,
+																	   unsigned long timeout)
+{
+	static_assert(Features::browser, "this build has no service browser, see MDNSFeatures");
+
+	this->stopDiscoveringService();
+
+	if (NULL == this->_serviceFoundCallback)
+		return 0;
+
+	this->_legacyQueries[1] = this->discoverServiceAsync(serviceName, proto, subtype, timeout,
+														 _legacyServiceFound, this);
+
+	return (MDNS_INVALID_HANDLE != this->_legacyQueries[1]);
+}
+
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::stopDiscoveringService()
+{
+	(void)this->cancelRequest(this->_legacyQueries[1]);
+	this->_legacyQueries[1] = MDNS_INVALID_HANDLE;
+}
+
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::isDiscoveringService()
+{
+	return (this->_findQuery(this->_legacyQueries[1]) >= 0);
+}
+
+// looks up the IPv4 address of name (without ".local"). callback gets the address, or NULL
+// for it if no answer arrived within timeout ms (0: no timeout), which ends the lookup either
+// way. unlike resolveName(), this can run up to NumMDNSQueries lookups and browses at once,
+// each reporting to its own callback and context.
+// return values:
+// the handle of the lookup, for cancelRequest()
+// MDNS_INVALID_HANDLE otherwise (all query slots taken, out of memory, or not sent)
+template <class UdpClass, class Features>
+MDNSHandle_t EthernetBonjour3Class<UdpClass, Features>::resolveNameAsync(const char *name, unsigned long timeout,
+																		 MDNSNameResolvedCallback callback,
+																		 void *context)
+{
+	static_assert(Features::resolver, "this build has no name resolver, see MDNSFeatures");
+
+	if (NULL == callback)
+		return MDNS_INVALID_HANDLE;
+
+	this->_compactArena();
+
+	char *n;
+	if (NULL == this->_alloc(strlen(name) + 7, &n))
+		return MDNS_INVALID_HANDLE;
+
+	strcpy(n, name);
+	strcat(n, MDNS_TLD);
+
+	int idx = this->_newQuery((uint8_t *)n);
+	if (idx < 0)
+		return MDNS_INVALID_HANDLE;
+
+	this->_queries[idx].nameCallback = callback;
+	this->_queries[idx].context = context;
+
+	return this->_startQuery(idx, timeout);
+}
+
+// browses for the instances of a service type like "_ipp", or only those registered with
+// subtype (unless NULL). callback gets each instance found, and a NULL instance name if
+// timeout ms pass (0: no timeout), which ends the browse.
+// return values:
+// the handle of the browse, for cancelRequest()
+// MDNS_INVALID_HANDLE otherwise (all query slots taken, out of memory, or not sent)
+template <class UdpClass, class Features>
+MDNSHandle_t EthernetBonjour3Class<UdpClass, Features>::discoverServiceAsync(const char *serviceName,
+																			 MDNSServiceProtocol_t proto,
+																			 const char *subtype,
+																			 unsigned long timeout,
+																			 MDNSServiceFoundCallback callback,
+																			 void *context)
+{
+	static_assert(Features::browser, "this build has no service browser, see MDNSFeatures");
+
+	uint16_t subLen = 0;
+
+	if (NULL == callback)
+		return MDNS_INVALID_HANDLE;
+
+	if (NULL != subtype && 0 != *subtype)
+	{
+		subLen = strlen(subtype) + 6; // "._sub."
+		if (subLen > 255)
+			return MDNS_INVALID_HANDLE;
+	}
+
+	this->_compactArena();
+
+	char *n;
+	if (NULL == this->_alloc(subLen + strlen(serviceName) + 13, &n))
+		return MDNS_INVALID_HANDLE;
+
+	n[0] = '\0';
+	if (subLen > 0)
+	{
+		strcpy(n, subtype);
+		strcat(n, "._sub.");
+	}
+	strcat(n, serviceName);
+
+	const uint8_t *srv_type = this->_postfixForProtocol(proto);
+	if (srv_type)
+		strcat(n, (const char *)srv_type);
+
+	int idx = this->_newQuery((uint8_t *)n);
+	if (idx < 0)
+		return MDNS_INVALID_HANDLE;
+
+	MDNSQuery_t *query = &this->_queries[idx];
+	query->isService = 1;
+	query->proto = proto;
+	query->subtypeLength = subLen;
+	query->serviceCallback = callback;
+	query->context = context;
+
+	return this->_startQuery(idx, timeout);
+}
+
+// ends a lookup or browse, without calling its callback again.
+// return values:
+// 1 on success
+// 0 if it has ended already
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::cancelRequest(MDNSHandle_t handle)
+{
+	int idx = this->_findQuery(handle);
+
+	if (idx < 0)
+		return 0;
+
+	this->_cancelQuery(idx);
+
+	return 1;
+}
+
+// return values:
+// 1 while the lookup or browse with this handle is running
+// 0 once it has ended
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::isRequestActive(MDNSHandle_t handle)
+{
+	return (this->_findQuery(handle) >= 0);
+}
+
+// sends a message on every interface, or, while we're handling a received packet, on the
+// interface it arrived on only, so that the answer carries the address valid there.
+// return value:
+// A DNSError_t (DNSSuccess if the message went out on at least one interface, the error of
+// the last one if it failed on all of them)
+// in "int" mode: positive on success, negative on error
+template <class UdpClass, class Features>
+MDNSError_t EthernetBonjour3Class<UdpClass, Features>::_sendMDNSMessage(uint32_t peerAddress, uint32_t xid, int type,
+																		int serviceRecord)
+{
+	MDNSError_t statusCode = MDNSNothingToDo;
+	MDNSInterface_t<UdpClass> *arrivedOn = this->_iface;
+	uint8_t sent = 0;
+
+	for (int i = 0; i < NumMDNSInterfaces; i++)
+	{
+		if (!this->_interfaces[i].active || (NULL != arrivedOn && arrivedOn != &this->_interfaces[i]))
+			continue;
+
+		this->_iface = &this->_interfaces[i];
+		statusCode = this->_sendMDNSMessageOnInterface(peerAddress, xid, type, serviceRecord);
+
+		if (MDNSNothingToDo == statusCode)
+			break;
+		if (MDNSSuccess == statusCode)
+			sent = 1;
+	}
+
+	this->_iface = arrivedOn;
+
+	if (sent)
+		statusCode = MDNSSuccess;
+
+	// a failed address query counts as a try, too, so the services waiting for it expire
+	if (MDNSPacketTypeAddressQuery == type && MDNSNothingToDo != statusCode)
+	{
+		for (int i = 0; i < _numPendingServices; i++)
+			if (NULL != this->_pendingServices[i].target)
+				this->_pendingServices[i].tries++;
+
+		this->_armTimer(MDNSTimerAddressResend, millis(), MDNS_AQUERY_RESEND_TIME);
+	}
+
+	return statusCode;
+}
+
+// return value:
+// A DNSError_t (DNSSuccess on success, MDNSSocketError if no copy of the message went out,
+// something else otherwise)
+// in "int" mode: positive on success, negative on error
+template <class UdpClass, class Features>
+MDNSError_t EthernetBonjour3Class<UdpClass, Features>::_sendMDNSMessageOnInterface(uint32_t peerAddress, uint32_t xid,
+																				   int type, int serviceRecord)
+{
+	MDNSError_t statusCode = MDNSSuccess;
+
+	DNSHeader_t dnsHeaderBuf;
+	DNSHeader_t *dnsHeader = &dnsHeaderBuf;
+
+	memset(dnsHeader, 0, sizeof(DNSHeader_t));
+
+	dnsHeader->xid = __htons(xid);
+	dnsHeader->opCode = DNSOpQuery;
+
+	switch (type)
+	{
+	case MDNSPacketTypeServiceRecordRelease:
+		dnsHeader->answerCount = __htons(1);
+		dnsHeader->queryResponse = 1;
+		dnsHeader->authoritiveAnswer = 1;
+		break;
+	case MDNSPacketTypeMyIPAnswer:
+		dnsHeader->answerCount = __htons(this->_hasIPv6() ? 2 : 1);
+		dnsHeader->additionalCount = __htons(1);
+		dnsHeader->queryResponse = 1;
+		dnsHeader->authoritiveAnswer = 1;
+		break;
+	case MDNSPacketTypeProxyHostAnswer:
+	{
+		// the addresses of all proxy hosts the query asked for, each with its NSEC
+		uint16_t aCnt = 0;
+		for (int i = 0; i < _numProxyHosts; i++)
+			if (this->_proxyHosts[i].askedFor & MDNS_PROXY_ASKED_ADDRESS)
+				aCnt++;
+
+		if (0 == aCnt)
+			return MDNSNothingToDo;
+
+		dnsHeader->answerCount = __htons(aCnt);
+		dnsHeader->additionalCount = __htons(aCnt);
+		dnsHeader->queryResponse = 1;
+		dnsHeader->authoritiveAnswer = 1;
+		break;
+	}
+	case MDNSPacketTypeServiceRecord:
+		// the address(es) of the SRV target and two NSECs are additional records
+		dnsHeader->answerCount = __htons(4);
+		dnsHeader->additionalCount = __htons(
+			this->_hostRecordCount(this->_serviceRecords[serviceRecord]->host) + 2);
+		dnsHeader->queryResponse = 1;
+		dnsHeader->authoritiveAnswer = 1;
+		break;
+	case MDNSPacketTypeServiceInstanceAnswer:
+		// SRV and TXT, with the address(es) of the SRV target and two NSECs as additional records
+		dnsHeader->answerCount = __htons(2);
+		dnsHeader->additionalCount = __htons(
+			this->_hostRecordCount(this->_serviceRecords[serviceRecord]->host) + 2);
+		dnsHeader->queryResponse = 1;
+		dnsHeader->authoritiveAnswer = 1;
+		break;
+	case MDNSPacketTypeNameQuery:
+	case MDNSPacketTypeServiceQuery:
+		dnsHeader->queryCount = __htons(1);
+		break;
+	case MDNSPacketTypeAddressQuery:
+	{
+		// several instances on one host share its question
+		uint16_t qCnt = 0;
+		for (int i = 0; i < _numPendingServices; i++)
+			if (NULL != this->_pendingServices[i].target &&
+				i == this->_findPendingTarget(this->_pendingServices[i].target))
+				qCnt++;
+
+		if (0 == qCnt)
+			return MDNSNothingToDo;
+
+		dnsHeader->queryCount = __htons(qCnt);
+		break;
+	}
+	case MDNSPacketTypeProbe:
+	{
+		uint16_t qCnt = (this->_hostProbed ? 0 : 1) + this->_countProxyHosts(0);
+		for (int i = 0; i < NumMDNSServiceRecords; i++)
+			if (NULL != this->_serviceRecords[i] && !this->_serviceRecords[i]->probed)
+				qCnt++;
+
+		if (0 == qCnt)
+			return MDNSNothingToDo;
+
+		// one question per name, and our proposed records in the authority section
+		dnsHeader->queryCount = __htons(qCnt);
+		dnsHeader->authorityCount = __htons(qCnt + ((!this->_hostProbed && this->_hasIPv6()) ? 1 : 0));
+		break;
+	}
+	case MDNSPacketTypeGoodbye:
+	case MDNSPacketTypeAnnounce:
+	{
+		// our address(es), those of the proxy hosts, and PTR, SRV and TXT for every service.
+		// announcements also carry the DNS-SD service type PTR.
+		uint16_t aCnt = (this->_hasIPv6() ? 2 : 1) + this->_countProxyHosts(1);
+		for (int i = 0; i < NumMDNSServiceRecords; i++)
+			if (NULL != this->_serviceRecords[i] && this->_serviceRecords[i]->probed)
+				aCnt += ((MDNSPacketTypeAnnounce == type) ? 4 : 3) + this->_countServiceSubtypes(i);
+
+		dnsHeader->answerCount = __htons(aCnt);
+		dnsHeader->queryResponse = 1;
+		dnsHeader->authoritiveAnswer = 1;
+		break;
+	}
+	case MDNSPacketTypeAddressGoodbye:
+	case MDNSPacketTypeProxyHostGoodbye:
+	case MDNSPacketTypeServiceTxt:
+		dnsHeader->answerCount = __htons(1);
+		dnsHeader->queryResponse = 1;
+		dnsHeader->authoritiveAnswer = 1;
+		break;
+	case MDNSPacketTypeHostRefresh:
+	case MDNSPacketTypeServiceRefresh:
+	{
+		// host records: the addresses and all SRVs. service records: TXT and the PTRs.
+		uint16_t aCnt = (MDNSPacketTypeHostRefresh == type) ?
+							(this->_hasIPv6() ? 2 : 1) + this->_countProxyHosts(1) : 0;
+		for (int i = 0; i < NumMDNSServiceRecords; i++)
+			if (NULL != this->_serviceRecords[i] && this->_serviceRecords[i]->probed)
+				aCnt += (MDNSPacketTypeHostRefresh == type) ? 1 : 3 + this->_countServiceSubtypes(i);
+
+		if (0 == aCnt)
+			return MDNSNothingToDo;
+
+		dnsHeader->answerCount = __htons(aCnt);
+		dnsHeader->queryResponse = 1;
+		dnsHeader->authoritiveAnswer = 1;
+		break;
+	}
+	case MDNSPacketTypeServiceSubtype:
+		// the subtype PTRs, and SRV, TXT and the target's address(es) as additional records
+		dnsHeader->answerCount = __htons(this->_countServiceSubtypes(serviceRecord));
+		dnsHeader->additionalCount = __htons(
+			this->_hostRecordCount(this->_serviceRecords[serviceRecord]->host) + 2);
+		dnsHeader->queryResponse = 1;
+		dnsHeader->authoritiveAnswer = 1;
+		break;
+	case MDNSPacketTypeNegativeAnswer:
+		// an NSEC record in the answer section, and the address(es) for host name queries
+		dnsHeader->answerCount = __htons(1);
+		if (serviceRecord < 0)
+			dnsHeader->additionalCount = __htons(this->_hostRecordCount(-1 - serviceRecord));
+		dnsHeader->authoritiveAnswer = 1;
+		dnsHeader->queryResponse = 1;
+		break;
+	}
+
+	Log::sending(peerAddress, xid, type, serviceRecord);
+
+	uint16_t len;
+	int sent = 0;
+
+	if (this->_iface->socket.beginPacket(mdnsMulticastIPAddr, MDNS_SERVER_PORT))
+	{
+		len = this->_writeMDNSMessage(dnsHeader, type, serviceRecord);
+		sent = this->_countSentPacket(type, len, this->_iface->socket.endPacket());
+	}
+	else
+		this->_stats.txErrors++;
+
+	// dual-stack: the same message goes to the IPv6 group, if our socket joined it
+	if (Features::ipv6 && this->_iface->ipv6Multicast)
+	{
+		if (MDNSUdpIPv6<UdpClass>::beginPacket(this->_iface->socket, IPv6Address(mdnsMulticastIPv6Addr), MDNS_SERVER_PORT))
+		{
+			len = this->_writeMDNSMessage(dnsHeader, type, serviceRecord);
+			sent |= this->_countSentPacket(type, len, this->_iface->socket.endPacket());
+		}
+		else
+			this->_stats.txErrors++;
+	}
+
+	return sent ? statusCode : MDNSSocketError;
+}
+
+// return value:
+// 1 if the packet went out
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_countSentPacket(int type, uint16_t len, int sent)
+{
+	if (!sent)
+	{
+		this->_stats.txErrors++;
+		return 0;
+	}
+
+	if (type >= 0 && type < NumMDNSPacketTypes)
+	{
+		this->_stats.txPackets[type]++;
+		this->_stats.txBytes[type] += len;
+	}
+
+	return 1;
+}
+
+// writes header and records of a message of the given type to the current packet.
+// return value:
+// the size of the message, in bytes
+template <class UdpClass, class Features>
+uint16_t EthernetBonjour3Class<UdpClass, Features>::_writeMDNSMessage(const DNSHeader_t *dnsHeader, int type,
+																	  int serviceRecord)
+{
+	uint16_t ptr = 0;
+
+	// the header buffer doubles as scratch space while we write the records
+	DNSHeader_t scratch;
+	uint8_t *buf = (uint8_t *)&scratch;
+
+	this->_iface->socket.write((uint8_t *)dnsHeader, sizeof(DNSHeader_t));
+	ptr += sizeof(DNSHeader_t);
+
+	// construct the answer section
+	switch (type)
+	{
+	case MDNSPacketTypeMyIPAnswer:
+	{
+		this->_writeMyIPAnswerRecord(&ptr, buf, sizeof(DNSHeader_t), this->_hostTTL, 1);
+		if (this->_hasIPv6())
+			this->_writeMyIPv6AnswerRecord(&ptr, buf, sizeof(DNSHeader_t), this->_hostTTL, 1);
+
+		// tell the peer which records we don't have, so it doesn't need to ask
+		this->_writeNSECRecord(-1, &ptr, buf, sizeof(DNSHeader_t), this->_hostTTL);
+		break;
+	}
+
+	case MDNSPacketTypeProxyHostAnswer:
+	{
+		for (int i = 0; i < _numProxyHosts; i++)
+			if (this->_proxyHosts[i].askedFor & MDNS_PROXY_ASKED_ADDRESS)
+				this->_writeHostRecords(i + 1, &ptr, buf, sizeof(DNSHeader_t), this->_hostTTL, 1);
+
+		for (int i = 0; i < _numProxyHosts; i++)
+			if (this->_proxyHosts[i].askedFor & MDNS_PROXY_ASKED_ADDRESS)
+				this->_writeNSECRecord(MDNS_HOST_RECORD(i + 1), &ptr, buf, sizeof(DNSHeader_t),
+									   this->_hostTTL);
+		break;
+	}
+
+	case MDNSPacketTypeServiceRecord:
+	{
+
+		// SRV location record
+		this->_writeServiceRecordSRV(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), this->_hostTTL, 1);
+
+		// TXT record
+		this->_writeServiceRecordTXT(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), this->_serviceTTL);
+
+		// PTR record (for the dns-sd service in general)
+		this->_writeDNSSDServicePTR(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), this->_serviceTTL);
+
+		// PTR record (our service)
+		this->_writeServiceRecordPTR(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), this->_serviceTTL);
+
+		// finally, the IP address(es) of the SRV target as additional record
+		uint8_t host = this->_serviceRecords[serviceRecord]->host;
+		this->_writeHostRecords(host, &ptr, buf, sizeof(DNSHeader_t), this->_hostTTL, 1);
+
+		// and the NSEC records for the service instance and the target's host name
+		this->_writeNSECRecord(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), this->_hostTTL);
+		this->_writeNSECRecord(MDNS_HOST_RECORD(host), &ptr, buf, sizeof(DNSHeader_t), this->_hostTTL);
+
+		break;
+	}
+
+	case MDNSPacketTypeServiceInstanceAnswer:
+	{
+		// a question for the instance name itself doesn't need the PTRs
+		this->_writeServiceRecordSRV(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), this->_hostTTL, 1);
+		this->_writeServiceRecordTXT(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), this->_serviceTTL);
+
+		uint8_t host = this->_serviceRecords[serviceRecord]->host;
+		this->_writeHostRecords(host, &ptr, buf, sizeof(DNSHeader_t), this->_hostTTL, 1);
+
+		this->_writeNSECRecord(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), this->_hostTTL);
+		this->_writeNSECRecord(MDNS_HOST_RECORD(host), &ptr, buf, sizeof(DNSHeader_t), this->_hostTTL);
+
+		break;
+	}
+
+	case MDNSPacketTypeServiceRecordRelease:
+	{
+		// just send our service PTR with a TTL of zero
+		this->_writeServiceRecordPTR(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), 0);
+		break;
+	}
+	case MDNSPacketTypeGoodbye:
+	{
+		// all our records with a TTL of zero
+		this->_writeMyIPAnswerRecord(&ptr, buf, sizeof(DNSHeader_t), 0, 1);
+		if (this->_hasIPv6())
+			this->_writeMyIPv6AnswerRecord(&ptr, buf, sizeof(DNSHeader_t), 0, 1);
+
+		for (int i = 0; i < _numProxyHosts; i++)
+			if (NULL != this->_proxyHosts[i].name && this->_proxyHosts[i].probed)
+				this->_writeHostRecords(i + 1, &ptr, buf, sizeof(DNSHeader_t), 0, 1);
+
+		for (int i = 0; i < NumMDNSServiceRecords; i++)
+		{
+			if (NULL == this->_serviceRecords[i] || !this->_serviceRecords[i]->probed)
+				continue;
+
+			this->_writeServiceRecordPTR(i, &ptr, buf, sizeof(DNSHeader_t), 0);
+			this->_writeServiceRecordSRV(i, &ptr, buf, sizeof(DNSHeader_t), 0, 1);
+			this->_writeServiceRecordTXT(i, &ptr, buf, sizeof(DNSHeader_t), 0);
+
+			for (int k = 0; k < NumMDNSServiceSubtypes; k++)
+				if (NULL != this->_serviceRecords[i]->subtypes[k])
+					this->_writeServiceSubtypePTR(i, k, &ptr, buf, sizeof(DNSHeader_t), 0);
+		}
+		break;
+	}
+	case MDNSPacketTypeAnnounce:
+	{
+		// everything we own in one packet
+		this->_writeMyIPAnswerRecord(&ptr, buf, sizeof(DNSHeader_t), this->_hostTTL, 1);
+		if (this->_hasIPv6())
+			this->_writeMyIPv6AnswerRecord(&ptr, buf, sizeof(DNSHeader_t), this->_hostTTL, 1);
+
+		for (int i = 0; i < _numProxyHosts; i++)
+			if (NULL != this->_proxyHosts[i].name && this->_proxyHosts[i].probed)
+				this->_writeHostRecords(i + 1, &ptr, buf, sizeof(DNSHeader_t), this->_hostTTL, 1);
+
+		for (int i = 0; i < NumMDNSServiceRecords; i++)
+		{
+			if (NULL == this->_serviceRecords[i] || !this->_serviceRecords[i]->probed)
+				continue;
+
+			this->_writeServiceRecordSRV(i, &ptr, buf, sizeof(DNSHeader_t), this->_hostTTL, 1);
+			this->_writeServiceRecordTXT(i, &ptr, buf, sizeof(DNSHeader_t), this->_serviceTTL);
+			this->_writeDNSSDServicePTR(i, &ptr, buf, sizeof(DNSHeader_t), this->_serviceTTL);
+			this->_writeServiceRecordPTR(i, &ptr, buf, sizeof(DNSHeader_t), this->_serviceTTL);
+
+			for (int k = 0; k < NumMDNSServiceSubtypes; k++)
+				if (NULL != this->_serviceRecords[i]->subtypes[k])
+					this->_writeServiceSubtypePTR(i, k, &ptr, buf, sizeof(DNSHeader_t), this->_serviceTTL);
+		}
+		break;
+	}
+	case MDNSPacketTypeHostRefresh:
+	{
+		this->_writeMyIPAnswerRecord(&ptr, buf, sizeof(DNSHeader_t), this->_hostTTL, 1);
+		if (this->_hasIPv6())
+			this->_writeMyIPv6AnswerRecord(&ptr, buf, sizeof(DNSHeader_t), this->_hostTTL, 1);
+
+		for (int i = 0; i < _numProxyHosts; i++)
+			if (NULL != this->_proxyHosts[i].name && this->_proxyHosts[i].probed)
+				this->_writeHostRecords(i + 1, &ptr, buf, sizeof(DNSHeader_t), this->_hostTTL, 1);
+
+		for (int i = 0; i < NumMDNSServiceRecords; i++)
+			if (NULL != this->_serviceRecords[i] && this->_serviceRecords[i]->probed)
+				this->_writeServiceRecordSRV(i, &ptr, buf, sizeof(DNSHeader_t), this->_hostTTL, 1);
+		break;
+	}
+	case MDNSPacketTypeServiceRefresh:
+	{
+		for (int i = 0; i < NumMDNSServiceRecords; i++)
+		{
+			if (NULL == this->_serviceRecords[i] || !this->_serviceRecords[i]->probed)
+				continue;
+
+			this->_writeServiceRecordTXT(i, &ptr, buf, sizeof(DNSHeader_t), this->_serviceTTL);
+			this->_writeDNSSDServicePTR(i, &ptr, buf, sizeof(DNSHeader_t), this->_serviceTTL);
+			this->_writeServiceRecordPTR(i, &ptr, buf, sizeof(DNSHeader_t), this->_serviceTTL);
+
+			for (int k = 0; k < NumMDNSServiceSubtypes; k++)
+				if (NULL != this->_serviceRecords[i]->subtypes[k])
+					this->_writeServiceSubtypePTR(i, k, &ptr, buf, sizeof(DNSHeader_t), this->_serviceTTL);
+		}
+		break;
+	}
+	case MDNSPacketTypeServiceSubtype:
+	{
+		for (int k = 0; k < NumMDNSServiceSubtypes; k++)
+			if (NULL != this->_serviceRecords[serviceRecord]->subtypes[k])
+				this->_writeServiceSubtypePTR(serviceRecord, k, &ptr, buf, sizeof(DNSHeader_t),
+											  this->_serviceTTL);
+
+		this->_writeServiceRecordSRV(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), this->_hostTTL, 1);
+		this->_writeServiceRecordTXT(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), this->_serviceTTL);
+		this->_writeHostRecords(this->_serviceRecords[serviceRecord]->host, &ptr, buf,
+								sizeof(DNSHeader_t), this->_hostTTL, 1);
+		break;
+	}
+	case MDNSPacketTypeServiceTxt:
+	{
+		// only the TXT record changed, so that's all we send
+		this->_writeServiceRecordTXT(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), this->_serviceTTL);
+		break;
+	}
+	case MDNSPacketTypeAddressGoodbye:
+	{
+		// our IPv4 address is about to change, so this one is gone
+		this->_writeMyIPAnswerRecord(&ptr, buf, sizeof(DNSHeader_t), 0, 1);
+		break;
+	}
+	case MDNSPacketTypeProxyHostGoodbye:
+	{
+		// the proxy host in slot serviceRecord is about to go away
+		this->_writeHostRecords(serviceRecord + 1, &ptr, buf, sizeof(DNSHeader_t), 0, 1);
+		break;
+	}
+	case MDNSPacketTypeNameQuery:
+	case MDNSPacketTypeServiceQuery:
+	{
+		// construct a query for the name of the lookup in slot serviceRecord
+		this->_writeDNSName(this->_queries[serviceRecord].name, &ptr, buf, sizeof(DNSHeader_t), 1);
+
+		buf[0] = buf[2] = 0x0;
+		buf[1] = (type == MDNSPacketTypeServiceQuery) ? 0x0c : 0x01;
+		buf[3] = 0x1;
+
+		//		this->_iface->socket.write((uint8_t *)buf, sizeof(DNSHeader_t));
+		//		ptr += sizeof(DNSHeader_t);
+
+		this->_iface->socket.write((uint8_t *)buf, 4);
+		ptr += 4;
+
+		break;
+	}
+	case MDNSPacketTypeAddressQuery:
+	{
+		// ask for the A records of all SRV targets we're still missing, in one packet
+		for (int i = 0; i < _numPendingServices; i++)
+		{
+			if (NULL == this->_pendingServices[i].target ||
+				i != this->_findPendingTarget(this->_pendingServices[i].target))
+				continue;
+
+			this->_writeDNSName(this->_pendingServices[i].target, &ptr, buf, sizeof(DNSHeader_t), 1);
+
+			buf[0] = buf[2] = 0x0;
+			buf[1] = 0x01; // A record
+			buf[3] = 0x1;
+
+			this->_iface->socket.write((uint8_t *)buf, 4);
+			ptr += 4;
+		}
+
+		break;
+	}
+	case MDNSPacketTypeProbe:
+	{
+		// ask whether anybody already uses the names we're about to claim (QU, type ANY)...
+		if (!this->_hostProbed)
+		{
+			this->_writeDNSName(this->_bonjourName, &ptr, buf, sizeof(DNSHeader_t), 1);
+
+			buf[0] = 0x00;
+			buf[1] = 0xff; // ANY
+			buf[2] = 0x80; // unicast response
+			buf[3] = 0x01; // class IN
+
+			this->_iface->socket.write((uint8_t *)buf, 4);
+			ptr += 4;
+		}
+
+		for (int i = 0; i < _numProxyHosts; i++)
+		{
+			if (NULL == this->_proxyHosts[i].name || this->_proxyHosts[i].probed)
+				continue;
+
+			this->_writeDNSName(this->_proxyHosts[i].name, &ptr, buf, sizeof(DNSHeader_t), 1);
+
+			buf[0] = 0x00;
+			buf[1] = 0xff; // ANY
+			buf[2] = 0x80; // unicast response
+			buf[3] = 0x01; // class IN
+
+			this->_iface->socket.write((uint8_t *)buf, 4);
+			ptr += 4;
+		}
+
+		for (int i = 0; i < NumMDNSServiceRecords; i++)
+		{
+			if (NULL == this->_serviceRecords[i] || this->_serviceRecords[i]->probed)
+				continue;
+
+			this->_writeServiceRecordName(i, &ptr, buf, sizeof(DNSHeader_t), 0);
+
+			buf[0] = 0x00;
+			buf[1] = 0xff; // ANY
+			buf[2] = 0x80; // unicast response
+			buf[3] = 0x01; // class IN
+
+			this->_iface->socket.write((uint8_t *)buf, 4);
+			ptr += 4;
+		}
+
+		// ...and tell them which records we intend to use, for simultaneous probe tiebreaking
+		if (!this->_hostProbed)
+		{
+			this->_writeMyIPAnswerRecord(&ptr, buf, sizeof(DNSHeader_t), this->_hostTTL, 0);
+			if (this->_hasIPv6())
+				this->_writeMyIPv6AnswerRecord(&ptr, buf, sizeof(DNSHeader_t), this->_hostTTL, 0);
+		}
+
+		for (int i = 0; i < _numProxyHosts; i++)
+			if (NULL != this->_proxyHosts[i].name && !this->_proxyHosts[i].probed)
+				this->_writeHostRecords(i + 1, &ptr, buf, sizeof(DNSHeader_t), this->_hostTTL, 0);
+
+		for (int i = 0; i < NumMDNSServiceRecords; i++)
+			if (NULL != this->_serviceRecords[i] && !this->_serviceRecords[i]->probed)
+				this->_writeServiceRecordSRV(i, &ptr, buf, sizeof(DNSHeader_t), this->_hostTTL, 0);
+
+		break;
+	}
+	case MDNSPacketTypeNegativeAnswer:
+	{
+		// we were asked for a record type we don't have (like AAAA without IPv6), so we
+		// assert which types exist for that name (RFC 6762, section 6.1)
+		this->_writeNSECRecord(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), this->_hostTTL);
+
+		// send the address record(s) as additional record, in case the peer wants them.
+		if (serviceRecord < 0)
+			this->_writeHostRecords(-1 - serviceRecord, &ptr, buf, sizeof(DNSHeader_t), this->_hostTTL, 1);
+
+		break;
+	}
+	}
+
+	return ptr;
+}
+
+// return value:
+// A DNSError_t (DNSSuccess on success, something else otherwise)
+// in "int" mode: positive on success, negative on error
+template <class UdpClass, class Features>
+MDNSError_t EthernetBonjour3Class<UdpClass, Features>::_processMDNSQuery()
+{
+	MDNSError_t statusCode = MDNSSuccess;
+
+	int j;
+	uint32_t xid = 0;
+	uint8_t isResponse, opCode;
+	uint16_t udp_len, qCnt, aCnt, aaCnt, addCnt;
+	uint8_t recordsAskedFor[NumMDNSServiceRecords + 2];
+	uint8_t hostRecordMissing = 0;
+	uint8_t subtypesAskedFor[NumMDNSServiceRecords];
+	const uint8_t *udpBuffer = NULL;
+	uint8_t *udpCopy = NULL;
+	uint8_t head[sizeof(DNSHeader_t) + 1 + MDNS_MAX_LABEL_LEN];
+	uint16_t headLen;
+
+	memset(recordsAskedFor, 0, sizeof(uint8_t) * (NumMDNSServiceRecords + 2));
+	memset(subtypesAskedFor, 0, sizeof(uint8_t) * NumMDNSServiceRecords);
+
+	udp_len = this->_iface->socket.parsePacket();
+	if (0 == udp_len)
+	{
+		statusCode = MDNSTryLater;
+		goto errorReturn;
+	}
+
+	this->_stats.rxPackets++;
+	this->_stats.rxBytes += udp_len;
+
+	if (udp_len < sizeof(DNSHeader_t))
+	{
+		this->_stats.rxParseErrors++;
+		this->_iface->socket.flush();
+		goto errorReturn;
+	}
+
+	// most of the traffic on a busy network is of no interest to us. the header and the first
+	// label of the packet usually tell, so we look at those before reading the rest.
+	headLen = this->_readPacketHead(udp_len, head);
+	if (!this->_wantPacket(udp_len, head, headLen))
+	{
+		this->_stats.rxDropped++;
+		this->_iface->socket.flush();
+		goto errorReturn;
+	}
+
+	// if the socket lets us look at the datagram in place, we parse it right there. otherwise,
+	// the rest of it is read from the W5100/W5200 into a heap buffer.
+	udpBuffer = MDNSUdpPacket<UdpClass>::acquire(this->_iface->socket, udp_len, &udpCopy, head, headLen);
+	if (NULL == udpBuffer)
+	{
+		this->_iface->socket.flush();
+		statusCode = MDNSOutOfMemory;
+		goto errorReturn;
+	}
+
+	// header fields are read directly from the packet
+	xid = __loadBE16(&udpBuffer[0]);
+	isResponse = udpBuffer[2] >> 7;
+	opCode = (udpBuffer[2] >> 3) & 0x0f;
+	qCnt = __loadBE16(&udpBuffer[4]);
+	aCnt = __loadBE16(&udpBuffer[6]);
+	aaCnt = __loadBE16(&udpBuffer[8]);
+	addCnt = __loadBE16(&udpBuffer[10]);
+
+	if (isResponse)
+		this->_stats.rxResponses++;
+	else
+	{
+		this->_stats.rxQueries++;
+		if (udpBuffer[2] & 0x02)
+			this->_stats.rxTruncated++; // more known answers follow in the next datagram
+	}
+
+	Log::received(udp_len, isResponse, opCode);
+
+	// does anybody else use (or try to claim) one of our names?
+	if (MDNSProbeStateStopped != this->_probeState &&
+		DNSOpQuery == opCode &&
+		MDNS_SERVER_PORT == this->_iface->socket.remotePort() &&
+		(uint32_t)this->_iface->socket.remoteIP() != (uint32_t)this->_iface->localIP)
+		this->_processProbeConflicts(udpBuffer, udp_len, isResponse,
+									 qCnt, aCnt, aaCnt, addCnt);
+
+	if (0 == isResponse &&
+		DNSOpQuery == opCode &&
+		MDNS_SERVER_PORT == this->_iface->socket.remotePort())
+	{
+		// subtype names ("_printer._sub._http._tcp.local") are looked for separately
+		this->_processSubtypeQueries(udpBuffer, udp_len, qCnt, subtypesAskedFor);
+
+		// we don't answer any part of a malformed query
+		if (!this->_processQuestions(udpBuffer, udp_len, qCnt, recordsAskedFor, &hostRecordMissing))
+		{
+			this->_stats.rxParseErrors++;
+			memset(recordsAskedFor, 0, sizeof(uint8_t) * (NumMDNSServiceRecords + 2));
+			memset(subtypesAskedFor, 0, sizeof(uint8_t) * NumMDNSServiceRecords);
+			hostRecordMissing = 0;
+
+			for (j = 0; j < _numProxyHosts; j++)
+				this->_proxyHosts[j].askedFor = 0;
+		}
+	}
+	else if ((Features::resolver || Features::browser) &&
+			 1 == isResponse &&
+			 DNSOpQuery == opCode &&
+			 MDNS_SERVER_PORT == this->_iface->socket.remotePort() &&
+			 this->_hasQueries())
+	{
+		// first, see whether this packet carries an address we're waiting for
+		if (Features::browser)
+			this->_processPendingServices(udpBuffer, udp_len, qCnt, aCnt + aaCnt + addCnt);
+
+		if (!this->_processResponse(udpBuffer, udp_len, qCnt, aCnt + aaCnt + addCnt))
+			this->_stats.rxParseErrors++;
+	}
+	MDNSUdpPacket<UdpClass>::release(this->_iface->socket, udpCopy);
+
+errorReturn:
+	// now, handle the requests
+	for (j = 0; j < NumMDNSServiceRecords + 2; j++)
+	{
+		if (recordsAskedFor[j])
+		{
+			if (0 == j)
+				(void)this->_sendMDNSMessage(this->_iface->socket.remoteIP(), xid, (int)MDNSPacketTypeMyIPAnswer, 0);
+			else if (1 == j)
+			{
+				uint8_t k = 2;
+				for (k = 0; k < NumMDNSServiceRecords; k++)
+					recordsAskedFor[k + 2] |= MDNS_SERVICE_ASKED_PTR;
+			}
+			else if (NULL == this->_serviceRecords[j - 2] || !this->_serviceRecords[j - 2]->probed)
+				continue;
+			else if (recordsAskedFor[j] & MDNS_SERVICE_ASKED_PTR) // carries SRV and TXT as well
+				(void)this->_sendMDNSMessage(this->_iface->socket.remoteIP(), xid, (int)MDNSPacketTypeServiceRecord, j - 2);
+			else if (recordsAskedFor[j] & MDNS_SERVICE_ASKED_INSTANCE)
+				(void)this->_sendMDNSMessage(this->_iface->socket.remoteIP(), xid,
+											 (int)MDNSPacketTypeServiceInstanceAnswer, j - 2);
+			else
+				(void)this->_sendMDNSMessage(this->_iface->socket.remoteIP(), xid, (int)MDNSPacketTypeNegativeAnswer, j - 2);
+		}
+	}
+
+	// subtype browses get the subtype PTRs of matching services, and what's needed to use them
+	for (j = 0; j < NumMDNSServiceRecords; j++)
+		if (subtypesAskedFor[j] && NULL != this->_serviceRecords[j] && this->_serviceRecords[j]->probed)
+			(void)this->_sendMDNSMessage(this->_iface->socket.remoteIP(), xid, (int)MDNSPacketTypeServiceSubtype, j);
+
+	// if we were asked for a host record we don't have (like AAAA without IPv6), say so with
+	// an NSEC. our address answer carries the NSEC already.
+	if (hostRecordMissing && !recordsAskedFor[0])
+		(void)this->_sendMDNSMessage(this->_iface->socket.remoteIP(), xid, (int)MDNSPacketTypeNegativeAnswer, -1);
+
+	// the addresses of all proxy hosts asked for go out together. the others get their NSEC.
+	for (j = 0; j < _numProxyHosts; j++)
+	{
+		if (this->_proxyHosts[j].askedFor & MDNS_PROXY_ASKED_ADDRESS)
+		{
+			(void)this->_sendMDNSMessage(this->_iface->socket.remoteIP(), xid, (int)MDNSPacketTypeProxyHostAnswer, 0);
+			break;
+		}
+	}
+
+	for (j = 0; j < _numProxyHosts; j++)
+	{
+		if (MDNS_PROXY_ASKED_MISSING == this->_proxyHosts[j].askedFor)
+			(void)this->_sendMDNSMessage(this->_iface->socket.remoteIP(), xid,
+										 (int)MDNSPacketTypeNegativeAnswer, MDNS_HOST_RECORD(j + 1));
+
+		this->_proxyHosts[j].askedFor = 0;
+	}
+
+	return statusCode;
+}
+
+// notes which of our records the questions of a query ask for: recordsAskedFor[0] is our
+// address, [1] the DNS-SD service type list, [2...] the MDNS_SERVICE_ASKED_... flags of our
+// services. *pHostRecordMissing is set if a type we don't have is asked for our host name.
+// questions for proxy hosts are noted in their askedFor flags.
+// return values:
+// 1 on success
+// 0 if the query is malformed
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_processQuestions(const uint8_t *pkt, uint16_t pktLen,
+																 uint16_t qCnt, uint8_t *recordsAskedFor,
+																 uint8_t *pHostRecordMissing)
+{
+	DNSRecord_t question;
+	uint16_t i, offset = sizeof(DNSHeader_t);
+	int j;
+
+	for (i = 0; i < qCnt; i++)
+	{
+		if (!this->_nextDNSQuestion(pkt, pktLen, &offset, &question))
+			return 0;
+
+		// class IN, whether or not a unicast response is wanted
+		if (0x0001 != (question.cls & 0x7fff))
+			continue;
+
+		// we don't answer for names we haven't finished probing for.
+		if (this->_hostProbed && this->_matchDNSName(pkt, pktLen, question.nameOffset, this->_bonjourName))
+		{
+			if (0x01 == question.type || 0xff == question.type ||
+				(0x1c == question.type && this->_hasIPv6())) // dual-stack: our address answer carries both A and AAAA
+				recordsAskedFor[0] = 1;
+			else
+				*pHostRecordMissing = 1; // a type we don't have for our host name
+
+			continue;
+		}
+
+		for (j = 0; j < _numProxyHosts; j++)
+		{
+			MDNSProxyHost_t *host = &this->_proxyHosts[j];
+
+			if (NULL != host->name && host->probed &&
+				this->_matchDNSName(pkt, pktLen, question.nameOffset, host->name))
+			{
+				host->askedFor |= (0x01 == question.type || 0xff == question.type) ?
+									  MDNS_PROXY_ASKED_ADDRESS : MDNS_PROXY_ASKED_MISSING;
+				break;
+			}
+		}
+
+		if (j < _numProxyHosts)
+			continue;
+
+		// the instance names we've claimed: "Web._http._tcp.local"
+		for (j = 0; j < NumMDNSServiceRecords; j++)
+		{
+			MDNSServiceRecord_t *record = this->_serviceRecords[j];
+
+			if (NULL != record && record->probed &&
+				this->_matchDNSName(pkt, pktLen, question.nameOffset, record->name,
+									this->_postfixForProtocol(record->proto)))
+			{
+				recordsAskedFor[j + 2] |= (0x10 == question.type || 0x21 == question.type ||
+										   0xff == question.type) ?
+											  MDNS_SERVICE_ASKED_INSTANCE : MDNS_SERVICE_ASKED_MISSING;
+				break;
+			}
+		}
+
+		if (j < NumMDNSServiceRecords)
+			continue;
+
+		if (0x0c != question.type && 0x10 != question.type && 0x21 != question.type &&
+			0xff != question.type)
+			continue;
+
+		if (this->_matchDNSName(pkt, pktLen, question.nameOffset, (const uint8_t *)DNS_SD_SERVICE))
+		{
+			recordsAskedFor[1] = 1;
+			continue;
+		}
+
+		for (j = 0; j < NumMDNSServiceRecords; j++)
+		{
+			if (NULL != this->_serviceRecords[j] &&
+				NULL != this->_serviceRecords[j]->servName &&
+				this->_serviceRecords[j]->probed &&
+				this->_matchDNSName(pkt, pktLen, question.nameOffset, this->_serviceRecords[j]->servName))
+				recordsAskedFor[j + 2] |= MDNS_SERVICE_ASKED_PTR;
+		}
+	}
+
+	return 1;
+}
+
+// looks for the answers to the names we resolve and the services we browse for. the
+// instances a response lists in its PTR records are reported along with their SRV, TXT
+// and A records, if the response carries them. otherwise, we ask the SRV target for its
+// address, and report the instance once it answers. callbacks may start and cancel
+// lookups, so every browse is looked up by its handle again before it gets a result.
+// return values:
+// 1 on success
+// 0 if the response is malformed
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_processResponse(const uint8_t *pkt, uint16_t pktLen,
+																uint16_t qCnt, uint16_t recordCnt)
+{
+	DNSRecord_t record;
+	uint16_t i, offset;
+	int j, wellFormed = 1;
+
+	uint8_t *ptrNames[MDNS_MAX_SERVICES_PER_PACKET];
+	MDNSHandle_t ptrQueries[MDNS_MAX_SERVICES_PER_PACKET]; // the browse each instance is for
+	uint16_t ptrOffsets[MDNS_MAX_SERVICES_PER_PACKET]; // packet offset of the instance name
+	uint16_t ptrPorts[MDNS_MAX_SERVICES_PER_PACKET];
+	uint16_t ptrTargets[MDNS_MAX_SERVICES_PER_PACKET]; // packet offset of the SRV target name
+	uint8_t *servTxt[MDNS_MAX_SERVICES_PER_PACKET];
+	uint8_t servIPs[MDNS_MAX_SERVICES_PER_PACKET][4];
+	uint16_t servIPNames[MDNS_MAX_SERVICES_PER_PACKET]; // packet offset of the A record name
+	uint8_t ptrCount = 0, servIPCount = 0;
+
+	memset(ptrNames, 0, sizeof(ptrNames));
+	memset(ptrPorts, 0, sizeof(ptrPorts));
+	memset(ptrTargets, 0, sizeof(ptrTargets));
+	memset(servTxt, 0, sizeof(servTxt));
+
+	// first, the addresses of the names we resolve, and the instances of the services we browse for
+	offset = sizeof(DNSHeader_t);
+	if (!this->_skipDNSQuestions(pkt, pktLen, &offset, qCnt))
+		return 0;
+
+	for (i = 0; i < recordCnt; i++)
+	{
+		if (!this->_nextDNSRecord(pkt, pktLen, &offset, &record))
+		{
+			wellFormed = 0;
+			break;
+		}
+
+		for (j = 0; j < _numQueries; j++)
+		{
+			MDNSQuery_t *query = &this->_queries[j];
+
+			if (NULL == query->name)
+				continue;
+
+			if (Features::resolver && !query->isService && 0x01 == record.type && 4 == record.dataLength &&
+				this->_matchDNSName(pkt, pktLen, record.nameOffset, query->name))
+			{
+				// ok, this is the IP address. report it via callback.
+				this->_finishedResolvingName(j, (const byte *)&pkt[record.dataOffset]);
+			}
+			else if (Features::browser && query->isService && 0x0c == record.type &&
+					 ptrCount < MDNS_MAX_SERVICES_PER_PACKET &&
+					 this->_matchDNSName(pkt, pktLen, record.nameOffset, query->name))
+			{
+				// the instance name is the first label of the PTR target
+				int len = this->_readDNSLabel(pkt, pktLen, record.dataOffset, NULL, 0);
+
+				if (len > 0 && NULL != this->_alloc(len + 1, &ptrNames[ptrCount]))
+				{
+					(void)this->_readDNSLabel(pkt, pktLen, record.dataOffset, ptrNames[ptrCount], len + 1);
+					ptrOffsets[ptrCount] = record.dataOffset;
+					ptrQueries[ptrCount] = query->handle;
+					ptrCount++;
+				}
+			}
+		}
+	}
+
+	// then, the SRV, TXT and A records that go with those instances
+	offset = sizeof(DNSHeader_t);
+	if (wellFormed && ptrCount > 0 && this->_skipDNSQuestions(pkt, pktLen, &offset, qCnt))
+	{
+		for (i = 0; i < recordCnt; i++)
+		{
+			if (!this->_nextDNSRecord(pkt, pktLen, &offset, &record))
+				break;
+
+			if (0x01 == record.type && 4 == record.dataLength)
+			{
+				if (servIPCount < MDNS_MAX_SERVICES_PER_PACKET)
+				{
+					memcpy(servIPs[servIPCount], &pkt[record.dataOffset], 4);
+					servIPNames[servIPCount] = record.nameOffset;
+					servIPCount++;
+				}
+
+				continue;
+			}
+
+			if (0x21 != record.type && 0x10 != record.type)
+				continue;
+
+			for (j = 0; j < ptrCount; j++)
+			{
+				if (!this->_matchDNSNames(pkt, pktLen, record.nameOffset, ptrOffsets[j]))
+					continue;
+
+				// SRV: priority, weight, port and at least a root label for the target
+				if (0x21 == record.type && record.dataLength >= 7 && 0 == ptrTargets[j])
+				{
+					ptrPorts[j] = __loadBE16(&pkt[record.dataOffset + 4]);
+					ptrTargets[j] = record.dataOffset + 6;
+				}
+				// if there's a content to this txt record, save it for delivery
+				else if (0x10 == record.type && record.dataLength > 1 && NULL == servTxt[j])
+				{
+					if (NULL != this->_alloc(record.dataLength + 1, &servTxt[j]))
+					{
+						memcpy(servTxt[j], &pkt[record.dataOffset], record.dataLength);
+
+						// zero-terminate
+						servTxt[j][record.dataLength] = '\0';
+					}
+				}
+
+				break;
+			}
+		}
+	}
+
+	// deliver the services discovered in this packet
+	if (wellFormed && ptrCount > 0)
+	{
+		uint8_t addedPending = 0;
+
+		for (i = 0; i < ptrCount; i++)
+		{
+			const uint8_t *ipAddr = NULL;
+			uint8_t *target = NULL;
+			int q = this->_findQuery(ptrQueries[i]);
+
+			// an earlier callback may have ended the browse
+			if (q < 0)
+				continue;
+
+			// if we got the SRV record, we know exactly which host we need the address of
+			if (ptrTargets[i])
+			{
+				int tlen = this->_readDNSName(pkt, pktLen, ptrTargets[i], NULL, 0);
+				if (tlen > 0 && NULL != this->_alloc(tlen + 1, &target))
+					(void)this->_readDNSName(pkt, pktLen, ptrTargets[i], target, tlen + 1);
+			}
+
+			if (NULL != target)
+			{
+				for (j = 0; j < servIPCount; j++)
+				{
+					if (this->_matchDNSName(pkt, pktLen, servIPNames[j], target))
+					{
+						ipAddr = servIPs[j];
+						break;
+					}
+				}
+
+				// the address wasn't in this packet, so ask the target host for it
+				if (NULL == ipAddr)
+				{
+					int added = this->_addPendingService(ptrNames[i], target, servTxt[i], ptrPorts[i],
+														 ptrQueries[i]);
+					if (added)
 					{
-						if (servNamePos[j] && servNamePos[j] != buf[0])
-						{
-							servMatches[j] = 0; // no match
-						}
+						ptrNames[i] = NULL;
+						servTxt[i] = NULL;
+						if (1 == added)
+							addedPending = 1;
 					}
+					else
+						this->_free(target);
+
+					continue;
+				}
+
+				this->_free(target);
+			}
+			else if (servIPCount > 0)
+			{
+				// no SRV record, so we can only guess that the first address is the right one
+				ipAddr = servIPs[0];
+			}
+
+			if (ipAddr)
+			{
+				MDNSQuery_t *query = &this->_queries[q];
+				char typeName[MDNS_MAX_LABEL_LEN + 1];
+
+				this->_queryTypeName(query, typeName);
+
+				query->serviceCallback(query->context,
+									   query->handle,
+									   typeName,
+									   query->proto,
+									   (const char *)ptrNames[i],
+									   (const byte *)ipAddr,
+									   (unsigned short)ptrPorts[i],
+									   (const char *)servTxt[i]);
+			}
+		}
+
+		// batch the address queries for all instances of this packet into one query
+		if (addedPending)
+			(void)this->_sendMDNSMessage(0, 0, (int)MDNSPacketTypeAddressQuery, 0);
+	}
+
+	for (i = 0; i < MDNS_MAX_SERVICES_PER_PACKET; i++)
+	{
+		this->_free(ptrNames[i]);
+		this->_free(servTxt[i]);
+	}
+
+	return wellFormed;
+}
+
+// return value:
+// the number of datagrams handled
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::run()
+{
+	uint8_t i, n;
+	int handled = 0;
+	unsigned long start = micros();
+
+	// blocks freed since the last run() are merged into one piece here, where nobody holds a
+	// pointer into the arena. callbacks from within run() don't move anything.
+	this->_compactArena();
+	this->_running = 1;
+
+	// first, handle the MDNS packets waiting in the socket, within our budget. in interrupt
+	// mode, we only touch the socket after the application told us that data has arrived.
+	if (!this->_interruptMode || this->_rxPending)
+	{
+		this->_rxPending = 0;
+
+		// all interfaces share the budget. each call starts with the next one, so a busy
+		// interface can't keep the others from being read. while we're handling a packet,
+		// _iface tells everyone where it came from.
+		for (n = 0; n < NumMDNSInterfaces; n++)
+		{
+			i = (this->_runFirstInterface + n) % NumMDNSInterfaces;
+
+			if (!this->_interfaces[i].active)
+				continue;
+
+			if (handled >= this->_runMaxPackets ||
+				(this->_runMaxMicros && micros() - start >= this->_runMaxMicros))
+				break;
+
+			this->_iface = &this->_interfaces[i];
+
+			while (handled < this->_runMaxPackets)
+			{
+				MDNSError_t result = this->_processMDNSQuery();
+				if (MDNSTryLater == result)
+					break;
+				else if (MDNSOutOfMemory == result)
+					this->_stats.allocFailures++;
+
+				handled++;
+
+				if (this->_runMaxMicros && micros() - start >= this->_runMaxMicros)
+					break;
+			}
+		}
+
+		this->_iface = NULL;
+		this->_runFirstInterface = (this->_runFirstInterface + 1) % NumMDNSInterfaces;
+
+		// we ran out of budget, so there may be more data waiting for the next call
+		if (handled >= this->_runMaxPackets ||
+			(this->_runMaxMicros && micros() - start >= this->_runMaxMicros))
+			this->_rxPending = 1;
+	}
+
+	unsigned long now = millis();
+
+	// are we claiming names? if so, is it time for the next probe?
+	if (this->_timerExpired(MDNSTimerProbe, now))
+	{
+		if (this->_probeCount < MDNS_PROBE_COUNT)
+		{
+			(void)this->_sendMDNSMessage(0, 0, (int)MDNSPacketTypeProbe, 0);
+
+			this->_probeCount++;
+			this->_armTimer(MDNSTimerProbe, now, MDNS_PROBE_WAIT);
+		}
+		else
+		{
+			// nobody objected, so the names are ours now
+			this->_disarmTimer(MDNSTimerProbe);
+			this->_finishedProbing();
+		}
+	}
+
+	// tell everybody about our freshly claimed names: a few announcements, with the
+	// interval between them doubling each time. after that, we refresh them periodically.
+	if (this->_timerExpired(MDNSTimerAnnounce, now))
+	{
+		this->_announce();
+		this->_announceCount++;
+
+		if (this->_announceCount < MDNS_ANNOUNCE_COUNT)
+			this->_armTimer(MDNSTimerAnnounce, now,
+							(unsigned long)MDNS_ANNOUNCE_INTERVAL << (this->_announceCount - 1));
+		else
+		{
+			this->_disarmTimer(MDNSTimerAnnounce);
+			this->_armTimer(MDNSTimerRefresh, now, this->_refreshDelay(this->_hostTTL));
+			this->_armTimer(MDNSTimerServiceRefresh, now, this->_refreshDelay(this->_serviceTTL));
+		}
+	}
+
+	// now, should we re-announce our records before they expire in the caches? each kind
+	// of record is refreshed according to its own TTL.
+	if (this->_timerExpired(MDNSTimerRefresh, now))
+	{
+		(void)this->_sendMDNSMessage(0, 0, (int)MDNSPacketTypeHostRefresh, 0);
+		this->_armTimer(MDNSTimerRefresh, now, this->_refreshDelay(this->_hostTTL));
+	}
+
+	if (this->_timerExpired(MDNSTimerServiceRefresh, now))
+	{
+		(void)this->_sendMDNSMessage(0, 0, (int)MDNSPacketTypeServiceRefresh, 0);
+		this->_armTimer(MDNSTimerServiceRefresh, now, this->_refreshDelay(this->_serviceTTL));
+	}
+
+	// are we querying names or services? if so, should we resend the packet or time out?
+	for (i = 0; i < _numQueries; i++)
+	{
+		MDNSQuery_t *query = &this->_queries[i];
+
+		if (NULL == query->name)
+			continue;
+
+		if ((long)(now - query->resendDeadline) >= 0)
+			(void)this->_sendQuery(i, now);
+
+		if (query->hasTimeout && (long)(now - query->timeoutDeadline) >= 0)
+		{
+			if (Features::resolver && !query->isService)
+				this->_finishedResolvingName(i, NULL);
+			else if (Features::browser && query->isService)
+			{
+				// the slot is free before the callback runs, so that it can start the next browse
+				MDNSServiceFoundCallback callback = query->serviceCallback;
+				MDNSServiceProtocol_t proto = query->proto;
+				MDNSHandle_t handle = query->handle;
+				void *context = query->context;
+				char typeName[MDNS_MAX_LABEL_LEN + 1];
+
+				this->_queryTypeName(query, typeName);
+				this->_cancelQuery(i);
+
+				callback(context, handle, typeName, proto, NULL, NULL, 0, NULL);
+			}
+		}
+	}
+
+	// are discovered services still waiting for the address of their host?
+	if (Features::browser && this->_timerExpired(MDNSTimerAddressResend, now))
+	{
+		for (i = 0; i < _numPendingServices; i++)
+			if (NULL != this->_pendingServices[i].target &&
+				this->_pendingServices[i].tries >= MDNS_AQUERY_MAX_TRIES)
+				this->_removePendingService(i);
+
+		// re-armed by _sendMDNSMessage if anything is left to ask for
+		this->_disarmTimer(MDNSTimerAddressResend);
+		(void)this->_sendMDNSMessage(0, 0, (int)MDNSPacketTypeAddressQuery, 0);
+	}
+
+	unsigned long elapsed = micros() - start;
+	if (elapsed > this->_stats.maxRunMicros)
+		this->_stats.maxRunMicros = elapsed;
+
+	this->_running = 0;
+
+	return handled;
+}
+
+// limits how many datagrams a single run() handles (at least one), and for how many
+// microseconds (0 for no time limit).
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::setRunBudget(uint8_t maxPackets, unsigned long maxMicros)
+{
+	this->_runMaxPackets = maxPackets ? maxPackets : 1;
+	this->_runMaxMicros = maxMicros;
+}
+
+// return value:
+// the number of milliseconds until run() has something to do on its own (send a probe,
+// announcement or query, or report a timeout), 0 if that is overdue or datagrams are still
+// waiting from the last run(), or MDNS_NO_WAKEUP if nothing is scheduled. datagrams that
+// arrive in the meantime are not accounted for.
+template <class UdpClass, class Features>
+unsigned long EthernetBonjour3Class<UdpClass, Features>::nextWakeupMillis()
+{
+	unsigned long now = millis();
+	unsigned long next = MDNS_NO_WAKEUP;
+	int i;
+
+	if (this->_rxPending)
+		return 0;
+
+	for (i = 0; i < NumMDNSTimers; i++)
+	{
+		if (this->_timersArmed & (1 << i))
+		{
+			long left = (long)(this->_timerDeadlines[i] - now);
+
+			if (left <= 0)
+				return 0;
+			if ((unsigned long)left < next)
+				next = (unsigned long)left;
+		}
+	}
+
+	// lookups keep their deadlines themselves
+	for (i = 0; i < _numQueries; i++)
+	{
+		const MDNSQuery_t *query = &this->_queries[i];
+
+		if (NULL == query->name)
+			continue;
+
+		long left = (long)(query->resendDeadline - now);
+		if (query->hasTimeout && (long)(query->timeoutDeadline - now) < left)
+			left = (long)(query->timeoutDeadline - now);
+
+		if (left <= 0)
+			return 0;
+		if ((unsigned long)left < next)
+			next = (unsigned long)left;
+	}
+
+	return next;
+}
+
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_armTimer(MDNSTimer_t timer, unsigned long now, unsigned long delay)
+{
+	this->_timerDeadlines[timer] = now + delay;
+	this->_timersArmed |= (1 << timer);
+}
+
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_disarmTimer(MDNSTimer_t timer)
+{
+	this->_timersArmed &= ~(1 << timer);
+}
+
+// compares deadlines by their signed distance to now, so this keeps working when millis()
+// wraps around (after about 49 days), as long as no deadline is more than 24 days away.
+// return values:
+// 1 if the timer is armed and its deadline has passed
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_timerExpired(MDNSTimer_t timer, unsigned long now)
+{
+	return (this->_timersArmed & (1 << timer)) &&
+		   (long)(now - this->_timerDeadlines[timer]) >= 0;
+}
+
+// in interrupt mode, run() only reads from the socket after notifyPacketAvailable() was
+// called, e.g. from the interrupt handler of the ethernet chip.
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::setInterruptMode(int enabled)
+{
+	this->_interruptMode = enabled ? 1 : 0;
+	this->_rxPending = 1;
+}
+
+// safe to call from an interrupt handler.
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::notifyPacketAvailable()
+{
+	this->_rxPending = 1;
+}
+
+// return values:
+// 1 on success
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::setBonjourName(const char *bonjourName)
+{
+	uint8_t *n;
+
+	if (NULL == bonjourName || strlen(bonjourName) > MDNS_MAX_LABEL_LEN)
+		return 0;
+
+	// we keep the old name if there's no room for the new one
+	this->_compactArena();
+
+	if (NULL == this->_alloc(strlen(bonjourName) + 7, &n))
+		return 0;
+
+	strcpy((char *)n, bonjourName);
+	strcpy((char *)n + strlen(bonjourName), MDNS_TLD);
+
+	this->_free(this->_bonjourName);
+	this->_bonjourName = n;
+	this->_setOwner(n, &this->_bonjourName);
+
+	// the new name has to be probed for before we use it
+	this->_hostProbed = 0;
+	this->_startProbing(0);
+
+	return 1;
+}
+
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::setNameRegisteredCallback(BonjourNameRegisteredCallback newCallback)
+{
+	this->_nameRegisteredCallback = newCallback;
+}
+
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::isNameRegistered()
+{
+	return this->_hostProbed;
+}
+
+// return values:
+// 1 on success
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::addServiceRecord(const char *name, uint16_t port,
+																MDNSServiceProtocol_t proto)
+{
+#if defined(__MK20DX128__) || defined(__MK20DX256__)
+	return this->addServiceRecord(name, port, proto, NULL); //works for Teensy 3 (32-bit Arm Cortex)
+#else
+	return this->addServiceRecord(name, port, proto, ""); //works for Teensy 2 (8-bit Atmel)
+#endif
+}
+
+// return values:
+// 1 on success
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::addServiceRecord(const char *name, uint16_t port,
+																MDNSServiceProtocol_t proto, const char *textContent)
+{
+	return this->_addServiceRecord(name, port, proto, textContent, 0);
+}
+
+// adds a service record whose SRV target is host: 0 for us, 1 + the index of a proxy host.
+// return values:
+// 1 on success
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_addServiceRecord(const char *name, uint16_t port,
+																 MDNSServiceProtocol_t proto,
+																 const char *textContent, uint8_t host)
+{
+	int i, status = 0;
+	MDNSServiceRecord_t *record = NULL;
+
+	if (NULL != name && 0 != port)
+	{
+		this->_compactArena();
+
+		for (i = 0; i < NumMDNSServiceRecords; i++)
+		{
+			if (NULL == this->_serviceRecords[i])
+			{
+				if (NULL != this->_alloc(sizeof(MDNSServiceRecord_t), &record))
+				{
+					record->name = record->servName = record->textContent = NULL;
+					record->textLength = 0;
+					record->staticParts = 0;
+					record->host = host;
+					memset(record->subtypes, 0, sizeof(record->subtypes));
+
+					if (NULL == this->_alloc(strlen((char *)name) + 1, &record->name))
+						goto errorReturn;
+
+					// textContent is already in wire form ("\x7path=/2"), so it can't contain
+					// zero bytes. use setServiceTxt() for binary values.
+					if (NULL != textContent &&
+						!this->_setTxtContent(record, (const uint8_t *)textContent, strlen(textContent)))
+						goto errorReturn;
+
+					record->port = port;
+					record->proto = proto;
+					strcpy((char *)record->name, name);
+
+					uint8_t *s = this->_findFirstDotFromRight(record->name);
+					if (NULL == this->_alloc(strlen((char *)s) + 13, &record->servName))
+						goto errorReturn;
+
+					strcpy((char *)record->servName, (const char *)s);
+
+					const uint8_t *srv_type = this->_postfixForProtocol(proto);
+					if (srv_type)
+						strcat((char *)record->servName, (const char *)srv_type);
+
+					record->probed = 0;
+
+					this->_serviceRecords[i] = record;
+					this->_setOwner(record, &this->_serviceRecords[i]);
+
+					// the record is announced once probing for its name has finished
+					this->_startProbing(0);
+					status = 1;
+
+					break;
+				}
+			}
+		}
+	}
+
+	return status;
+
+errorReturn:
+	if (NULL != record)
+	{
+		this->_free(record->name);
+		this->_free(record->servName);
+		this->_free(record->textContent);
+		this->_free(record);
+	}
+
+	return 0;
+}
+
+// adds the records of a static table (see MDNS_STATIC_SERVICE). they are used in place, so
+// the table has to stay around until they're removed again.
+// return values:
+// 1 if all records were added
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::addServiceRecords(MDNSServiceRecord_t *records, uint8_t count)
+{
+	int i, j, added = 0, status = 1;
+
+	for (j = 0; j < count; j++)
+	{
+		MDNSServiceRecord_t *record = &records[j];
+
+		if (NULL == record->name || NULL == record->servName || 0 == record->port ||
+			record->textLength > MDNS_MAX_TXT_LENGTH)
+		{
+			status = 0;
+			continue;
+		}
+
+		for (i = 0; i < NumMDNSServiceRecords; i++)
+			if (NULL == this->_serviceRecords[i] || record == this->_serviceRecords[i])
+				break;
+
+		if (i >= NumMDNSServiceRecords)
+		{
+			status = 0;
+			break;
+		}
+
+		if (NULL == this->_serviceRecords[i])
+		{
+			record->probed = 0;
+			this->_serviceRecords[i] = record;
+			added++;
+		}
+	}
+
+	// the records are announced once probing for their names has finished
+	if (added > 0)
+		this->_startProbing(0);
+
+	return status;
+}
+
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_removeServiceRecord(int idx)
+{
+	MDNSServiceRecord_t *record = this->_serviceRecords[idx];
+
+	if (NULL != record)
+	{
+		if (record->probed)
+			(void)this->_sendMDNSMessage(0, 0, (int)MDNSPacketTypeServiceRecordRelease, idx);
+
+		if (!(record->staticParts & MDNS_STATIC_TXT))
+			this->_free(record->textContent);
+
+		if (!(record->staticParts & MDNS_STATIC_SERVNAME))
+			this->_free(record->servName);
+
+		for (int k = 0; k < NumMDNSServiceSubtypes; k++)
+			this->_free(record->subtypes[k]);
+
+		if (!(record->staticParts & MDNS_STATIC_NAME))
+			this->_free(record->name);
+
+		// a static record keeps what is left of it. what we freed can't be used again.
+		if (record->staticParts & MDNS_STATIC_RECORD)
+		{
+			if (!(record->staticParts & MDNS_STATIC_NAME))
+				record->name = NULL;
+			if (!(record->staticParts & MDNS_STATIC_TXT))
+			{
+				record->textContent = NULL;
+				record->textLength = 0;
+			}
+			memset(record->subtypes, 0, sizeof(record->subtypes));
+			record->probed = 0;
+		}
+		else
+			this->_free(record);
+
+		this->_serviceRecords[idx] = NULL;
+	}
+}
+
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::removeServiceRecord(uint16_t port, MDNSServiceProtocol_t proto)
+{
+	this->removeServiceRecord(NULL, port, proto);
+}
+
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::removeServiceRecord(const char *name, uint16_t port,
+																	MDNSServiceProtocol_t proto)
+{
+	int i;
+	for (i = 0; i < NumMDNSServiceRecords; i++)
+		if (NULL != this->_serviceRecords[i] &&
+			port == this->_serviceRecords[i]->port &&
+			proto == this->_serviceRecords[i]->proto &&
+			(NULL == name || 0 == strcmp((char *)this->_serviceRecords[i]->name, name)))
+		{
+			this->_removeServiceRecord(i);
+			break;
+		}
+}
+
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::removeAllServiceRecords()
+{
+	int i;
+	for (i = 0; i < NumMDNSServiceRecords; i++)
+		this->_removeServiceRecord(i);
+}
+
+// makes us answer for name (without ".local") with address, in place of a device that
+// doesn't speak mDNS itself. the name is probed for like ours, and renamed like ours if
+// somebody else has it already. if we answer for name already, its address changes.
+// builds without the proxy (see MDNSFeatures) always fail.
+// return values:
+// 1 on success
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::addProxyHost(const char *name, IPAddress address)
+{
+	if (NULL == name || 0 == _numProxyHosts || strlen(name) > MDNS_MAX_LABEL_LEN)
+		return 0;
+
+	int i = this->_findProxyHost(name);
+
+	if (i >= 0)
+	{
+		MDNSProxyHost_t *host = &this->_proxyHosts[i];
+
+		if ((uint32_t)host->address == (uint32_t)address)
+			return 1;
+
+		host->address = address;
+
+		// the new address flushes the old one from the caches
+		if (host->probed)
+			this->_startAnnouncing();
+
+		return 1;
+	}
+
+	for (i = 0; i < _numProxyHosts; i++)
+		if (NULL == this->_proxyHosts[i].name)
+			break;
+
+	if (i >= _numProxyHosts)
+		return 0;
+
+	MDNSProxyHost_t *host = &this->_proxyHosts[i];
+
+	this->_compactArena();
+
+	if (NULL == this->_alloc(strlen(name) + strlen(MDNS_TLD) + 1, &host->name))
+		return 0;
+
+	strcpy((char *)host->name, name);
+	strcat((char *)host->name, MDNS_TLD);
+	host->address = address;
+	host->probed = 0;
+	host->askedFor = 0;
+
+	this->_startProbing(0);
+
+	return 1;
+}
+
+// stops answering for the proxy host name (its current one, without ".local"), and removes
+// the service records that point to it.
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::removeProxyHost(const char *name)
+{
+	int i = this->_findProxyHost(name);
+
+	if (i >= 0)
+		this->_removeProxyHost(i);
+}
+
+// adds a service record like addServiceRecord(), but for the proxy host hostName (without
+// ".local", see addProxyHost()) instead of for us.
+// return values:
+// 1 on success
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::addProxyServiceRecord(const char *hostName, const char *name,
+																	 uint16_t port, MDNSServiceProtocol_t proto,
+																	 const char *textContent)
+{
+	int i = this->_findProxyHost(hostName);
+
+	if (i < 0)
+		return 0;
+
+	return this->_addServiceRecord(name, port, proto, textContent, i + 1);
+}
+
+// return value:
+// the name of host: ours (0), or that of a proxy host (1 + its index)
+template <class UdpClass, class Features>
+const uint8_t *EthernetBonjour3Class<UdpClass, Features>::_hostName(uint8_t host)
+{
+	return (0 == host) ? this->_bonjourName : this->_proxyHosts[host - 1].name;
+}
+
+// return value:
+// the number of address records _writeHostRecords() writes for host
+template <class UdpClass, class Features>
+uint16_t EthernetBonjour3Class<UdpClass, Features>::_hostRecordCount(uint8_t host)
+{
+	return (0 == host && this->_hasIPv6()) ? 2 : 1;
+}
+
+// return values:
+// the index of the proxy host with the given name (without ".local")
+// -1 if there is none
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_findProxyHost(const char *name)
+{
+	int i;
+
+	if (NULL == name || strlen(name) > MDNS_MAX_LABEL_LEN)
+		return -1;
+
+	uint8_t len = strlen(name);
+
+	for (i = 0; i < _numProxyHosts; i++)
+		if (NULL != this->_proxyHosts[i].name &&
+			mdnsLabelEquals(this->_proxyHosts[i].name, (const uint8_t *)name, len) &&
+			0 == strcmp((const char *)this->_proxyHosts[i].name + len, MDNS_TLD))
+			return i;
+
+	return -1;
+}
+
+// return value:
+// the number of proxy hosts whose name has (probed 1) or hasn't (0) been probed for yet
+template <class UdpClass, class Features>
+uint16_t EthernetBonjour3Class<UdpClass, Features>::_countProxyHosts(uint8_t probed)
+{
+	uint16_t count = 0;
+
+	for (int i = 0; i < _numProxyHosts; i++)
+		if (NULL != this->_proxyHosts[i].name && probed == this->_proxyHosts[i].probed)
+			count++;
+
+	return count;
+}
+
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_removeProxyHost(int idx)
+{
+	MDNSProxyHost_t *host = &this->_proxyHosts[idx];
+	int i;
+
+	for (i = 0; i < NumMDNSServiceRecords; i++)
+		if (NULL != this->_serviceRecords[i] && idx + 1 == this->_serviceRecords[i]->host)
+			this->_removeServiceRecord(i);
+
+	if (host->probed)
+		(void)this->_sendMDNSMessage(0, 0, (int)MDNSPacketTypeProxyHostGoodbye, idx);
+
+	this->_free(host->name);
+	host->name = NULL;
+	host->probed = 0;
+	host->askedFor = 0;
+}
+
+// return values:
+// the index of the service record with the given name and protocol
+// -1 if there is none
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_findServiceRecord(const char *name, MDNSServiceProtocol_t proto)
+{
+	int i;
+
+	if (NULL == name)
+		return -1;
+
+	for (i = 0; i < NumMDNSServiceRecords; i++)
+		if (NULL != this->_serviceRecords[i] &&
+			proto == this->_serviceRecords[i]->proto &&
+			0 == strcmp((char *)this->_serviceRecords[i]->name, name))
+			return i;
+
+	return -1;
+}
+
+// looks for the "key" or "key=value" string in the TXT rdata of a record. keys are
+// case-insensitive.
+// return values:
+// 1 if found, with *pOffset set to the length byte of the string
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_findTxtEntry(const MDNSServiceRecord_t *record, const char *key,
+															 uint16_t *pOffset)
+{
+	uint16_t off = 0, keyLen = strlen(key), i;
+
+	while (off < record->textLength)
+	{
+		uint8_t len = record->textContent[off];
+		const uint8_t *entry = &record->textContent[off + 1];
+
+		if (off + 1 + len > record->textLength)
+			break;
+
+		if (len >= keyLen && (len == keyLen || '=' == entry[keyLen]))
+		{
+			for (i = 0; i < keyLen; i++)
+				if (tolower(entry[i]) != tolower((uint8_t)key[i]))
+					break;
+
+			if (i == keyLen)
+			{
+				*pOffset = off;
+				return 1;
+			}
+		}
+
+		off += 1 + len;
+	}
+
+	return 0;
+}
+
+// replaces the TXT rdata of a record with a copy of content.
+// return values:
+// 1 on success
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_setTxtContent(MDNSServiceRecord_t *record, const uint8_t *content,
+															  uint16_t length)
+{
+	uint8_t *newContent = NULL;
+
+	if (length > MDNS_MAX_TXT_LENGTH)
+		return 0;
+
+	if (length > 0)
+	{
+		if (NULL == this->_alloc(length, &newContent))
+			return 0;
+
+		memcpy(newContent, content, length);
+	}
+
+	if (!(record->staticParts & MDNS_STATIC_TXT))
+		this->_free(record->textContent);
+
+	record->textContent = newContent;
+	this->_setOwner(newContent, &record->textContent);
+	record->textLength = length;
+	record->staticParts &= ~MDNS_STATIC_TXT;
+
+	return 1;
+}
+
+// sets "key=value" in the TXT record of a service, replacing an earlier value for key.
+// value may contain any bytes. a NULL value sets key as a boolean attribute, without "=".
+// call updateTxt() once you're done to tell everybody.
+// return values:
+// 1 on success
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::setServiceTxt(const char *name, MDNSServiceProtocol_t proto,
+															 const char *key, const uint8_t *value,
+															 uint8_t valueLength)
+{
+	this->_compactArena();
+
+	int idx = this->_findServiceRecord(name, proto);
+	if (idx < 0 || NULL == key || 0 == *key || NULL != strchr(key, '='))
+		return 0;
+
+	MDNSServiceRecord_t *record = this->_serviceRecords[idx];
+	uint16_t keyLen = strlen(key);
+	uint16_t entryLen = keyLen + ((NULL != value) ? 1 + valueLength : 0);
+	uint16_t off, oldLen = 0;
+
+	if (entryLen > 255)
+		return 0;
+
+	if (this->_findTxtEntry(record, key, &off))
+		oldLen = 1 + record->textContent[off];
+	else
+		off = record->textLength;
+
+	uint16_t newLength = record->textLength - oldLen + 1 + entryLen;
+	if (newLength > MDNS_MAX_TXT_LENGTH)
+		return 0;
+
+	uint8_t *content;
+	if (NULL == this->_alloc(newLength, &content))
+		return 0;
+
+	// everything before the old entry, the new entry, and everything after the old entry
+	if (off > 0)
+		memcpy(content, record->textContent, off);
+
+	content[off] = entryLen;
+	memcpy(&content[off + 1], key, keyLen);
+	if (NULL != value)
+	{
+		content[off + 1 + keyLen] = '=';
+		if (valueLength > 0)
+			memcpy(&content[off + 2 + keyLen], value, valueLength);
+	}
+
+	if (off + oldLen < record->textLength)
+		memcpy(&content[off + 1 + entryLen], &record->textContent[off + oldLen],
+			   record->textLength - off - oldLen);
+
+	if (!(record->staticParts & MDNS_STATIC_TXT))
+		this->_free(record->textContent);
+
+	record->textContent = content;
+	this->_setOwner(content, &record->textContent);
+	record->textLength = newLength;
+	record->staticParts &= ~MDNS_STATIC_TXT;
+
+	return 1;
+}
+
+// return values:
+// 1 on success
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::setServiceTxt(const char *name, MDNSServiceProtocol_t proto,
+															 const char *key, const char *value)
+{
+	if (NULL != value && strlen(value) > 255)
+		return 0;
+
+	return this->setServiceTxt(name, proto, key, (const uint8_t *)value,
+							   (NULL != value) ? strlen(value) : 0);
+}
+
+// removes key from the TXT record of a service. call updateTxt() once you're done.
+// return values:
+// 1 on success
+// 0 otherwise (no such service or key)
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::removeServiceTxt(const char *name, MDNSServiceProtocol_t proto,
+																const char *key)
+{
+	this->_compactArena();
+
+	int idx = this->_findServiceRecord(name, proto);
+	uint16_t off;
+
+	if (idx < 0 || NULL == key)
+		return 0;
+
+	MDNSServiceRecord_t *record = this->_serviceRecords[idx];
+	if (!this->_findTxtEntry(record, key, &off))
+		return 0;
+
+	// the TXT rdata of a static record is a constant, so we edit a copy of it
+	if ((record->staticParts & MDNS_STATIC_TXT) &&
+		!this->_setTxtContent(record, record->textContent, record->textLength))
+		return 0;
+
+	uint16_t oldLen = 1 + record->textContent[off];
+
+	memmove(&record->textContent[off], &record->textContent[off + oldLen],
+			record->textLength - off - oldLen);
+	record->textLength -= oldLen;
+
+	return 1;
+}
+
+// registers the service also under "<subtype>._sub.<service type>", so that clients can
+// browse for just the instances with this subtype. subtype is a single label, like
+// "_printer".
+// return values:
+// 1 on success
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::addServiceSubtype(const char *name, MDNSServiceProtocol_t proto,
+																 const char *subtype)
+{
+	this->_compactArena();
+
+	int idx = this->_findServiceRecord(name, proto), k;
+
+	if (idx < 0 || NULL == subtype || 0 == *subtype || NULL != strchr(subtype, '.') ||
+		strlen(subtype) > MDNS_MAX_LABEL_LEN)
+		return 0;
+
+	MDNSServiceRecord_t *record = this->_serviceRecords[idx];
+	if (NULL == record->servName)
+		return 0;
+
+	for (k = 0; k < NumMDNSServiceSubtypes; k++)
+		if (NULL == record->subtypes[k])
+			break;
+
+	if (k >= NumMDNSServiceSubtypes)
+		return 0;
+
+	uint8_t *n;
+	if (NULL == this->_alloc(strlen(subtype) + 6 + strlen((char *)record->servName) + 1, &n))
+		return 0;
+
+	strcpy((char *)n, subtype);
+	strcat((char *)n, "._sub.");
+	strcat((char *)n, (char *)record->servName);
+
+	record->subtypes[k] = n;
+	this->_setOwner(n, &record->subtypes[k]);
+
+	// subtype PTRs are shared records, so there's nothing to probe for
+	if (record->probed)
+		this->_startAnnouncing();
+
+	return 1;
+}
+
+// return values:
+// the number of subtypes registered for a service record
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_countServiceSubtypes(int idx)
+{
+	int k, cnt = 0;
+
+	for (k = 0; k < NumMDNSServiceSubtypes; k++)
+		if (NULL != this->_serviceRecords[idx]->subtypes[k])
+			cnt++;
+
+	return cnt;
+}
+
+// marks the service records whose subtype names are asked for by PTR (or ANY) questions.
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_processSubtypeQueries(const uint8_t *pkt, uint16_t pktLen,
+																	   uint16_t qCnt, uint8_t *subtypesAskedFor)
+{
+	DNSRecord_t question;
+	uint16_t offset = sizeof(DNSHeader_t), i;
+	int j, k;
+
+	for (i = 0; i < qCnt; i++)
+	{
+		if (!this->_nextDNSQuestion(pkt, pktLen, &offset, &question))
+			return;
+
+		if (0x0c != question.type && 0xff != question.type)
+			continue;
+
+		for (j = 0; j < NumMDNSServiceRecords; j++)
+		{
+			if (NULL == this->_serviceRecords[j] || !this->_serviceRecords[j]->probed)
+				continue;
+
+			for (k = 0; k < NumMDNSServiceSubtypes; k++)
+				if (NULL != this->_serviceRecords[j]->subtypes[k] &&
+					this->_matchDNSName(pkt, pktLen, question.nameOffset, this->_serviceRecords[j]->subtypes[k]))
+					subtypesAskedFor[j] = 1;
+		}
+	}
+}
+
+// tells everybody about the changed TXT record of a service, without sending anything else.
+// return values:
+// 1 on success
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::updateTxt(const char *name, MDNSServiceProtocol_t proto)
+{
+	int idx = this->_findServiceRecord(name, proto);
+
+	if (idx < 0)
+		return 0;
+
+	// a record we haven't claimed yet will be announced with its new TXT anyway
+	if (this->_serviceRecords[idx]->probed)
+		(void)this->_sendMDNSMessage(0, 0, (int)MDNSPacketTypeServiceTxt, idx);
+
+	return 1;
+}
+
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_writeDNSName(const uint8_t *name, uint16_t *pPtr,
+															  uint8_t *buf, int bufSize, int zeroTerminate)
+{
+	uint16_t ptr = *pPtr;
+	uint8_t *p1 = (uint8_t *)name, *p2, *p3;
+	int i, c, len;
+
+	while (*p1)
+	{
+		c = 1;
+		p2 = p1;
+		while (0 != *p2 && '.' != *p2)
+		{
+			p2++;
+			c++;
+		};
+
+		p3 = buf;
+		i = c;
+		len = bufSize - 1;
+		*p3++ = (uint8_t)--i;
+		while (i-- > 0)
+		{
+			*p3++ = *p1++;
+
+			if (--len <= 0)
+			{
+				this->_iface->socket.write((uint8_t *)buf, bufSize);
+				ptr += bufSize;
+				len = bufSize;
+				p3 = buf;
+			}
+		}
+
+		while ('.' == *p1)
+			++p1;
+
+		if (len != bufSize)
+		{
+			this->_iface->socket.write((uint8_t *)buf, bufSize - len);
+			ptr += bufSize - len;
+		}
+	}
+
+	if (zeroTerminate)
+	{
+		buf[0] = 0;
+		this->_iface->socket.write((uint8_t *)buf, 1);
+		ptr += 1;
+	}
+
+	*pPtr = ptr;
+}
+
+// writes the A record of name
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_writeAddressRecord(const uint8_t *name, const IPAddress &address,
+																	uint16_t *pPtr, uint8_t *buf, int bufSize,
+																	uint32_t ttl, uint8_t cacheFlush)
+{
+	uint16_t ptr = *pPtr;
+
+	this->_writeDNSName(name, &ptr, buf, bufSize, 1);
+
+	buf[0] = 0x00;
+	buf[1] = 0x01;
+	buf[2] = cacheFlush ? 0x80 : 0x00; // cache flush
+	buf[3] = 0x01;
+	this->_iface->socket.write((uint8_t *)buf, 4);
+	ptr += 4;
+
+	*((uint32_t *)buf) = __htonl(ttl);
+	*((uint16_t *)&buf[4]) = __htons(4); // data length
+
+	uint8_t ip[4];
+	IPAddress ipBuf;
+	ipBuf = address;
+	ip[0] = ipBuf[0];
+	ip[1] = ipBuf[1];
+	ip[2] = ipBuf[2];
+	ip[3] = ipBuf[3];
+
+	memcpy(&buf[6], &ip, 4);
+
+	this->_iface->socket.write((uint8_t *)buf, 10);
+	ptr += 10;
+
+	*pPtr = ptr;
+}
+
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_writeMyIPAnswerRecord(uint16_t *pPtr, uint8_t *buf, int bufSize,
+																	   uint32_t ttl, uint8_t cacheFlush)
+{
+	this->_writeAddressRecord(this->_bonjourName, this->_iface->localIP, pPtr, buf, bufSize, ttl, cacheFlush);
+}
+
+// writes the address records of host: ours (0), A and AAAA if we have IPv6 here, or the A
+// record of a proxy host (1 + its index)
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_writeHostRecords(uint8_t host, uint16_t *pPtr, uint8_t *buf,
+																  int bufSize, uint32_t ttl, uint8_t cacheFlush)
+{
+	if (0 == host)
+	{
+		this->_writeMyIPAnswerRecord(pPtr, buf, bufSize, ttl, cacheFlush);
+		if (this->_hasIPv6())
+			this->_writeMyIPv6AnswerRecord(pPtr, buf, bufSize, ttl, cacheFlush);
+	}
+	else
+		this->_writeAddressRecord(this->_proxyHosts[host - 1].name, this->_proxyHosts[host - 1].address,
+								  pPtr, buf, bufSize, ttl, cacheFlush);
+}
+
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_writeMyIPv6AnswerRecord(uint16_t *pPtr, uint8_t *buf, int bufSize,
+																		 uint32_t ttl, uint8_t cacheFlush)
+{
+	uint16_t ptr = *pPtr;
+
+	this->_writeDNSName(this->_bonjourName, &ptr, buf, bufSize, 1);
+
+	buf[0] = 0x00;
+	buf[1] = 0x1c; // AAAA record
+	buf[2] = cacheFlush ? 0x80 : 0x00; // cache flush
+	buf[3] = 0x01; // class IN
+
+	// ttl
+	*((uint32_t *)&buf[4]) = __htonl(ttl);
+
+	// data length
+	*((uint16_t *)&buf[8]) = __htons(16);
+
+	this->_iface->socket.write((uint8_t *)buf, 10);
+	ptr += 10;
+
+	this->_iface->socket.write(this->_iface->localIPv6.raw_address(), 16); // our IPv6 address
+	ptr += 16;
+
+	*pPtr = ptr;
+}
+
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_writeServiceRecordName(int recordIndex, uint16_t *pPtr, uint8_t *buf,
+																		int bufSize, int tld)
+{
+	uint16_t ptr = *pPtr;
+
+	uint8_t *name = tld ? this->_serviceRecords[recordIndex]->servName : this->_serviceRecords[recordIndex]->name;
+
+	this->_writeDNSName(name, &ptr, buf, bufSize, tld);
+
+	if (0 == tld)
+	{
+		const uint8_t *srv_type =
+			this->_postfixForProtocol(this->_serviceRecords[recordIndex]->proto);
+
+		if (NULL != srv_type)
+		{
+			srv_type++; // eat the dot at the beginning
+			this->_writeDNSName(srv_type, &ptr, buf, bufSize, 1);
+		}
+	}
+
+	*pPtr = ptr;
+}
+
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_writeServiceRecordSRV(int recordIndex, uint16_t *pPtr, uint8_t *buf,
+																	   int bufSize, uint32_t ttl, uint8_t cacheFlush)
+{
+	uint16_t ptr = *pPtr;
+
+	this->_writeServiceRecordName(recordIndex, &ptr, buf, bufSize, 0);
+
+	buf[0] = 0x00;
+	buf[1] = 0x21; // SRV record
+	buf[2] = cacheFlush ? 0x80 : 0x00; // cache flush
+	buf[3] = 0x01; // class IN
+
+	// ttl
+	*((uint32_t *)&buf[4]) = __htonl(ttl);
+
+	const uint8_t *target = this->_hostName(this->_serviceRecords[recordIndex]->host);
+
+	// data length
+	*((uint16_t *)&buf[8]) = __htons(8 + strlen((const char *)target));
+
+	this->_iface->socket.write((uint8_t *)buf, 10);
+	ptr += 10;
+	// priority and weight
+	buf[0] = buf[1] = buf[2] = buf[3] = 0;
+
+	// port
+	*((uint16_t *)&buf[4]) = __htons(this->_serviceRecords[recordIndex]->port);
+
+	this->_iface->socket.write((uint8_t *)buf, 6);
+	ptr += 6;
+	// target
+	this->_writeDNSName(target, &ptr, buf, bufSize, 1);
+
+	*pPtr = ptr;
+}
+
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_writeServiceRecordTXT(int recordIndex, uint16_t *pPtr, uint8_t *buf,
+																	   int bufSize, uint32_t ttl)
+{
+	uint16_t ptr = *pPtr;
+
+	this->_writeServiceRecordName(recordIndex, &ptr, buf, bufSize, 0);
+
+	buf[0] = 0x00;
+	buf[1] = 0x10; // TXT record
+	buf[2] = 0x80; // cache flush
+	buf[3] = 0x01; // class IN
+
+	// ttl
+	*((uint32_t *)&buf[4]) = __htonl(ttl);
+
+	this->_iface->socket.write((uint8_t *)buf, 8);
+	ptr += 8;
+
+	// data length && text
+	if (0 == this->_serviceRecords[recordIndex]->textLength)
+	{
+		buf[0] = 0x00;
+		buf[1] = 0x01;
+		buf[2] = 0x00;
+
+		this->_iface->socket.write((uint8_t *)buf, 3);
+		ptr += 3;
+	}
+	else
+	{
+		int slen = this->_serviceRecords[recordIndex]->textLength;
+		*((uint16_t *)buf) = __htons(slen);
+		this->_iface->socket.write((uint8_t *)buf, 2);
+		ptr += 2;
+
+		this->_iface->socket.write((uint8_t *)this->_serviceRecords[recordIndex]->textContent, slen);
+		ptr += slen;
+	}
+
+	*pPtr = ptr;
+}
+
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_writeServiceRecordPTR(int recordIndex, uint16_t *pPtr, uint8_t *buf,
+																	   int bufSize, uint32_t ttl)
+{
+	uint16_t ptr = *pPtr;
+
+	this->_writeServiceRecordName(recordIndex, &ptr, buf, bufSize, 1);
+
+	buf[0] = 0x00;
+	buf[1] = 0x0c; // PTR record
+	buf[2] = 0x00; // no cache flush
+	buf[3] = 0x01; // class IN
+
+	// ttl
+	*((uint32_t *)&buf[4]) = __htonl(ttl);
+
+	// data length (+13 = "._tcp.local" or "._udp.local" + 1  byte zero termination)
+	*((uint16_t *)&buf[8]) =
+		__htons(strlen((char *)this->_serviceRecords[recordIndex]->name) + 13);
+
+	this->_iface->socket.write((uint8_t *)buf, 10);
+	ptr += 10;
+
+	this->_writeServiceRecordName(recordIndex, &ptr, buf, bufSize, 0);
+
+	*pPtr = ptr;
+}
+
+// writes the DNS-SD service type enumeration PTR (_services._dns-sd._udp.local) that points
+// to the service type of one of our service records.
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_writeDNSSDServicePTR(int recordIndex, uint16_t *pPtr, uint8_t *buf,
+																	  int bufSize, uint32_t ttl)
+{
+	uint16_t ptr = *pPtr;
+
+	this->_writeDNSName((const uint8_t *)DNS_SD_SERVICE, &ptr, buf, bufSize, 1);
+
+	buf[0] = 0x00;
+	buf[1] = 0x0c; // PTR record
+	buf[2] = 0x00; // no cache flush
+	buf[3] = 0x01; // class IN
+
+	// ttl
+	*((uint32_t *)&buf[4]) = __htonl(ttl);
+
+	// data length.
+	uint16_t dlen = strlen((char *)this->_serviceRecords[recordIndex]->servName) + 2;
+	*((uint16_t *)&buf[8]) = __htons(dlen);
+
+	this->_iface->socket.write((uint8_t *)buf, 10);
+	ptr += 10;
+
+	this->_writeServiceRecordName(recordIndex, &ptr, buf, bufSize, 1);
+
+	*pPtr = ptr;
+}
+
+// writes the PTR from one of the subtype names of a service record to its instance name.
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_writeServiceSubtypePTR(int recordIndex, int subtype, uint16_t *pPtr,
+																		uint8_t *buf, int bufSize, uint32_t ttl)
+{
+	uint16_t ptr = *pPtr;
+
+	this->_writeDNSName(this->_serviceRecords[recordIndex]->subtypes[subtype], &ptr, buf, bufSize, 1);
+
+	buf[0] = 0x00;
+	buf[1] = 0x0c; // PTR record
+	buf[2] = 0x00; // no cache flush
+	buf[3] = 0x01; // class IN
+
+	// ttl
+	*((uint32_t *)&buf[4]) = __htonl(ttl);
+
+	// data length (+13 = "._tcp.local" or "._udp.local" + 1  byte zero termination)
+	*((uint16_t *)&buf[8]) =
+		__htons(strlen((char *)this->_serviceRecords[recordIndex]->name) + 13);
+
+	this->_iface->socket.write((uint8_t *)buf, 10);
+	ptr += 10;
+
+	this->_writeServiceRecordName(recordIndex, &ptr, buf, bufSize, 0);
+
+	*pPtr = ptr;
+}
+
+// writes an NSEC record for a host name (recordIndex MDNS_HOST_RECORD(host)) or one of our
+// service instances, listing the record types that exist for it. everything else doesn't.
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_writeNSECRecord(int recordIndex, uint16_t *pPtr, uint8_t *buf,
+																 int bufSize, uint32_t ttl)
+{
+	uint16_t ptr = *pPtr;
+	uint16_t nameLen;
+	uint8_t bitmapLen;
+	const uint8_t *hostName = NULL;
+	uint8_t hasIPv6 = 0; // only we have AAAA records, proxy hosts don't
+
+	if (recordIndex < 0)
+	{
+		hostName = this->_hostName(-1 - recordIndex);
+		hasIPv6 = (-1 == recordIndex) && this->_hasIPv6();
+
+		this->_writeDNSName(hostName, &ptr, buf, bufSize, 1);
+		nameLen = strlen((const char *)hostName) + 2;
+		bitmapLen = hasIPv6 ? 4 : 1; // A (1), AAAA (28)
+	}
+	else
+	{
+		this->_writeServiceRecordName(recordIndex, &ptr, buf, bufSize, 0);
+		nameLen = strlen((char *)this->_serviceRecords[recordIndex]->name) + 13;
+		bitmapLen = 5; // TXT (16), SRV (33)
+	}
+
+	buf[0] = 0x00;
+	buf[1] = 0x2f; // NSEC record
+	buf[2] = 0x80; // cache flush
+	buf[3] = 0x01; // class IN
+
+	// ttl
+	*((uint32_t *)&buf[4]) = __htonl(ttl);
+
+	// data length: next domain name, window number, bitmap length and bitmap
+	*((uint16_t *)&buf[8]) = __htons(nameLen + 2 + bitmapLen);
+
+	this->_iface->socket.write((uint8_t *)buf, 10);
+	ptr += 10;
+
+	// the next domain name is the name itself again (RFC 6762, section 6.1)
+	if (recordIndex < 0)
+		this->_writeDNSName(hostName, &ptr, buf, bufSize, 1);
+	else
+		this->_writeServiceRecordName(recordIndex, &ptr, buf, bufSize, 0);
+
+	memset(buf, 0, 2 + bitmapLen);
+	buf[1] = bitmapLen; // window block 0
+	if (recordIndex < 0)
+	{
+		buf[2] = 0x40; // A
+		if (hasIPv6)
+			buf[5] = 0x08; // AAAA
+	}
+	else
+	{
+		buf[4] = 0x80; // TXT
+		buf[6] = 0x40; // SRV
+	}
+
+	this->_iface->socket.write((uint8_t *)buf, 2 + bitmapLen);
+	ptr += 2 + bitmapLen;
+
+	*pPtr = ptr;
+}
+
+template <class UdpClass, class Features>
+uint8_t *EthernetBonjour3Class<UdpClass, Features>::_findFirstDotFromRight(const uint8_t *str)
+{
+	const uint8_t *p = str + strlen((char *)str);
+	while (p > str && '.' != *p--)
+		;
+	return (uint8_t *)&p[2];
+}
+
+template <class UdpClass, class Features>
+const uint8_t *EthernetBonjour3Class<UdpClass, Features>::_postfixForProtocol(MDNSServiceProtocol_t proto)
+{
+	const uint8_t *srv_type = NULL;
+	switch (proto)
+	{
+	case MDNSServiceTCP:
+		srv_type = (uint8_t *)"._tcp" MDNS_TLD;
+		break;
+	case MDNSServiceUDP:
+		srv_type = (uint8_t *)"._udp" MDNS_TLD;
+		break;
+	}
 
-					tLen += 1;
-				}
-				else if (rLen > 0)
-				{
-					int tr = rLen, ir;
+	return srv_type;
+}
 
-					while (tr > 0)
-					{
-						ir = (tr > sizeof(DNSHeader_t)) ? sizeof(DNSHeader_t) : tr;
-
-						memcpy((uint8_t *)buf, (uint16_t *)(ptr + offset), ir);
-						offset += ir;
-						tr -= ir;
-
-						for (j = 0; j < NumMDNSServiceRecords + 2; j++)
-						{
-/*	Serial.print("recordsAskedFor[j]:");
-	Serial.print(recordsAskedFor[j]);
-
-	Serial.print("  servMatches[");
-	Serial.print(j);
-	Serial.print("]:");
-	Serial.println(servMatches[j]);
-*/
-							if (!recordsAskedFor[j] && servMatches[j])
-							{
-/*
-Serial.println("jajajajajajajaja ^^^ ^^^^ ^^^^^ ^^^^ ^^^^ ^^^^ ^^^^ ^^^^ ^^^^ ^^^^^^^^^^^");
-Serial.print(" servNames[");
-Serial.print(j);
-Serial.print("]: ");
-for (int r = 0; r < servLens[j]; r++)
-	Serial.print((char)servNames[j][r]);
-Serial.println("");
-Serial.print("buf: ");
-for (int r = 0; r < ir; r++)
-	Serial.print((char)buf[r]);
-Serial.println("");
-*/
-								auto match = this->_matchStringPart(&servNames[j], &servLens[j], buf, ir);
-if (match)
-		Serial.println("match match match -------------------------------");
-
-								servMatches[j] &= match;
-if (match) {
-	Serial.print("servMatches[");
-	Serial.print(j);
-	Serial.print("]: ");
-	Serial.println(servMatches[j]);
-}
-
-							}
-						}
-					}
+// ends the name lookup in slot idx, and reports ipAddr, or NULL if it timed out. the slot is
+// free before the callback runs, so that it can start the next lookup right away.
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_finishedResolvingName(int idx, const byte ipAddr[4])
+{
+	MDNSQuery_t *query = &this->_queries[idx];
+	MDNSNameResolvedCallback callback = query->nameCallback;
+	MDNSHandle_t handle = query->handle;
+	void *context = query->context;
+	uint8_t *name = query->name;
 
-					tLen += rLen;
-				}
-			} while (rLen > 0 && rLen <= 128);
+	// the callback gets the name without ".local"
+	this->_setOwner(name, &name);
+	memset(query, 0, sizeof(MDNSQuery_t));
 
-Serial.println("*  *  *  *  *  *  *  *  * *  *  *  *  *  *  *");
-for (j = 0; j < NumMDNSServiceRecords + 2; j++)
-{
-	Serial.print("recordsAskedFor[j]:");
-	Serial.print(recordsAskedFor[j]);
-				Serial.print("  servMatches[");
-				Serial.print(j);
-				Serial.print("]:");
-	Serial.println(servMatches[j]);
+	uint8_t *n = this->_findFirstDotFromRight(name);
+	*(n - 1) = '\0';
+
+	callback(context, handle, (const char *)name, ipAddr);
+
+	this->_free(name);
 }
 
-			// if this matched a name of ours (and there are no characters left), then
-			// check whether this is an A record query (for our own name) or a PTR record query
-			// (for one of our services).
-			// if so, we'll note to send a record
+// copies the service type of the browse, like "_ipp", to typeName, which has room for a label
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_queryTypeName(const MDNSQuery_t *query, char *typeName)
+{
+	const uint8_t *p = query->name + query->subtypeLength;
+	int i;
 
-			memcpy((uint8_t *)buf, (uint16_t *)(ptr + offset), 4);
-			offset += 4;
+	for (i = 0; i < MDNS_MAX_LABEL_LEN && 0 != p[i] && '.' != p[i]; i++)
+		typeName[i] = p[i];
+	typeName[i] = '\0';
+}
 
-			for (j = 0; j < NumMDNSServiceRecords + 2; j++)
-			{
-				if (!recordsAskedFor[j] && servNames[j] && servMatches[j] && 0 == servLens[j])
-				{
-Serial.println("#################################################################################");
+// takes ownership of name, target and txt on success. if the browse already waits for the
+// instance, its entry is refreshed instead, so the instance is reported only once.
+// return values:
+// 1 if the service was added, and the address of its target has to be asked for
+// 2 if it was added or refreshed, and somebody asked for that address already
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_addPendingService(uint8_t *name, uint8_t *target, uint8_t *txt,
+																  uint16_t port, MDNSHandle_t query)
+{
+	MDNSPendingService_t *pending;
+	int i, slot = -1, asked = 0;
+	uint8_t tries = 0;
 
-					if (0 == servNamePos[j])
-						servNamePos[j] = offset - 4 - tLen;
+	for (i = 0; i < _numPendingServices; i++)
+	{
+		pending = &this->_pendingServices[i];
 
-					if (buf[0] == 0 &&
-						buf[3] == 0x01 &&
-						(buf[2] == 0x00 ||
-						 buf[2] == 0x80))
-					{
+		if (NULL == pending->target)
+		{
+			if (slot < 0)
+				slot = i;
+		}
+		else if (query == pending->query && mdnsNameEquals(pending->name, name))
+		{
+			// the same instance again, maybe with a new port or TXT. the retries go on.
+			asked = mdnsNameEquals(pending->target, target);
+			tries = pending->tries;
+			this->_removePendingService(i);
 
-						if ((0 == j && 0x01 == buf[1]) || (0 < j && (0x0c == buf[1] || 0x10 == buf[1] || 0x21 == buf[1])))
-							recordsAskedFor[j] = 1;
-						else if (0 == j && 0x1c == buf[1])
-							wantsIPv6Addr = 1;
-					}
-				}
-			}
+			slot = i;
+			break;
 		}
 	}
-	else if (1 == dnsHeader->queryResponse &&
-			 DNSOpQuery == dnsHeader->opCode &&
-			 MDNS_SERVER_PORT == _socket.remotePort() &&
-			 (NULL != this->_resolveNames[0] || NULL != this->_resolveNames[1]))
-	{
-		Serial.print("Message is a response");
-
-		int offset = sizeof(DNSHeader_t);
-		uint8_t *buf = (uint8_t *)dnsHeader;
-		int rLen = 0, tLen = 0;
-
-		uint8_t *ptrNames[MDNS_MAX_SERVICES_PER_PACKET];
-		uint16_t ptrOffsets[MDNS_MAX_SERVICES_PER_PACKET];
-		uint16_t ptrPorts[MDNS_MAX_SERVICES_PER_PACKET];
-		uint8_t ptrIPs[MDNS_MAX_SERVICES_PER_PACKET];
-		uint8_t servIPs[MDNS_MAX_SERVICES_PER_PACKET][5];
-		uint8_t *servTxt[MDNS_MAX_SERVICES_PER_PACKET];
-		memset(servIPs, 0, sizeof(uint8_t) * MDNS_MAX_SERVICES_PER_PACKET * 5);
-		memset(servTxt, 0, sizeof(uint8_t *) * MDNS_MAX_SERVICES_PER_PACKET);
-
-		const uint8_t *ptrNamesCmp[MDNS_MAX_SERVICES_PER_PACKET];
-		int ptrLensCmp[MDNS_MAX_SERVICES_PER_PACKET];
-		uint8_t ptrNamesMatches[MDNS_MAX_SERVICES_PER_PACKET];
-
-		uint8_t checkAARecords = 0;
-		memset(ptrNames, 0, sizeof(uint8_t *) * MDNS_MAX_SERVICES_PER_PACKET);
-
-		const uint8_t *servNames[2];
-		uint8_t servNamePos[2];
-		int servLens[2];
-		uint8_t servMatches[2];
-		uint8_t firstNamePtrByte = 0;
-		uint8_t partMatched[2];
-		uint8_t lastWasCompressed[2];
-		uint8_t servWasCompressed[2];
-
-		servNamePos[0] = servNamePos[1] = 0;
-
-		for (i = 0; i < qCnt + aCnt + aaCnt + addCnt; i++)
-		{
 
-			for (j = 0; j < 2; j++)
-			{
-				if (NULL != this->_resolveNames[j])
-				{
-					servNames[j] = this->_resolveNames[j];
-					servLens[j] = strlen((const char *)this->_resolveNames[j]);
-					servMatches[j] = 1;
-				}
-				else
-				{
-					servNames[j] = NULL;
-					servLens[j] = servMatches[j] = 0;
-				}
-			}
+	if (slot < 0)
+		return 0;
 
-			for (j = 0; j < MDNS_MAX_SERVICES_PER_PACKET; j++)
-			{
-				if (NULL != ptrNames[j])
-				{
-					ptrNamesCmp[j] = ptrNames[j];
-					ptrLensCmp[j] = strlen((const char *)ptrNames[j]);
-					ptrNamesMatches[j] = 1;
-				}
-			}
+	if (!asked)
+		asked = (this->_findPendingTarget(target) >= 0);
+
+	pending = &this->_pendingServices[slot];
+	pending->name = name;
+	pending->target = target;
+	pending->txt = txt;
+	this->_setOwner(name, &pending->name);
+	this->_setOwner(target, &pending->target);
+	this->_setOwner(txt, &pending->txt);
+	pending->port = port;
+	pending->tries = tries;
+	pending->query = query;
+
+	return asked ? 2 : 1;
+}
 
-			partMatched[0] = partMatched[1] = 0;
-			lastWasCompressed[0] = lastWasCompressed[1] = 0;
-			servWasCompressed[0] = servWasCompressed[1] = 0;
-			firstNamePtrByte = 0;
-			tLen = 0;
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_removePendingService(int idx)
+{
+	MDNSPendingService_t *pending = &this->_pendingServices[idx];
 
-			do
-			{
-				memcpy((uint8_t *)buf, (uint16_t *)(ptr + offset), 1);
-				offset += 1;
-				rLen = buf[0];
-				tLen += 1;
+	this->_free(pending->name);
+	this->_free(pending->target);
+	this->_free(pending->txt);
 
-				if (rLen > 128)
-				{ // handle DNS name compression, kinda, sorta...
+	memset(pending, 0, sizeof(MDNSPendingService_t));
+}
 
-					memcpy((uint8_t *)buf, (uint16_t *)(ptr + offset), 1);
-					offset += 1;
+// drops the services the browse with this handle still waits for
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_cancelPendingServices(MDNSHandle_t query)
+{
+	int i;
+	for (i = 0; i < _numPendingServices; i++)
+		if (NULL != this->_pendingServices[i].target && query == this->_pendingServices[i].query)
+			this->_removePendingService(i);
+}
 
-					for (j = 0; j < 2; j++)
-					{
-						if (servNamePos[j] && servNamePos[j] != buf[0])
-							servMatches[j] = 0;
-						else
-							servWasCompressed[j] = 1;
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_hasPendingServices()
+{
+	int i;
+	for (i = 0; i < _numPendingServices; i++)
+		if (NULL != this->_pendingServices[i].target)
+			return 1;
 
-						lastWasCompressed[j] = 1;
-					}
+	return 0;
+}
 
-					tLen += 1;
+// return values:
+// the first pending service that waits for the address of target
+// -1 if there is none
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_findPendingTarget(const uint8_t *target)
+{
+	int i;
+	for (i = 0; i < _numPendingServices; i++)
+		if (NULL != this->_pendingServices[i].target && mdnsNameEquals(this->_pendingServices[i].target, target))
+			return i;
 
-					if (0 == firstNamePtrByte)
-						firstNamePtrByte = buf[0];
-				}
-				else if (rLen > 0)
-				{
-					if (i < qCnt)
-						offset += rLen;
-					else
-					{
-						int tr = rLen, ir;
-
-						if (0 == firstNamePtrByte)
-							firstNamePtrByte = offset - 1; // -1, since we already read length (1 byte)
-
-						while (tr > 0)
-						{
-							ir = (tr > sizeof(DNSHeader_t)) ? sizeof(DNSHeader_t) : tr;
-							memcpy((uint8_t *)buf, (uint16_t *)(ptr + offset), ir);
-							offset += ir;
-							tr -= ir;
-
-							for (j = 0; j < 2; j++)
-							{
-								if (!recordsFound[j] && servMatches[j] && servNames[j])
-									servMatches[j] &= this->_matchStringPart(&servNames[j], &servLens[j],
-																			 buf, ir);
-								if (!partMatched[j])
-									partMatched[j] = servMatches[j];
-
-								lastWasCompressed[j] = 0;
-							}
-
-							for (j = 0; j < MDNS_MAX_SERVICES_PER_PACKET; j++)
-							{
-								if (NULL != ptrNames[j] && ptrNamesMatches[j])
-								{
-									// only compare the part we have. this is incorrect, but good enough,
-									// since actual MDNS implementations won't go here anyways, as they
-									// should use name compression. This is just so that multiple Arduinos
-									// running this MDNSResponder code should be able to find each other's
-									// services.
-									if (ptrLensCmp[j] >= ir)
-										ptrNamesMatches[j] &= this->_matchStringPart(&ptrNamesCmp[j],
-																					 &ptrLensCmp[j], buf, ir);
-								}
-							}
-						}
-
-						tLen += rLen;
-					}
-				}
-			} while (rLen > 0 && rLen <= 128);
-
-			// if this matched a name of ours (and there are no characters left), then
-			// check wether this is an A record query (for our own name) or a PTR record query
-			// (for one of our services).
-			// if so, we'll note to send a record
-			if (i < qCnt)
-				offset += 4;
-			else if (i >= qCnt)
-			{
-				if (i >= qCnt + aCnt && !checkAARecords)
-					break;
+	return -1;
+}
 
-				uint8_t packetHandled = 0;
+// looks for A records answering one of our pending SRV targets and completes the
+// service discovery event for every instance whose address has arrived.
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_processPendingServices(const uint8_t *pkt, uint16_t pktLen,
+																		uint16_t qCnt, uint16_t recordCnt)
+{
+	DNSRecord_t record;
+	uint16_t i, offset = sizeof(DNSHeader_t);
+	int j;
 
-				memcpy((uint8_t *)buf, (uint16_t *)(ptr + offset), 4);
-				offset += 4;
-				if (i < qCnt + aCnt)
-				{
-					for (j = 0; j < 2; j++)
-					{
-						if (0 == servNamePos[j])
-							servNamePos[j] = offset - 4 - tLen;
-
-						if (servNames[j] &&
-							((servMatches[j] && 0 == servLens[j]) ||
-							 (partMatched[j] && lastWasCompressed[j]) ||
-							 (servWasCompressed[j] && servMatches[j])))
-						{ // somewhat handle compression by guessing
-
-							if (buf[0] == 0 && buf[1] == ((0 == j) ? 0x01 : 0x0c) &&
-								(buf[2] == 0x00 || buf[2] == 0x80) && buf[3] == 0x01)
-							{
-								recordsFound[j] = 1;
-
-								// this is an A or PTR type response. Parse it as such.
-
-								memcpy((uint8_t *)buf, (uint16_t *)(ptr + offset), 6);
-								offset += 6;
-								//uint32_t ttl = ethutil_ntohl(*(uint32_t*)buf);
-								uint16_t dataLen = __ntohs(*(uint16_t *)&buf[4]);
-
-								if (0 == j && 4 == dataLen)
-								{
-									// ok, this is the IP address. report it via callback.
-
-									memcpy((uint8_t *)buf, (uint16_t *)(ptr + offset), 4);
-
-									this->_finishedResolvingName((char *)this->_resolveNames[0],
-																 (const byte *)buf);
-								}
-								else if (1 == j)
-								{
-									uint8_t k;
-									for (k = 0; k < MDNS_MAX_SERVICES_PER_PACKET; k++)
-										if (NULL == ptrNames[k])
-											break;
-
-									if (k < MDNS_MAX_SERVICES_PER_PACKET)
-									{
-										int l = dataLen - 2; // -2: data compression of service postfix
-
-										uint8_t *ptrName = (uint8_t *)malloc(l);
-
-										if (ptrName)
-										{
-
-											memcpy((uint8_t *)buf, (uint16_t *)(ptr + offset), 1);
-											memcpy((uint8_t *)ptrName, (uint16_t *)(ptr + offset + 1), l - 1);
-
-											if (buf[0] < l - 1)
-												ptrName[buf[0]]; // this catches uncompressed names
-											else
-												ptrName[l - 1] = '\0';
-
-											ptrNames[k] = ptrName;
-											ptrOffsets[k] = (uint16_t)(offset);
-
-											checkAARecords = 1;
-										}
-									}
-								}
-								offset += dataLen;
-								packetHandled = 1;
-							}
-						}
-					}
-				}
-				else if (i >= qCnt + aCnt + aaCnt)
+	if (!this->_hasPendingServices())
+		return;
+
+	if (!this->_skipDNSQuestions(pkt, pktLen, &offset, qCnt))
+		return;
+
+	for (i = 0; i < recordCnt; i++)
+	{
+		if (!this->_nextDNSRecord(pkt, pktLen, &offset, &record))
+			return;
+
+		if (0x01 == record.type && 4 == record.dataLength)
+		{
+			for (j = 0; j < _numPendingServices; j++)
+			{
+				MDNSPendingService_t *pending = &this->_pendingServices[j];
+
+				if (NULL != pending->target &&
+					this->_matchDNSName(pkt, pktLen, record.nameOffset, pending->target))
 				{
-					//  check whether we find a service description
-					if (buf[1] == 0x21)
+					int q = this->_findQuery(pending->query);
+
+					if (q >= 0)
 					{
-						for (j = 0; j < MDNS_MAX_SERVICES_PER_PACKET; j++)
-						{
-							if (ptrNames[j] &&
-								((firstNamePtrByte && firstNamePtrByte == ptrOffsets[j]) ||
-								 (0 == ptrLensCmp[j] && ptrNamesMatches[j])))
-							{
-								// we have found the matching SRV location packet to a previous SRV domain
-
-								memcpy((uint8_t *)buf, (uint16_t *)(ptr + offset), 6);
-								offset += 6;
-
-								//uint32_t ttl = ethutil_ntohl(*(uint32_t*)buf);
-								uint16_t dataLen = __ntohs(*(uint16_t *)&buf[4]);
-
-								if (dataLen >= 8)
-								{
-
-									memcpy((uint8_t *)buf, (uint16_t *)(ptr + offset), 8);
-									ptrPorts[j] = __ntohs(*(uint16_t *)&buf[4]);
-
-									if (buf[6] > 128)
-									{ // target is a compressed name
-										ptrIPs[j] = buf[7];
-									}
-									else
-									{ // target is uncompressed
-										ptrIPs[j] = offset + 6;
-									}
-								}
-								offset += dataLen;
-								packetHandled = 1;
-
-								break;
-							}
-						}
-					}
-					else if (buf[1] == 0x10)
-					{ // txt record
-						for (j = 0; j < MDNS_MAX_SERVICES_PER_PACKET; j++)
-						{
-							if (ptrNames[j] &&
-								((firstNamePtrByte && firstNamePtrByte == ptrOffsets[j]) ||
-								 (0 == ptrLensCmp[j] && ptrNamesMatches[j])))
-							{
-
-								memcpy((uint8_t *)buf, (uint16_t *)(ptr + offset), 6);
-								offset += 6;
-
-								//uint32_t ttl = ethutil_ntohl(*(uint32_t*)buf);
-								uint16_t dataLen = __ntohs(*(uint16_t *)&buf[4]);
-
-								// if there's a content to this txt record, save it for delivery
-								if (dataLen > 1 && NULL == servTxt[j])
-								{
-									servTxt[j] = (uint8_t *)malloc(dataLen + 1);
-									if (NULL != servTxt[j])
-									{
-
-										memcpy((uint8_t *)servTxt[j], (uint16_t *)(ptr + offset), dataLen);
-
-										// zero-terminate
-										servTxt[j][dataLen] = '\0';
-									}
-								}
-								offset += dataLen;
-								packetHandled = 1;
-
-								break;
-							}
-						}
-					}
-					else if (buf[1] == 0x01)
-					{ // A record (IPv4 address)
-						for (j = 0; j < MDNS_MAX_SERVICES_PER_PACKET; j++)
-						{
-							if (0 == servIPs[j][0])
-							{
-								servIPs[j][0] = firstNamePtrByte ? firstNamePtrByte : 255;
-
-								memcpy((uint8_t *)buf, (uint16_t *)(ptr + offset), 6);
-								offset += 6;
-
-								uint16_t dataLen = __ntohs(*(uint16_t *)&buf[4]);
-								if (4 == dataLen)
-								{
-									memcpy((uint8_t *)&servIPs[j][1], (uint16_t *)(ptr + offset), 4);
-								}
-								offset += dataLen;
-								packetHandled = 1;
-
-								break;
-							}
-						}
+						MDNSQuery_t *query = &this->_queries[q];
+						char typeName[MDNS_MAX_LABEL_LEN + 1];
+
+						this->_queryTypeName(query, typeName);
+
+						query->serviceCallback(query->context,
+											   query->handle,
+											   typeName,
+											   query->proto,
+											   (const char *)pending->name,
+											   (const byte *)&pkt[record.dataOffset],
+											   (unsigned short)pending->port,
+											   (const char *)pending->txt);
 					}
-				}
 
-				// eat the answer
-				if (!packetHandled)
-				{
-					offset += 4; // ttl
-					memcpy((uint8_t *)buf, (uint16_t *)(ptr + offset), 2);
-					offset += 2 + __ntohs(*(uint16_t *)buf); // skip over content
+					// unless the callback dropped it already, along with its browse
+					if (NULL != pending->target)
+						this->_removePendingService(j);
 				}
 			}
 		}
+	}
+}
 
-		// deliver the services discovered in this packet
-		if (NULL != this->_resolveNames[1])
-		{
-			char *typeName = (char *)this->_resolveNames[1];
-			char *p = (char *)this->_resolveNames[1];
-			while (*p && *p != '.')
-				p++;
-			*p = '\0';
-
-			for (i = 0; i < MDNS_MAX_SERVICES_PER_PACKET; i++)
-				if (ptrNames[i])
-				{
-					const uint8_t *ipAddr = NULL;
-					const uint8_t *fallbackIpAddr = NULL;
+// reads the question at *pOffset into *pRecord and moves *pOffset past it.
+// return values:
+// 1 on success
+// 0 if the question is malformed or runs past the end of the packet
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_nextDNSQuestion(const uint8_t *pkt, uint16_t pktLen,
+																uint16_t *pOffset, DNSRecord_t *pRecord)
+{
+	uint16_t offset = this->_skipDNSName(pkt, pktLen, *pOffset);
 
-					for (j = 0; j < MDNS_MAX_SERVICES_PER_PACKET; j++)
-					{
-						if (servIPs[j][0] == ptrIPs[i] || servIPs[j][0] == 255)
-						{
-							// the || part is such a hack, but it will work as long as there's only
-							// one A record per MDNS packet. fucking DNS name compression.
-							ipAddr = &servIPs[j][1];
-
-							break;
-						}
-						else if (NULL == fallbackIpAddr && 0 != servIPs[j][0])
-							fallbackIpAddr = &servIPs[j][1];
-					}
+	if (0 == offset || (uint32_t)offset + 4 > pktLen)
+		return 0;
 
-					// if we can't find a matching IP, we try to use the first one we found.
-					if (NULL == ipAddr)
-						ipAddr = fallbackIpAddr;
+	pRecord->nameOffset = *pOffset;
+	pRecord->type = __loadBE16(&pkt[offset]);
+	pRecord->cls = __loadBE16(&pkt[offset + 2]);
+	pRecord->dataOffset = 0;
+	pRecord->dataLength = 0;
 
-					if (ipAddr && this->_serviceFoundCallback)
-					{
-						this->_serviceFoundCallback(typeName,
-													this->_resolveServiceProto,
-													(const char *)ptrNames[i],
-													(const byte *)ipAddr,
-													(unsigned short)ptrPorts[i],
-													(const char *)servTxt[i]);
-					}
-				}
-			*p = '.';
-		}
+	*pOffset = offset + 4;
+	return 1;
+}
 
-		uint8_t k;
-		for (k = 0; k < MDNS_MAX_SERVICES_PER_PACKET; k++)
-			if (NULL != ptrNames[k])
-			{
-				free(ptrNames[k]);
-				if (NULL != servTxt[k])
-					free(servTxt[k]);
-			}
+// reads the resource record at *pOffset into *pRecord and moves *pOffset past it.
+// return values:
+// 1 on success
+// 0 if the record is malformed or runs past the end of the packet
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_nextDNSRecord(const uint8_t *pkt, uint16_t pktLen,
+															  uint16_t *pOffset, DNSRecord_t *pRecord)
+{
+	uint16_t offset = this->_skipDNSName(pkt, pktLen, *pOffset);
+
+	if (0 == offset || (uint32_t)offset + 10 > pktLen)
+		return 0;
+
+	pRecord->nameOffset = *pOffset;
+	pRecord->type = __loadBE16(&pkt[offset]);
+	pRecord->cls = __loadBE16(&pkt[offset + 2]);
+	pRecord->dataOffset = offset + 10;
+	pRecord->dataLength = __loadBE16(&pkt[offset + 8]);
+
+	if ((uint32_t)pRecord->dataOffset + pRecord->dataLength > pktLen)
+		return 0;
+
+	*pOffset = pRecord->dataOffset + pRecord->dataLength;
+	return 1;
+}
+
+// moves *pOffset past the question section of a packet with qCnt questions.
+// return values:
+// 1 on success
+// 0 if a question is malformed
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_skipDNSQuestions(const uint8_t *pkt, uint16_t pktLen,
+																 uint16_t *pOffset, uint16_t qCnt)
+{
+	DNSRecord_t question;
+	uint16_t i;
+
+	for (i = 0; i < qCnt; i++)
+		if (!this->_nextDNSQuestion(pkt, pktLen, pOffset, &question))
+			return 0;
+
+	return 1;
+}
+
+// return value:
+// the offset of the first byte after the name at offset
+// 0 if the name is malformed
+template <class UdpClass, class Features>
+uint16_t EthernetBonjour3Class<UdpClass, Features>::_skipDNSName(const uint8_t *pkt, uint16_t pktLen, uint16_t offset)
+{
+	uint32_t o = offset;
+
+	while (o < pktLen)
+	{
+		uint8_t len = pkt[o];
+
+		if (0xc0 == (len & 0xc0)) // compression pointer ends the name
+			return (o + 2 <= pktLen) ? (uint16_t)(o + 2) : 0;
+		else if (len & 0xc0) // reserved label types
+			return 0;
+
+		o += 1 + len;
+		if (0 == len)
+			return (uint16_t)o;
 	}
-	free(udpBuffer);
 
-errorReturn:
-	// now, handle the requests
-	for (j = 0; j < NumMDNSServiceRecords + 2; j++)
+	return 0;
+}
+
+// decodes the (possibly compressed) name at offset into a dotted, zero-terminated string
+// without trailing dot. if name is NULL, only the length is calculated.
+// return values:
+// the length of the decoded name (without zero termination)
+// -1 if the name is malformed or doesn't fit into nameSize bytes
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_readDNSName(const uint8_t *pkt, uint16_t pktLen, uint16_t offset,
+															uint8_t *name, int nameSize)
+{
+	uint32_t o = offset;
+	int length = 0, hops = 0;
+
+	while (o < pktLen)
 	{
-		if (recordsAskedFor[j])
+		uint8_t len = pkt[o];
+
+		if (0xc0 == (len & 0xc0))
 		{
-			if (0 == j)
-				(void)this->_sendMDNSMessage(_socket.remoteIP(), xid, (int)MDNSPacketTypeMyIPAnswer, 0);
-			else if (1 == j)
+			if (o + 1 >= pktLen || ++hops > MDNS_MAX_NAME_HOPS)
+				return -1;
+
+			o = ((uint16_t)(len & 0x3f) << 8) | pkt[o + 1];
+			continue;
+		}
+		else if (len & 0xc0)
+			return -1;
+
+		o++;
+
+		if (0 == len)
+		{
+			if (NULL != name)
 			{
-				uint8_t k = 2;
-				for (k = 0; k < NumMDNSServiceRecords; k++)
-					recordsAskedFor[k + 2] = 1;
+				if (length >= nameSize)
+					return -1;
+				name[length] = '\0';
 			}
-			else if (NULL != this->_serviceRecords[j - 2])
-				(void)this->_sendMDNSMessage(_socket.remoteIP(), xid, (int)MDNSPacketTypeServiceRecord, j - 2);
+
+			return length;
 		}
-	}
 
-	// if we were asked for our IPv6 address, say that we don't have any
-	if (wantsIPv6Addr)
-		(void)this->_sendMDNSMessage(_socket.remoteIP(), xid, (int)MDNSPacketTypeNoIPv6AddrAvailable, 0);
+		if (o + len > pktLen)
+			return -1;
 
-	return statusCode;
+		if (length > 0)
+		{
+			if (NULL != name && length + 1 >= nameSize)
+				return -1;
+			if (NULL != name)
+				name[length] = '.';
+			length++;
+		}
+
+		if (NULL != name)
+		{
+			if (length + len >= nameSize)
+				return -1;
+			memcpy(&name[length], &pkt[o], len);
+		}
+
+		length += len;
+		o += len;
+	}
+
+	return -1;
 }
 
-template <class UdpClass>
-void EthernetBonjour3Class<UdpClass>::run()
+// if suffix is given, it is appended to name before comparing (it has to start with a dot).
+// return values:
+// 1 if the (possibly compressed) name at offset equals the dotted name (ignoring case)
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_matchDNSName(const uint8_t *pkt, uint16_t pktLen, uint16_t offset,
+															 const uint8_t *name, const uint8_t *suffix)
 {
-	uint8_t i;
-	unsigned long now = millis();
+	const uint8_t *n = name;
+	uint32_t o = offset;
+	int hops = 0;
+
+	while (o < pktLen)
+	{
+		uint8_t len = pkt[o];
+
+		if (0xc0 == (len & 0xc0))
+		{
+			if (o + 1 >= pktLen || ++hops > MDNS_MAX_NAME_HOPS)
+				return 0;
+
+			o = ((uint16_t)(len & 0x3f) << 8) | pkt[o + 1];
+			continue;
+		}
+		else if (len & 0xc0)
+			return 0;
+
+		o++;
+
+		if (0 == *n && NULL != suffix)
+		{
+			n = suffix;
+			suffix = NULL;
+		}
+
+		if (0 == len)
+			return (0 == *n);
+
+		if (o + len > pktLen)
+			return 0;
+
+		if (n != name)
+		{
+			if ('.' != *n)
+				return 0;
+			n++;
+		}
+
+		if (!mdnsLabelEquals(n, &pkt[o], len))
+			return 0;
+
+		n += len;
+		o += len;
+	}
 
-	// first, look for MDNS queries to handle
-	(void)_processMDNSQuery();
+	return 0;
+}
+
+// compares the uncompressed wire form of the name at offset to the one of the dotted name,
+// byte by byte, as needed for simultaneous probe tiebreaking.
+// return value:
+// < 0, 0 or > 0 if the name at offset sorts before, equal to or after name
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_compareDNSName(const uint8_t *pkt, uint16_t pktLen, uint16_t offset,
+															   const uint8_t *name)
+{
+	const uint8_t *n = name;
+	uint32_t o = offset;
+	int hops = 0;
 
-	// are we querying a name or service? if so, should we resend the packet or time out?
-	for (i = 0; i < 2; i++)
+	while (o < pktLen)
 	{
-		if (NULL != this->_resolveNames[i])
+		uint8_t len = pkt[o];
+
+		if (0xc0 == (len & 0xc0))
 		{
-			// Hint: _resolveLastSendMillis is updated in _sendMDNSMessage
-			if (now - this->_resolveLastSendMillis[i] > ((i == 0) ? (uint32_t)MDNS_NQUERY_RESEND_TIME : (uint32_t)MDNS_SQUERY_RESEND_TIME))
-				(void)this->_sendMDNSMessage(0,
-											 0,
-											 (0 == i) ? MDNSPacketTypeNameQuery : MDNSPacketTypeServiceQuery,
-											 0);
-
-			if (this->_resolveTimeouts[i] > 0 && now > this->_resolveTimeouts[i])
-			{
-				if (i == 0)
-					this->_finishedResolvingName((char *)this->_resolveNames[0], NULL);
-				else if (i == 1)
-				{
-					if (this->_serviceFoundCallback)
-					{
-						char *typeName = (char *)this->_resolveNames[1];
-						char *p = (char *)this->_resolveNames[1];
-						while (*p && *p != '.')
-							p++;
-						*p = '\0';
-
-						this->_serviceFoundCallback(typeName,
-													this->_resolveServiceProto,
-													NULL,
-													NULL,
-													0,
-													NULL);
-					}
-				}
+			if (o + 1 >= pktLen || ++hops > MDNS_MAX_NAME_HOPS)
+				return 0;
 
-				if (NULL != this->_resolveNames[i])
-				{
-					free(this->_resolveNames[i]);
-					this->_resolveNames[i] = NULL;
-				}
-			}
+			o = ((uint16_t)(len & 0x3f) << 8) | pkt[o + 1];
+			continue;
 		}
+		else if (len & 0xc0)
+			return 0;
+
+		o++;
+
+		// the next label of our name, its length byte is compared first
+		const uint8_t *e = n;
+		while (*e && '.' != *e)
+			e++;
+
+		if (len != (uint8_t)(e - n))
+			return (int)len - (int)(e - n);
+
+		if (0 == len)
+			return 0;
+
+		if (o + len > pktLen)
+			return 0;
+
+		int cmp = memcmp(&pkt[o], n, len);
+		if (0 != cmp)
+			return cmp;
+
+		o += len;
+		n = *e ? e + 1 : e;
 	}
 
-	// now, should we re-announce our services again?
-	unsigned long announceTimeOut = MDNS_RESPONSE_TTL / 4;
-	if ((now - this->_lastAnnounceMillis) > 1000 * announceTimeOut)
+	return 0;
+}
+
+// moves *pOffset to the next label of the name there, following compression pointers.
+// return values:
+// the length of that label, 0 at the end of the name
+// -1 if the name is malformed
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_nextDNSLabel(const uint8_t *pkt, uint16_t pktLen,
+															 uint16_t *pOffset, int *pHops)
+{
+	uint16_t o = *pOffset;
+
+	while (o < pktLen)
 	{
-		for (i = 0; i < NumMDNSServiceRecords; i++)
+		uint8_t len = pkt[o];
+
+		if (0xc0 == (len & 0xc0))
 		{
-			if (NULL != this->_serviceRecords[i])
-			{
-				(void)this->_sendMDNSMessage(0, 0, (int)MDNSPacketTypeServiceRecord, i);
-			}
+			if ((uint32_t)o + 1 >= pktLen || ++(*pHops) > MDNS_MAX_NAME_HOPS)
+				return -1;
+
+			o = ((uint16_t)(len & 0x3f) << 8) | pkt[o + 1];
+			continue;
 		}
+		else if ((len & 0xc0) || (uint32_t)o + 1 + len > pktLen)
+			return -1;
+
+		*pOffset = o;
+		return len;
+	}
+
+	return -1;
+}
+
+// return values:
+// 1 if the (possibly compressed) names at offset1 and offset2 are equal (ignoring case)
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_matchDNSNames(const uint8_t *pkt, uint16_t pktLen,
+															  uint16_t offset1, uint16_t offset2)
+{
+	int hops1 = 0, hops2 = 0;
+
+	for (;;)
+	{
+		int len1 = this->_nextDNSLabel(pkt, pktLen, &offset1, &hops1);
+		int len2 = this->_nextDNSLabel(pkt, pktLen, &offset2, &hops2);
+
+		if (len1 < 0 || len1 != len2)
+			return 0;
+		if (0 == len1)
+			return 1;
+
+		if (offset1 != offset2 &&
+			!mdnsLabelEquals(&pkt[offset1 + 1], &pkt[offset2 + 1], len1))
+			return 0;
+
+		offset1 += 1 + len1;
+		offset2 += 1 + len2;
+	}
+}
+
+// copies the first label of the name at offset to label, zero-terminated. if label is NULL,
+// only the length is calculated.
+// return values:
+// the length of the label
+// -1 if the name is malformed, empty, or its first label doesn't fit into labelSize bytes
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_readDNSLabel(const uint8_t *pkt, uint16_t pktLen,
+															 uint16_t offset, uint8_t *label, int labelSize)
+{
+	int hops = 0;
+	int len = this->_nextDNSLabel(pkt, pktLen, &offset, &hops);
+
+	if (len <= 0)
+		return -1;
+
+	if (NULL != label)
+	{
+		if (len >= labelSize)
+			return -1;
+
+		memcpy(label, &pkt[offset + 1], len);
+		label[len] = '\0';
+	}
+
+	return len;
+}
+
+// (re)starts the probe cycle for all names we haven't claimed yet.
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_startProbing(unsigned long delay)
+{
+	// names can only be probed for once we're up and running
+	if (MDNSProbeStateStopped == this->_probeState)
+		return;
+
+	this->_probeState = MDNSProbeStateProbing;
+	this->_probeCount = 0;
+	this->_armTimer(MDNSTimerProbe, millis(), delay);
+
+	// announcing resumes with a fresh burst once probing has finished
+	this->_disarmTimer(MDNSTimerAnnounce);
+	this->_disarmTimer(MDNSTimerRefresh);
+	this->_disarmTimer(MDNSTimerServiceRefresh);
+}
+
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_finishedProbing()
+{
+	int i;
+	uint8_t hostClaimed = !this->_hostProbed;
+
+	this->_probeState = MDNSProbeStateDone;
+	this->_probeConflicts = 0;
+	this->_hostProbed = 1;
+
+	for (i = 0; i < NumMDNSServiceRecords; i++)
+		if (NULL != this->_serviceRecords[i])
+			this->_serviceRecords[i]->probed = 1;
+
+	for (i = 0; i < _numProxyHosts; i++)
+		if (NULL != this->_proxyHosts[i].name)
+			this->_proxyHosts[i].probed = 1;
+
+	this->_startAnnouncing();
+
+	if (hostClaimed && NULL != this->_nameRegisteredCallback)
+	{
+		uint8_t *n = this->_findFirstDotFromRight(this->_bonjourName);
+		*(n - 1) = '\0';
+
+		this->_nameRegisteredCallback((const char *)this->_bonjourName);
+
+		*(n - 1) = '.';
+	}
+}
+
+// (re)starts the announcement burst for all our records.
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_startAnnouncing()
+{
+	this->_announceCount = 0;
+	this->_disarmTimer(MDNSTimerRefresh);
+	this->_disarmTimer(MDNSTimerServiceRefresh);
+	this->_armTimer(MDNSTimerAnnounce, millis(), 0);
+}
 
-		this->_lastAnnounceMillis = now;
-	}
+// return value:
+// the time (in ms) after which we re-announce a record with the given TTL (in seconds)
+template <class UdpClass, class Features>
+unsigned long EthernetBonjour3Class<UdpClass, Features>::_refreshDelay(uint32_t ttl)
+{
+	return (unsigned long)ttl * (10 * MDNS_REFRESH_PERCENT);
 }
 
-// return values:
-// 1 on success
-// 0 otherwise
-template <class UdpClass>
-int EthernetBonjour3Class<UdpClass>::setBonjourName(const char *bonjourName)
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_announce()
 {
-	if (NULL == bonjourName)
-		return 0;
+	// our address(es) and all our services go out in a single packet
+	(void)this->_sendMDNSMessage(0, 0, (int)MDNSPacketTypeAnnounce, 0);
+}
 
-	if (this->_bonjourName != NULL)
-		free(this->_bonjourName);
+// reads the header of the current datagram of udpLen bytes into head, followed by the
+// length and bytes of the first label, if it has one. head has to have room for
+// sizeof(DNSHeader_t) + 1 + MDNS_MAX_LABEL_LEN bytes.
+// return value:
+// the number of bytes in head
+template <class UdpClass, class Features>
+uint16_t EthernetBonjour3Class<UdpClass, Features>::_readPacketHead(uint16_t udpLen, uint8_t *head)
+{
+	uint16_t headLen = 0;
+	int n;
 
-	this->_bonjourName = (uint8_t *)malloc(strlen(bonjourName) + 7);
-	if (NULL == this->_bonjourName)
-		return 0;
+	n = MDNSUdpPacket<UdpClass>::readHead(this->_iface->socket, headLen, head, sizeof(DNSHeader_t));
+	if (n != sizeof(DNSHeader_t) || udpLen <= sizeof(DNSHeader_t))
+		return (n > 0) ? n : 0;
+	headLen = n;
 
-	strcpy((char *)this->_bonjourName, bonjourName);
-	strcpy((char *)this->_bonjourName + strlen(bonjourName), MDNS_TLD);
+	n = MDNSUdpPacket<UdpClass>::readHead(this->_iface->socket, headLen, &head[headLen], 1);
+	if (1 != n)
+		return headLen;
+	headLen++;
 
-	return 1;
+	// compressed or oversized labels are left to the parser
+	uint8_t labelLen = head[headLen - 1];
+	if (labelLen > MDNS_MAX_LABEL_LEN || headLen + labelLen > udpLen)
+		return headLen;
+
+	n = MDNSUdpPacket<UdpClass>::readHead(this->_iface->socket, headLen, &head[headLen], labelLen);
+	if (n > 0)
+		headLen += n;
+
+	return headLen;
 }
 
-// return values:
-// 1 on success
-// 0 otherwise
-template <class UdpClass>
-int EthernetBonjour3Class<UdpClass>::addServiceRecord(const char *name, uint16_t port,
-													  MDNSServiceProtocol_t proto)
+// 1 if label (of len bytes) matches the first label of the dotted name, ignoring case
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_matchFirstLabel(const uint8_t *name, const uint8_t *label,
+																uint8_t len)
 {
-#if defined(__MK20DX128__) || defined(__MK20DX256__)
-	return this->addServiceRecord(name, port, proto, NULL); //works for Teensy 3 (32-bit Arm Cortex)
-#else
-	return this->addServiceRecord(name, port, proto, ""); //works for Teensy 2 (8-bit Atmel)
-#endif
+	if (NULL == name || !mdnsLabelEquals(name, label, len))
+		return 0;
+
+	return ('.' == name[len] || 0 == name[len]);
 }
 
+// decides from the header and first label of a datagram of udpLen bytes whether it's worth
+// reading and parsing. responses are only of interest while we resolve something or own
+// names. a conflicting record for one of them can be anywhere in a response, so we read them
+// all, unless the socket lets us check the record names in place. a query with a single
+// question can only be for us if its first label is ours. others are always read, since any
+// of their questions might be.
 // return values:
-// 1 on success
-// 0 otherwise
-template <class UdpClass>
-int EthernetBonjour3Class<UdpClass>::addServiceRecord(const char *name, uint16_t port,
-													  MDNSServiceProtocol_t proto, const char *textContent)
+// 1 if the datagram should be parsed
+// 0 if it can be dropped
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_wantPacket(uint16_t udpLen, const uint8_t *head,
+														   uint16_t headLen)
 {
-	int i, status = 0;
-	MDNSServiceRecord_t *record = NULL;
-
-	if (NULL != name && 0 != port)
-	{
-		for (i = 0; i < NumMDNSServiceRecords; i++)
-		{
-			if (NULL == this->_serviceRecords[i])
-			{
-				record = (MDNSServiceRecord_t *)malloc(sizeof(MDNSServiceRecord_t));
-				if (NULL != record)
-				{
-					record->name = record->textContent = NULL;
+	int i, k;
 
-					record->name = (uint8_t *)malloc(strlen((char *)name) + 1);
-					memset(record->name, 0, strlen((char *)name) + 1);
-					if (NULL == record->name)
-						goto errorReturn;
+	if (headLen < sizeof(DNSHeader_t) ||
+		MDNS_SERVER_PORT != this->_iface->socket.remotePort() ||
+		DNSOpQuery != ((head[2] >> 3) & 0x0f))
+		return 0;
 
-					if (NULL != textContent)
-					{
-						record->textContent = (uint8_t *)malloc(strlen((char *)textContent) + 1);
-						memset(record->textContent, 0, strlen((char *)textContent) + 1);
-						if (NULL == record->textContent)
-							goto errorReturn;
+	uint8_t isResponse = head[2] >> 7;
+	uint16_t qCnt = __loadBE16(&head[4]);
 
-						strcpy((char *)record->textContent, textContent);
-					}
+	if (MDNSProbeStateProbing == this->_probeState)
+		return 1;
 
-					record->port = port;
-					record->proto = proto;
-					strcpy((char *)record->name, name);
+	if (isResponse)
+	{
+		if (this->_hasQueries() || this->_hasPendingServices())
+			return 1;
 
-					uint8_t *s = this->_findFirstDotFromRight(record->name);
-					record->servName = (uint8_t *)malloc(strlen((char *)s) + 13);
-					memset(record->servName, 0, strlen((char *)s) + 13);
-					if (record->servName)
-					{
-						strcpy((char *)record->servName, (const char *)s);
+		if (MDNSProbeStateStopped == this->_probeState)
+			return 0;
 
-						const uint8_t *srv_type = this->_postfixForProtocol(proto);
-						if (srv_type)
-							strcat((char *)record->servName, (const char *)srv_type);
-					}
+		const uint8_t *pkt = MDNSUdpPacket<UdpClass>::peek(this->_iface->socket);
+		return (NULL == pkt || this->_hasOwnedRecord(pkt, udpLen));
+	}
+	else if (1 != qCnt)
+		return (qCnt > 0);
 
-					this->_serviceRecords[i] = record;
+	// the first label is only complete if it's neither compressed nor the root
+	if (headLen <= sizeof(DNSHeader_t) + 1 ||
+		headLen != sizeof(DNSHeader_t) + 1 + head[sizeof(DNSHeader_t)])
+		return 0;
 
-					status = (MDNSSuccess ==
-							  this->_sendMDNSMessage(0, 0, (int)MDNSPacketTypeServiceRecord, i));
+	const uint8_t *label = &head[sizeof(DNSHeader_t) + 1];
+	uint8_t len = head[sizeof(DNSHeader_t)];
 
-					break;
-				}
-			}
-		}
-	}
+	if (this->_matchFirstLabel(this->_bonjourName, label, len) ||
+		this->_matchFirstLabel((const uint8_t *)DNS_SD_SERVICE, label, len))
+		return 1;
 
-	return status;
+	for (i = 0; i < _numProxyHosts; i++)
+		if (this->_matchFirstLabel(this->_proxyHosts[i].name, label, len))
+			return 1;
 
-errorReturn:
-	if (NULL != record)
+	for (i = 0; i < NumMDNSServiceRecords; i++)
 	{
-		if (NULL != record->name)
-			free(record->name);
-		if (NULL != record->servName)
-			free(record->servName);
-		if (NULL != record->textContent)
-			free(record->textContent);
+		const MDNSServiceRecord_t *record = this->_serviceRecords[i];
 
-		free(record);
+		if (NULL == record)
+			continue;
+
+		if (this->_matchFirstLabel(record->name, label, len) ||
+			this->_matchFirstLabel(record->servName, label, len))
+			return 1;
+
+		for (k = 0; k < NumMDNSServiceSubtypes; k++)
+			if (this->_matchFirstLabel(record->subtypes[k], label, len))
+				return 1;
 	}
 
 	return 0;
 }
 
-template <class UdpClass>
-void EthernetBonjour3Class<UdpClass>::_removeServiceRecord(int idx)
+// return values:
+// 1 if a record of the response pkt is for our host name, a proxy host or one of our service
+//   instances, or if the response is malformed (which is left to the parser)
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_hasOwnedRecord(const uint8_t *pkt, uint16_t pktLen)
 {
-	if (NULL != this->_serviceRecords[idx])
+	DNSRecord_t rr;
+	uint16_t offset = sizeof(DNSHeader_t);
+	uint32_t i, recordCnt = (uint32_t)__loadBE16(&pkt[6]) + __loadBE16(&pkt[8]) + __loadBE16(&pkt[10]);
+	int j;
+
+	if (!this->_skipDNSQuestions(pkt, pktLen, &offset, __loadBE16(&pkt[4])))
+		return 1;
+
+	for (i = 0; i < recordCnt; i++)
 	{
-		(void)this->_sendMDNSMessage(0, 0, (int)MDNSPacketTypeServiceRecordRelease, idx);
+		if (!this->_nextDNSRecord(pkt, pktLen, &offset, &rr))
+			return 1;
 
-		if (NULL != this->_serviceRecords[idx]->textContent)
-			free(this->_serviceRecords[idx]->textContent);
+		if (this->_matchDNSName(pkt, pktLen, rr.nameOffset, this->_bonjourName))
+			return 1;
 
-		if (NULL != this->_serviceRecords[idx]->servName)
-			free(this->_serviceRecords[idx]->servName);
+		for (j = 0; j < _numProxyHosts; j++)
+			if (NULL != this->_proxyHosts[j].name &&
+				this->_matchDNSName(pkt, pktLen, rr.nameOffset, this->_proxyHosts[j].name))
+				return 1;
 
-		free(this->_serviceRecords[idx]->name);
-		free(this->_serviceRecords[idx]);
+		for (j = 0; j < NumMDNSServiceRecords; j++)
+		{
+			const MDNSServiceRecord_t *record = this->_serviceRecords[j];
 
-		this->_serviceRecords[idx] = NULL;
+			if (NULL != record &&
+				this->_matchDNSName(pkt, pktLen, rr.nameOffset, record->name,
+									this->_postfixForProtocol(record->proto)))
+				return 1;
+		}
 	}
-}
 
-template <class UdpClass>
-void EthernetBonjour3Class<UdpClass>::removeServiceRecord(uint16_t port, MDNSServiceProtocol_t proto)
-{
-	this->removeServiceRecord(NULL, port, proto);
+	return 0;
 }
 
-template <class UdpClass>
-void EthernetBonjour3Class<UdpClass>::removeServiceRecord(const char *name, uint16_t port,
-														  MDNSServiceProtocol_t proto)
+// checks the records of a received packet against the names we own or are probing for.
+// while probing, any response record for one of our names means that somebody else already
+// uses it, and a probe for it means we have to break the tie. once we own a name, only
+// response records that disagree with ours are conflicts, and they make us probe again.
+template <class UdpClass, class Features>
+void EthernetBonjour3Class<UdpClass, Features>::_processProbeConflicts(const uint8_t *pkt, uint16_t pktLen,
+																	   uint8_t isResponse, uint16_t qCnt,
+																	   uint16_t aCnt, uint16_t aaCnt,
+																	   uint16_t addCnt)
 {
-	int i;
-	for (i = 0; i < NumMDNSServiceRecords; i++)
-		if (port == this->_serviceRecords[i]->port &&
-			proto == this->_serviceRecords[i]->proto &&
-			(NULL == name || 0 == strcmp((char *)this->_serviceRecords[i]->name, name)))
+	DNSRecord_t rr;
+	uint16_t i, offset = sizeof(DNSHeader_t);
+	int j;
+	uint8_t hostConflict = 0, lostTiebreak = 0;
+	uint8_t serviceConflicts[NumMDNSServiceRecords];
+	uint8_t proxyConflicts[_numProxyHosts > 0 ? _numProxyHosts : 1];
+	int hostTie = 0;
+	uint16_t hostTieType = 0xffff;
+
+	memset(serviceConflicts, 0, sizeof(serviceConflicts));
+	memset(proxyConflicts, 0, sizeof(proxyConflicts));
+
+	if (!this->_skipDNSQuestions(pkt, pktLen, &offset, qCnt))
+		return;
+
+	for (i = 0; i < aCnt + aaCnt + addCnt; i++)
+	{
+		if (!this->_nextDNSRecord(pkt, pktLen, &offset, &rr))
+			return;
+
+		uint16_t nameOffset = rr.nameOffset;
+		uint16_t type = rr.type;
+		uint16_t cls = rr.cls;
+		uint16_t dataOffset = rr.dataOffset;
+		uint16_t dataLen = rr.dataLength;
+
+		// in queries, only the authority section of probes is of interest to us
+		if (!isResponse && (i < aCnt || i >= aCnt + aaCnt))
+			continue;
+
+		if (this->_matchDNSName(pkt, pktLen, nameOffset, this->_bonjourName))
 		{
-			this->_removeServiceRecord(i);
-			break;
+			int cmp = this->_compareProbeRecord(-1, pkt, pktLen, type, cls, dataOffset, dataLen);
+
+			if (isResponse)
+			{
+				if (!this->_hostProbed ||
+					((0x01 == type || (0x1c == type && this->_hasIPv6())) && 0 != cmp))
+					hostConflict = 1;
+			}
+			else if (0 != cmp && type < hostTieType)
+			{
+				// records are compared in the order of their types, so the first one that
+				// differs decides the tie
+				hostTie = cmp;
+				hostTieType = type;
+			}
 		}
-}
 
-template <class UdpClass>
-void EthernetBonjour3Class<UdpClass>::removeAllServiceRecords()
-{
-	int i;
-	for (i = 0; i < NumMDNSServiceRecords; i++)
-		this->_removeServiceRecord(i);
-}
+		// proxy hosts only have an A record, so they're handled like service instances
+		for (j = 0; j < _numProxyHosts; j++)
+		{
+			MDNSProxyHost_t *host = &this->_proxyHosts[j];
 
-template <class UdpClass>
-void EthernetBonjour3Class<UdpClass>::_writeDNSName(const uint8_t *name, uint16_t *pPtr,
-													uint8_t *buf, int bufSize, int zeroTerminate)
-{
-	uint16_t ptr = *pPtr;
-	uint8_t *p1 = (uint8_t *)name, *p2, *p3;
-	int i, c, len;
+			if (NULL == host->name || !this->_matchDNSName(pkt, pktLen, nameOffset, host->name))
+				continue;
 
-	while (*p1)
-	{
-		c = 1;
-		p2 = p1;
-		while (0 != *p2 && '.' != *p2)
-		{
-			p2++;
-			c++;
-		};
+			int cmp = this->_compareProbeRecord(MDNS_HOST_RECORD(j + 1), pkt, pktLen, type, cls,
+												dataOffset, dataLen);
 
-		p3 = buf;
-		i = c;
-		len = bufSize - 1;
-		*p3++ = (uint8_t)--i;
-		while (i-- > 0)
+			if (isResponse)
+			{
+				if (!host->probed || (0x01 == type && 0 != cmp))
+					proxyConflicts[j] = 1;
+			}
+			else if (MDNSProbeStateProbing == this->_probeState && !host->probed && cmp > 0)
+				lostTiebreak = 1;
+		}
+
+		for (j = 0; j < NumMDNSServiceRecords; j++)
 		{
-			*p3++ = *p1++;
+			MDNSServiceRecord_t *record = this->_serviceRecords[j];
 
-			if (--len <= 0)
+			if (NULL == record ||
+				!this->_matchDNSName(pkt, pktLen, nameOffset, record->name,
+									 this->_postfixForProtocol(record->proto)))
+				continue;
+
+			int cmp = this->_compareProbeRecord(j, pkt, pktLen, type, cls, dataOffset, dataLen);
+
+			if (isResponse)
 			{
-				_socket.write((uint8_t *)buf, bufSize);
-				ptr += bufSize;
-				len = bufSize;
-				p3 = buf;
+				if (!record->probed || (0x21 == type && 0 != cmp))
+					serviceConflicts[j] = 1;
 			}
+			else if (MDNSProbeStateProbing == this->_probeState && !record->probed && cmp > 0)
+				lostTiebreak = 1;
 		}
+	}
 
-		while ('.' == *p1)
-			++p1;
+	if (MDNSProbeStateProbing == this->_probeState && !this->_hostProbed && hostTie > 0)
+		lostTiebreak = 1;
 
-		if (len != bufSize)
+	uint8_t conflicts = 0;
+
+	// a name we own goes back to probing first (RFC 6762, section 9). we only pick a new one
+	// if somebody still answers for it then.
+	if (hostConflict)
+	{
+		if (this->_hostProbed)
 		{
-			_socket.write((uint8_t *)buf, bufSize - len);
-			ptr += bufSize - len;
+			this->_hostProbed = 0;
+			this->_startProbing(0);
 		}
+		else
+			(void)this->_renameBonjourName();
+		conflicts++;
 	}
 
-	if (zeroTerminate)
+	for (j = 0; j < NumMDNSServiceRecords; j++)
 	{
-		buf[0] = 0;
-		_socket.write((uint8_t *)buf, 1);
-		ptr += 1;
+		if (serviceConflicts[j])
+		{
+			if (this->_serviceRecords[j]->probed)
+			{
+				this->_serviceRecords[j]->probed = 0;
+				this->_startProbing(0);
+			}
+			else
+				(void)this->_renameServiceRecord(j);
+			conflicts++;
+		}
 	}
 
-	*pPtr = ptr;
+	for (j = 0; j < _numProxyHosts; j++)
+	{
+		if (proxyConflicts[j])
+		{
+			if (this->_proxyHosts[j].probed)
+			{
+				this->_proxyHosts[j].probed = 0;
+				this->_startProbing(0);
+			}
+			else
+				(void)this->_renameProxyHost(j);
+			conflicts++;
+		}
+	}
+
+	if (conflicts)
+	{
+		// if somebody keeps taking our names, don't flood the network with probes
+		this->_probeConflicts += conflicts;
+		if (this->_probeConflicts >= MDNS_PROBE_MAX_CONFLICTS)
+			this->_startProbing(MDNS_PROBE_RATE_LIMIT);
+	}
+	else if (lostTiebreak)
+	{
+		// the other side wins. we try again in a second, by which time it should defend the name.
+		this->_startProbing(MDNS_PROBE_DEFER);
+	}
 }
 
-template <class UdpClass>
-void EthernetBonjour3Class<UdpClass>::_writeMyIPAnswerRecord(uint16_t *pPtr, uint8_t *buf, int bufSize)
+// compares a received record to the one we'd use for a host name (recordIndex
+// MDNS_HOST_RECORD(host), an A record, or an AAAA record if it's ours, we have IPv6 and the
+// received one is AAAA) or for one of our service instances (a SRV record): first the class
+// (without the cache flush bit), then the type, then the rdata bytes.
+// return value:
+// < 0, 0 or > 0 if the received record sorts before, equal to or after ours
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_compareProbeRecord(int recordIndex, const uint8_t *pkt,
+																   uint16_t pktLen, uint16_t type, uint16_t cls,
+																   uint16_t offset, uint16_t dataLen)
 {
-	uint16_t ptr = *pPtr;
+	uint8_t rdata[16];
+	uint16_t rdataLen, i;
+	uint16_t ourType = (recordIndex >= 0) ? 0x21 :
+					   ((0x1c == type && -1 == recordIndex && this->_hasIPv6()) ? 0x1c : 0x01);
 
-	this->_writeDNSName(this->_bonjourName, &ptr, buf, bufSize, 1);
+	if ((cls & 0x7fff) != 0x01)
+		return (int)(cls & 0x7fff) - 0x01;
 
-	buf[0] = 0x00;
-	buf[1] = 0x01;
-	buf[2] = 0x80; // cache flush: true
-	buf[3] = 0x01;
-	_socket.write((uint8_t *)buf, 4);
-	ptr += 4;
+	if (type != ourType)
+		return (int)type - (int)ourType;
 
-	*((uint32_t *)buf) = __htonl(MDNS_RESPONSE_TTL_10);
-	*((uint16_t *)&buf[4]) = __htons(4); // data length
+	if (0x1c == ourType)
+	{
+		memcpy(rdata, this->_iface->localIPv6.raw_address(), 16);
+		rdataLen = 16;
+	}
+	else if (recordIndex < 0)
+	{
+		IPAddress address = (-1 == recordIndex) ? this->_iface->localIP :
+												  this->_proxyHosts[-2 - recordIndex].address;
 
-	uint8_t myIp[4];
-	IPAddress myIpBuf;
-	myIpBuf = _localIP;
-	myIp[0] = myIpBuf[0];
-	myIp[1] = myIpBuf[1];
-	myIp[2] = myIpBuf[2];
-	myIp[3] = myIpBuf[3];
+		for (i = 0; i < 4; i++)
+			rdata[i] = address[i];
+		rdataLen = 4;
+	}
+	else
+	{
+		// priority and weight, followed by the port
+		rdata[0] = rdata[1] = rdata[2] = rdata[3] = 0;
+		rdata[4] = (uint8_t)(this->_serviceRecords[recordIndex]->port >> 8);
+		rdata[5] = (uint8_t)(this->_serviceRecords[recordIndex]->port & 0xff);
+		rdataLen = 6;
+	}
 
-	memcpy(&buf[6], &myIp, 4); // our IP address
+	for (i = 0; i < rdataLen && i < dataLen; i++)
+		if (pkt[offset + i] != rdata[i])
+			return (int)pkt[offset + i] - (int)rdata[i];
 
-	_socket.write((uint8_t *)buf, 10);
-	ptr += 10;
+	if (dataLen < rdataLen)
+		return -1;
 
-	*pPtr = ptr;
+	// the SRV target is a name, which may be compressed
+	if (recordIndex >= 0)
+		return this->_compareDNSName(pkt, pktLen, offset + rdataLen,
+									 this->_hostName(this->_serviceRecords[recordIndex]->host));
+
+	return (int)dataLen - (int)rdataLen;
 }
 
-template <class UdpClass>
-void EthernetBonjour3Class<UdpClass>::_writeServiceRecordName(int recordIndex, uint16_t *pPtr, uint8_t *buf,
-															  int bufSize, int tld)
+// puts the name that follows a host name in case of a conflict at *pName, a new block
+// owned there: "arduino.local" becomes "arduino-2.local", "arduino-2.local" becomes
+// "arduino-3.local" and so on.
+// return values:
+// 1 on success
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_numberedHostName(const uint8_t *name, uint8_t **pName)
 {
-	uint16_t ptr = *pPtr;
+	int len = strlen((const char *)name) - strlen(MDNS_TLD);
+	int base = len;
+	unsigned long num = 2;
+	char digits[11];
+	int d = 0;
 
-	uint8_t *name = tld ? this->_serviceRecords[recordIndex]->servName : this->_serviceRecords[recordIndex]->name;
+	int p = len;
+	while (p > 0 && name[p - 1] >= '0' && name[p - 1] <= '9')
+		p--;
 
-	this->_writeDNSName(name, &ptr, buf, bufSize, tld);
+	if (p < len && p > 1 && '-' == name[p - 1])
+	{
+		num = strtoul((const char *)&name[p], NULL, 10) + 1;
+		base = p - 1;
+	}
 
-	if (0 == tld)
+	do
 	{
-		const uint8_t *srv_type =
-			this->_postfixForProtocol(this->_serviceRecords[recordIndex]->proto);
+		digits[d++] = '0' + (num % 10);
+		num /= 10;
+	} while (num > 0 && d < (int)sizeof(digits));
 
-		if (NULL != srv_type)
-		{
-			srv_type++; // eat the dot at the beginning
-			this->_writeDNSName(srv_type, &ptr, buf, bufSize, 1);
-		}
-	}
+	// the label with its "-N" has to stay within MDNS_MAX_LABEL_LEN
+	base = mdnsTrimLabel(name, base, MDNS_MAX_LABEL_LEN - 1 - d);
 
-	*pPtr = ptr;
+	uint8_t *n;
+	if (NULL == this->_alloc(base + d + 2 + strlen(MDNS_TLD), pName))
+		return 0;
+
+	n = *pName;
+	memcpy(n, name, base);
+	n[base] = '-';
+	for (p = 0; p < d; p++)
+		n[base + 1 + p] = digits[d - 1 - p];
+	strcpy((char *)&n[base + 1 + d], MDNS_TLD);
+
+	return 1;
 }
 
-template <class UdpClass>
-void EthernetBonjour3Class<UdpClass>::_writeServiceRecordPTR(int recordIndex, uint16_t *pPtr, uint8_t *buf,
-															 int bufSize, uint32_t ttl)
+// picks a new host name after a conflict, see _numberedHostName(). probing restarts for the
+// new name.
+// return values:
+// 1 on success
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_renameBonjourName()
 {
-	uint16_t ptr = *pPtr;
+	uint8_t *n;
 
-	this->_writeServiceRecordName(recordIndex, &ptr, buf, bufSize, 1);
+	if (!this->_numberedHostName(this->_bonjourName, &n))
+		return 0;
 
-	buf[0] = 0x00;
-	buf[1] = 0x0c; // PTR record
-	buf[2] = 0x00; // no cache flush
-	buf[3] = 0x01; // class IN
+	this->_free(this->_bonjourName);
+	this->_bonjourName = n;
+	this->_setOwner(n, &this->_bonjourName);
+	this->_hostProbed = 0;
 
-	// ttl
-	*((uint32_t *)&buf[4]) = __htonl(ttl);
+	this->_startProbing(0);
 
-	// data length (+13 = "._tcp.local" or "._udp.local" + 1  byte zero termination)
-	*((uint16_t *)&buf[8]) =
-		__htons(strlen((char *)this->_serviceRecords[recordIndex]->name) + 13);
+	return 1;
+}
 
-	_socket.write((uint8_t *)buf, 10);
-	ptr += 10;
+// picks a new service instance name after a conflict: "Web._http" becomes "Web (2)._http",
+// "Web (2)._http" becomes "Web (3)._http" and so on. probing restarts for the new name.
+// return values:
+// 1 on success
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_renameServiceRecord(int idx)
+{
+	MDNSServiceRecord_t *record = this->_serviceRecords[idx];
+	uint8_t *type = this->_findFirstDotFromRight(record->name) - 1;
+	int len = type - record->name;
+	int base = len;
+	unsigned long num = 2;
+	char digits[11];
+	int d = 0;
+
+	// do we already have a " (N)" postfix?
+	if (len > 4 && ')' == record->name[len - 1])
+	{
+		int p = len - 1;
+		while (p > 0 && record->name[p - 1] >= '0' && record->name[p - 1] <= '9')
+			p--;
 
-	this->_writeServiceRecordName(recordIndex, &ptr, buf, bufSize, 0);
+		if (p < len - 1 && p > 2 && '(' == record->name[p - 1] && ' ' == record->name[p - 2])
+		{
+			num = strtoul((const char *)&record->name[p], NULL, 10) + 1;
+			base = p - 2;
+		}
+	}
 
-	*pPtr = ptr;
-}
+	do
+	{
+		digits[d++] = '0' + (num % 10);
+		num /= 10;
+	} while (num > 0 && d < (int)sizeof(digits));
 
-template <class UdpClass>
-uint8_t *EthernetBonjour3Class<UdpClass>::_findFirstDotFromRight(const uint8_t *str)
-{
-	const uint8_t *p = str + strlen((char *)str);
-	while (p > str && '.' != *p--)
-		;
-	return (uint8_t *)&p[2];
-}
+	// the label with its " (N)" has to stay within MDNS_MAX_LABEL_LEN
+	base = mdnsTrimLabel(record->name, base, MDNS_MAX_LABEL_LEN - 3 - d);
 
-template <class UdpClass>
-int EthernetBonjour3Class<UdpClass>::_matchStringPart(const uint8_t **pCmpStr, int *pCmpLen, const uint8_t *buf,
-													  int dataLen)
-{
-	int matches = 1;
+	uint8_t *n;
+	if (NULL == this->_alloc(base + d + 3 + strlen((char *)type) + 1, &n))
+		return 0;
 
-	if (*pCmpLen >= dataLen)
-		matches &= (0 == memcmp(*pCmpStr, buf, dataLen));
-	else
-		matches = 0;
+	memcpy(n, record->name, base);
+	n[base] = ' ';
+	n[base + 1] = '(';
+	for (int p = 0; p < d; p++)
+		n[base + 2 + p] = digits[d - 1 - p];
+	n[base + 2 + d] = ')';
+	strcpy((char *)&n[base + 3 + d], (const char *)type);
 
-	*pCmpStr += dataLen;
-	*pCmpLen -= dataLen;
-	if ('.' == **pCmpStr)
-		(*pCmpStr)++, (*pCmpLen)--;
+	if (!(record->staticParts & MDNS_STATIC_NAME))
+		this->_free(record->name);
 
-	return matches;
-}
+	record->name = n;
+	this->_setOwner(n, &record->name);
+	record->staticParts &= ~MDNS_STATIC_NAME;
+	record->probed = 0;
 
-template <class UdpClass>
-const uint8_t *EthernetBonjour3Class<UdpClass>::_postfixForProtocol(MDNSServiceProtocol_t proto)
-{
-	const uint8_t *srv_type = NULL;
-	switch (proto)
-	{
-	case MDNSServiceTCP:
-		srv_type = (uint8_t *)"._tcp" MDNS_TLD;
-		break;
-	case MDNSServiceUDP:
-		srv_type = (uint8_t *)"._udp" MDNS_TLD;
-		break;
-	}
+	this->_startProbing(0);
 
-	return srv_type;
+	return 1;
 }
 
-template <class UdpClass>
-void EthernetBonjour3Class<UdpClass>::_finishedResolvingName(char *name, const byte ipAddr[4])
+// picks a new name for a proxy host after a conflict, see _numberedHostName(). the service
+// records that point to it follow along. probing restarts for the new name.
+// return values:
+// 1 on success
+// 0 otherwise
+template <class UdpClass, class Features>
+int EthernetBonjour3Class<UdpClass, Features>::_renameProxyHost(int idx)
 {
-	if (NULL != this->_nameFoundCallback)
-	{
-		if (NULL != name)
-		{
-			uint8_t *n = this->_findFirstDotFromRight((const uint8_t *)name);
-			*(n - 1) = '\0';
-		}
+	MDNSProxyHost_t *host = &this->_proxyHosts[idx];
+	uint8_t *n;
 
-		this->_nameFoundCallback((const char *)name, ipAddr);
-	}
+	if (!this->_numberedHostName(host->name, &n))
+		return 0;
+
+	this->_free(host->name);
+	host->name = n;
+	this->_setOwner(n, &host->name);
+	host->probed = 0;
 
-	free(this->_resolveNames[0]);
-	this->_resolveNames[0] = NULL;
+	this->_startProbing(0);
+
+	return 1;
 }
 
 END_MDNS_NAMESPACE
\ No newline at end of file
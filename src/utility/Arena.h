@@ -0,0 +1,185 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "../EthernetBonjour3_Namespace.h"
+
+BEGIN_MDNS_NAMESPACE
+
+// a compacting allocator on a fixed buffer, for the names, TXT data and service records the
+// library keeps (see EthernetBonjour3Class::setArena()). it never fragments for good: every
+// block remembers its owner, the place where the pointer to it is stored, so compact() can
+// slide all blocks to the start of the buffer and fix their owners up. owners may be inside
+// other blocks, like the name pointer of a service record. since compact() moves things,
+// nobody may hold other pointers into the arena while it runs.
+class MDNSArena
+{
+private:
+   typedef struct _MDNSArenaBlock_t {
+      uint16_t size;   // of the data, rounded up to the alignment
+      void*    owner;  // where the pointer to the data is stored, NULL for a free block
+   } MDNSArenaBlock_t;
+
+   enum { _align = sizeof(void*) };
+
+   uint8_t*  _buffer;
+   uint16_t  _size;
+   uint16_t  _top;   // offset of the first byte after the last block
+   uint16_t  _used;  // bytes in live blocks, headers included
+
+   static uint16_t _round(uint16_t size)
+   {
+      return (size + _align - 1) & ~(uint16_t)(_align - 1);
+   }
+
+   MDNSArenaBlock_t* _block(uint16_t offset)
+   {
+      return (MDNSArenaBlock_t*)&this->_buffer[offset];
+   }
+
+   static void _store(void* owner, void* p)
+   {
+      memcpy(owner, &p, sizeof(void*));
+   }
+
+public:
+   MDNSArena(uint8_t* buffer, uint16_t size)
+   {
+      uint16_t skip = (_align - ((uintptr_t)buffer % _align)) % _align;
+
+      this->_buffer = buffer + skip;
+      this->_size = (size > skip) ? ((size - skip) & ~(uint16_t)(_align - 1)) : 0;
+      this->_top = 0;
+      this->_used = 0;
+   }
+
+   // return value:
+   // a block of size bytes, whose address is also stored at owner, or NULL if there is no
+   // room left after the last block. compact() first to use the space of freed blocks.
+   void* alloc(uint16_t size, void* owner)
+   {
+      if (NULL == owner || size > this->_size)
+         return NULL;
+
+      uint16_t need = sizeof(MDNSArenaBlock_t) + _round(size);
+      if (need > this->_size - this->_top)
+         return NULL;
+
+      MDNSArenaBlock_t* block = this->_block(this->_top);
+      block->size = _round(size);
+      block->owner = owner;
+
+      this->_top += need;
+      this->_used += need;
+
+      void* p = (void*)(block + 1);
+      _store(owner, p);
+
+      return p;
+   }
+
+   // p has to be a block of this arena, or NULL. the owner isn't touched.
+   void free(void* p)
+   {
+      if (NULL == p)
+         return;
+
+      MDNSArenaBlock_t* block = (MDNSArenaBlock_t*)p - 1;
+      uint16_t need = sizeof(MDNSArenaBlock_t) + block->size;
+
+      block->owner = NULL;
+      this->_used -= need;
+
+      // the last block can be given back right away
+      if ((uint8_t*)p + block->size == &this->_buffer[this->_top])
+         this->_top -= need;
+   }
+
+   // tells the arena that the pointer to block p is now stored at owner
+   void setOwner(void* p, void* owner)
+   {
+      if (NULL != p)
+         ((MDNSArenaBlock_t*)p - 1)->owner = owner;
+   }
+
+   // return value:
+   // 1 if p points into the arena
+   int contains(const void* p)
+   {
+      return (const uint8_t*)p >= this->_buffer && (const uint8_t*)p < &this->_buffer[this->_size];
+   }
+
+   // slides all live blocks to the start of the buffer, so that the free space is in one
+   // piece again, and updates their owners
+   void compact()
+   {
+      uint16_t from = 0, to = 0;
+
+      if (this->_top == this->_used)
+         return;
+
+      while (from < this->_top)
+      {
+         MDNSArenaBlock_t* block = this->_block(from);
+         uint16_t need = sizeof(MDNSArenaBlock_t) + block->size;
+
+         if (NULL != block->owner)
+         {
+            if (from != to)
+            {
+               uint8_t* oldData = (uint8_t*)(block + 1);
+               uint16_t delta = from - to;
+
+               memmove(&this->_buffer[to], block, need);
+               block = this->_block(to);
+               _store(block->owner, (void*)(block + 1));
+
+               // owners inside the block we just moved moved along with it
+               for (uint16_t o = 0; o < this->_top; )
+               {
+                  MDNSArenaBlock_t* other = this->_block(o);
+                  uint8_t* owner = (uint8_t*)other->owner;
+
+                  if (owner >= oldData && owner < oldData + block->size)
+                     other->owner = owner - delta;
+
+                  // blocks up to this one are packed already, the others are still in place
+                  o += sizeof(MDNSArenaBlock_t) + other->size;
+                  if (o == to + need)
+                     o = from + need;
+               }
+            }
+
+            to += need;
+         }
+
+         from += need;
+      }
+
+      this->_top = to;
+   }
+
+   uint16_t size() { return this->_size; }
+
+   // return value:
+   // the bytes in use, including the bookkeeping of the blocks
+   uint16_t used() { return this->_used; }
+
+   // return value:
+   // the bytes left for allocations right now, without compacting
+   uint16_t available() { return this->_size - this->_top; }
+};
+
+// an arena that brings its own buffer of Size bytes
+template <uint16_t Size>
+class MDNSStaticArena : public MDNSArena
+{
+private:
+   void* _storage[(Size + sizeof(void*) - 1) / sizeof(void*)];
+
+public:
+   MDNSStaticArena() : MDNSArena((uint8_t*)this->_storage, sizeof(this->_storage)) {}
+};
+
+END_MDNS_NAMESPACE
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "../EthernetBonjour3_Namespace.h"
+
+BEGIN_MDNS_NAMESPACE
+
+// logging policies: the library reports what it does through the static functions of the
+// Log class of its feature policy (see below). MDNSNoLog compiles to nothing. to log
+// somewhere else, write a class with the same functions.
+struct MDNSNoLog
+{
+   static void startQuery(const char*) {}
+   static void sending(uint32_t, uint32_t, int, int) {}
+   static void received(uint16_t, uint8_t, uint8_t) {}
+};
+
+#if ARDUINO
+// prints the debug trace of old versions of the library to Serial
+struct MDNSSerialLog
+{
+   static void startQuery(const char* name)
+   {
+      Serial.print("_initQuery ");
+      Serial.println(name);
+   }
+
+   static void sending(uint32_t peerAddress, uint32_t xid, int type, int serviceRecord)
+   {
+      Serial.print("_sendMDNSMessage ");
+      Serial.print("peerAddress:");
+      Serial.print(peerAddress);
+      Serial.print(" xid:");
+      Serial.print(xid);
+      Serial.print(" type:");
+      Serial.print(type);
+      Serial.print(" serviceRecord:");
+      Serial.println(serviceRecord);
+   }
+
+   // len is the size of the UDP payload, like rxBytes in the statistics
+   static void received(uint16_t len, uint8_t isResponse, uint8_t opCode)
+   {
+      Serial.print("_processMDNSQuery");
+      Serial.print(" len: ");
+      Serial.print(len);
+      Serial.print(" queryResponse: ");
+      Serial.print(isResponse);
+      Serial.print(" opCode: ");
+      Serial.print(opCode);
+      Serial.println("");
+   }
+};
+#endif
+
+// compile time feature selection, the second template parameter of EthernetBonjour3Class.
+// the responder is always there; the name resolver, the service browser (with its table of
+// services waiting for an address), AAAA answers and the hosts we answer for on behalf of
+// others (the proxy) can be left out, which drops their code and state from the build. Log is
+// a logging policy, see above.
+template <int Resolver = 1, int Browser = 1, int IPv6 = 1, class Log = MDNSNoLog, int Proxy = 1>
+struct MDNSFeatures
+{
+   enum { resolver = Resolver, browser = Browser, ipv6 = IPv6, proxy = Proxy };
+   typedef Log LogPolicy;
+};
+
+typedef MDNSFeatures<>                          MDNSAllFeatures;
+typedef MDNSFeatures<0, 0>                      MDNSResponderFeatures; // only advertises, never looks up
+typedef MDNSFeatures<0, 0, 0, MDNSNoLog, 0>     MDNSMinimalFeatures;   // like above, IPv4 only, no proxy
+
+END_MDNS_NAMESPACE
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "../EthernetBonjour3_Namespace.h"
+
+BEGIN_MDNS_NAMESPACE
+
+// a plain 128 bit IPv6 address, in network byte order. the WIZnet chips don't do IPv6, so
+// there's no such type in the Arduino Ethernet libraries.
+class IPv6Address
+{
+private:
+   uint8_t _address[16];
+
+public:
+   IPv6Address()
+   {
+      memset(this->_address, 0, sizeof(this->_address));
+   }
+
+   // explicit, so a 4 byte array never silently turns into an IPv6 address
+   explicit IPv6Address(const uint8_t* address)
+   {
+      memcpy(this->_address, address, sizeof(this->_address));
+   }
+
+   uint8_t operator[](int index) const { return this->_address[index]; }
+   uint8_t& operator[](int index) { return this->_address[index]; }
+
+   const uint8_t* raw_address() const { return this->_address; }
+
+   int isUnspecified() const
+   {
+      for (int i = 0; i < 16; i++)
+         if (0 != this->_address[i])
+            return 0;
+
+      return 1;
+   }
+
+   bool operator==(const IPv6Address& other) const
+   {
+      return 0 == memcmp(this->_address, other._address, sizeof(this->_address));
+   }
+
+   bool operator!=(const IPv6Address& other) const
+   {
+      return !(*this == other);
+   }
+};
+
+END_MDNS_NAMESPACE
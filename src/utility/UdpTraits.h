@@ -0,0 +1,139 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../EthernetBonjour3_Namespace.h"
+
+#include "IPv6Address.h"
+
+BEGIN_MDNS_NAMESPACE
+
+// compile time detection of optional UdpClass capabilities. this has to work with the
+// AVR toolchain, which has no <type_traits>, so we roll our own SFINAE tests.
+template <class UdpClass>
+struct MDNSUdpTraits
+{
+private:
+   // an IPv6-capable UdpClass offers beginMulticast() and beginPacket() for IPv6Address
+   template <class U>
+   static char _testIPv6(decltype(((U*)0)->beginMulticast(*(const IPv6Address*)0, (uint16_t)0))*);
+   template <class U>
+   static long _testIPv6(...);
+
+   // a UdpClass that keeps received datagrams in memory can offer peekPacket(), which
+   // returns the datagram of the last parsePacket() (or NULL), valid until the next one
+   template <class U>
+   static char _testPeek(decltype(((U*)0)->peekPacket())*);
+   template <class U>
+   static long _testPeek(...);
+
+public:
+   enum { hasIPv6 = (sizeof(_testIPv6<UdpClass>(0)) == sizeof(char)) };
+   enum { hasPeekPacket = (sizeof(_testPeek<UdpClass>(0)) == sizeof(char)) };
+};
+
+// forwards IPv6 calls to UdpClass if it can handle them, and fails them otherwise.
+template <class UdpClass, int hasIPv6 = MDNSUdpTraits<UdpClass>::hasIPv6>
+struct MDNSUdpIPv6
+{
+   static int beginMulticast(UdpClass&, const IPv6Address&, uint16_t) { return 0; }
+   static int beginPacket(UdpClass&, const IPv6Address&, uint16_t) { return 0; }
+};
+
+template <class UdpClass>
+struct MDNSUdpIPv6<UdpClass, 1>
+{
+   static int beginMulticast(UdpClass& socket, const IPv6Address& group, uint16_t port)
+   {
+      return socket.beginMulticast(group, port);
+   }
+
+   static int beginPacket(UdpClass& socket, const IPv6Address& address, uint16_t port)
+   {
+      return socket.beginPacket(address, port);
+   }
+};
+
+// gives the parser the bytes of a received datagram of len bytes: a view into the socket's
+// own buffer if it has peekPacket(), or a heap copy in *pCopy, which release() frees.
+// readHead() copies n bytes at offset to buf, so we can look at the start of a datagram
+// before deciding to acquire() it. without peekPacket(), this consumes the bytes, so the
+// offsets have to follow each other, and acquire() has to be handed everything read so far.
+// peek() returns the whole datagram in place without consuming it, or NULL if it can't.
+template <class UdpClass, int hasPeekPacket = MDNSUdpTraits<UdpClass>::hasPeekPacket>
+struct MDNSUdpPacket
+{
+   static const uint8_t* peek(UdpClass&)
+   {
+      return NULL;
+   }
+
+   static int readHead(UdpClass& socket, uint16_t, uint8_t* buf, uint16_t n)
+   {
+      return socket.read(buf, n);
+   }
+
+   static const uint8_t* acquire(UdpClass& socket, uint16_t len, uint8_t** pCopy,
+                                 const uint8_t* head = NULL, uint16_t headLen = 0)
+   {
+      *pCopy = (uint8_t*)malloc(len);
+      if (NULL != *pCopy)
+      {
+         if (headLen > 0)
+            memcpy(*pCopy, head, headLen);
+         if (len > headLen)
+            socket.read(*pCopy + headLen, len - headLen);
+      }
+
+      return *pCopy;
+   }
+
+   static void release(UdpClass&, uint8_t* copy)
+   {
+      if (NULL != copy)
+         free(copy);
+   }
+};
+
+template <class UdpClass>
+struct MDNSUdpPacket<UdpClass, 1>
+{
+   static const uint8_t* peek(UdpClass& socket)
+   {
+      return (const uint8_t*)socket.peekPacket();
+   }
+
+   static int readHead(UdpClass& socket, uint16_t offset, uint8_t* buf, uint16_t n)
+   {
+      const uint8_t* view = (const uint8_t*)socket.peekPacket();
+      if (NULL != view)
+      {
+         memcpy(buf, view + offset, n);
+         return n;
+      }
+
+      return MDNSUdpPacket<UdpClass, 0>::readHead(socket, offset, buf, n);
+   }
+
+   static const uint8_t* acquire(UdpClass& socket, uint16_t len, uint8_t** pCopy,
+                                 const uint8_t* head = NULL, uint16_t headLen = 0)
+   {
+      const uint8_t* view = (const uint8_t*)socket.peekPacket();
+      if (NULL != view)
+      {
+         *pCopy = NULL;
+         return view;
+      }
+
+      return MDNSUdpPacket<UdpClass, 0>::acquire(socket, len, pCopy, head, headLen);
+   }
+
+   static void release(UdpClass& socket, uint8_t* copy)
+   {
+      MDNSUdpPacket<UdpClass, 0>::release(socket, copy);
+   }
+};
+
+END_MDNS_NAMESPACE
@@ -76,3 +76,12 @@
 #define __htonll(x) ((uint64_t)(x))
 #endif
 #endif /* __machine_host_to_from_network_defined */
+
+#include <stdint.h>
+
+// big-endian load from a byte pointer. packet fields aren't aligned, so we can't just
+// cast the pointer and byte-swap.
+static inline uint16_t __loadBE16(const uint8_t *p)
+{
+    return (uint16_t)(((uint16_t)p[0] << 8) | p[1]);
+}